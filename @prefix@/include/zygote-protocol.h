@@ -0,0 +1,207 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Wire protocol between grow and the zygote process
+ *
+ * A grow request is a single frame sent with one sendmsg(2), carrying the
+ * client's stdin, stdout and stderr as SCM_RIGHTS ancillary data in that
+ * order, followed by the control and status pipes of a fuzzer with
+ * forkserver=1.  The frame starts with a zygote_frame_t header, followed by typed
+ * sections, each a zygote_section_t header and its payload:
+ *
+ *   ZYGOTE_SECTION_CODE    NUL-terminated absolute path to the shared object
+ *   ZYGOTE_SECTION_ENV     NUL-terminated "NAME=value" strings
+ *   ZYGOTE_SECTION_CWD     NUL-terminated working directory
+ *   ZYGOTE_SECTION_ARGV    NUL-terminated arguments following the code path
+ *   ZYGOTE_SECTION_OPTION  NUL-terminated "name=value" request options
+ *
+ * The zygote answers with a sequence of records, each a zygote_reply_t header
+ * and its payload, tagged with the id of the frame they answer:
+ *
+ *   ZYGOTE_REPLY_PID       int pid, int caps of the process that will run
+ *   ZYGOTE_REPLY_REPORT    NUL-terminated text for grow to show on its stderr
+ *   ZYGOTE_REPLY_TIMING    long long timestamps indexed by ZYGOTE_TIME_*
+ *   ZYGOTE_REPLY_RUSAGE    long long resource usage indexed by ZYGOTE_RUSAGE_*
+ *   ZYGOTE_REPLY_BUSY      int children running, int requests waiting, when
+ *                          the zygote turns the request away
+ *   ZYGOTE_REPLY_CGROUP    long long usage of the child's own cgroup, indexed
+ *                          by ZYGOTE_CGROUP_*
+ *   ZYGOTE_REPLY_EXIT      int exit status, ending the replies to the frame
+ *
+ * Both sides ignore sections, options and records they don't understand, and
+ * advertise what they do understand as ZYGOTE_CAP_* bits: the client in the
+ * frame header, and the zygote in its ZYGOTE_REPLY_PID record.  The zygote
+ * still serves clients of the first releases speaking ZYGOTE_VERSION_LEGACY,
+ * where every number and string is written separately, the code path among
+ * the arguments after the environment and the working directory, and the
+ * zygote answers with the pid and the exit status only.  Their requests are
+ * always served by a child forked from the zygote itself, or a warm one.
+ *
+ * Options the zygote understands:
+ *
+ *   dirty=1                report the pages copied from the zygote by run()
+ *   dirty=2                also report writes to regions given to zygote_register()
+ *   timing=1               send ZYGOTE_REPLY_TIMING and ZYGOTE_REPLY_RUSAGE
+ *   priority=CLASS         interactive, normal or batch, no higher than the
+ *                          zygote grants the peer
+ *   thread=1               run run_thread() on a thread of the executor, even
+ *                          if the zygote can't tell the code defines it, for
+ *                          clients with ZYGOTE_CAP_THREAD only
+ *   thread=0               fork a child even if the code defines run_thread()
+ *   worker=0               fork a child even if the zygote keeps workers
+ *   forkserver=1           serve the fork-server protocol of AFL on the pipes
+ *                          passed after stdio, forking a child for every input
+ *                          from the one that has loaded the code, and send
+ *                          ZYGOTE_REPLY_EXIT once the fuzzer is gone
+ *   shards=N               run run() in N children forked from the one that
+ *                          has loaded the code, followed by reduce(), if any,
+ *                          each counting against ZYGOTE_MAX_IN_FLIGHT, and no
+ *                          more of them than it or 4096
+ *   reduction=BYTES        size of the buffer the shards share, 1 MiB if not
+ *                          given, and 1 GiB at most
+ *
+ * A request must arrive whole within 5 seconds of the connection, or of its
+ * first byte on a pipelined one, or the zygote closes the connection.
+ *
+ * A zygote too busy to even queue the request answers with ZYGOTE_REPLY_BUSY,
+ * and ZYGOTE_REPLY_EXIT with ZYGOTE_EXIT_BUSY, so clients can back off.
+ *
+ * With timing=1, the process reaping the child sends the last timestamp, the
+ * resource usage, and that of its cgroup if any after ZYGOTE_REPLY_EXIT, and then closes its end of the
+ * connection, so a client that sees ZYGOTE_CAP_TIMING should read till EOF.
+ *
+ * A client setting ZYGOTE_CAP_PIPELINE in a frame header may send more frames
+ * on the same connection, each with ids of its own and descriptors of its
+ * own, without waiting for the replies.  It should send the first frame and
+ * pipeline the rest only once the ZYGOTE_REPLY_PID answering it shows the
+ * zygote sets ZYGOTE_CAP_PIPELINE too, or else use a connection per frame.
+ * The records of every frame come back as they happen, interleaved, with each
+ * record sent whole.  A frame ends with ZYGOTE_REPLY_EXIT, as timing=1 is
+ * ignored for pipelined frames.  Frames are read no faster than the zygote
+ * can queue them, and replies wait for the client to read them, so a client
+ * must keep reading while it sends, and shuts down its writing end after the
+ * last frame.
+ *
+ * All numbers are native int, or long long where noted, as both ends always
+ * share the same host.
+ */
+
+#ifndef _ZYGOTE_PROTOCOL_H
+#define _ZYGOTE_PROTOCOL_H
+
+#include "zygote.h"
+
+#define ZYGOTE_VERSION_LEGACY   0x00000002
+
+// control pipe of a fuzzer to its fork server, followed by the status pipe,
+// as AFL passes them
+#define ZYGOTE_FORKSRV_FD 198
+
+// upper bound on the size of a frame a zygote will accept
+#define ZYGOTE_FRAME_MAX (64 << 20)
+
+typedef struct {
+    int version;    // ZYGOTE_VERSION
+    int length;     // of the sections following this header
+    int id;         // echoed in every reply record to this frame
+    int caps;       // ZYGOTE_CAP_* the client understands
+} zygote_frame_t;
+
+typedef struct {
+    int type;       // ZYGOTE_SECTION_*
+    int length;     // of the payload following this header
+} zygote_section_t;
+
+typedef struct {
+    int type;       // ZYGOTE_REPLY_*
+    int id;         // of the frame being answered
+    int length;     // of the payload following this header
+} zygote_reply_t;
+
+enum {
+    ZYGOTE_SECTION_CODE = 1,
+    ZYGOTE_SECTION_ENV,
+    ZYGOTE_SECTION_CWD,
+    ZYGOTE_SECTION_ARGV,
+    ZYGOTE_SECTION_OPTION,
+};
+
+enum {
+    ZYGOTE_REPLY_PID = 1,
+    ZYGOTE_REPLY_EXIT,
+    ZYGOTE_REPLY_REPORT,
+    ZYGOTE_REPLY_TIMING,
+    ZYGOTE_REPLY_RUSAGE,
+    ZYGOTE_REPLY_BUSY,
+    ZYGOTE_REPLY_CGROUP,
+};
+
+// exit status of a request turned away, EX_TEMPFAIL of sysexits.h
+#define ZYGOTE_EXIT_BUSY 75
+
+// points in the life of a request, in nanoseconds of CLOCK_MONOTONIC, or 0
+// where unknown, e.g., no dlopen() by children of a sub-zygote
+enum {
+    ZYGOTE_TIME_CONNECT,    // grow starts connecting
+    ZYGOTE_TIME_SENT,       // grow has sent the request
+    ZYGOTE_TIME_ACCEPT,     // the zygote accepted the connection
+    ZYGOTE_TIME_RECEIVE,    // the zygote received the whole request
+    ZYGOTE_TIME_DISPATCH,   // the zygote forks or hands off the request
+    ZYGOTE_TIME_START,      // the child starts serving the request
+    ZYGOTE_TIME_LOAD,       // the child has dlopen'ed the code and found run()
+    ZYGOTE_TIME_RUN,        // run() is called
+    ZYGOTE_TIME_RETURN,     // run() has returned
+    ZYGOTE_TIME_EXIT,       // the child exits
+    ZYGOTE_TIME_REAP,       // the child's exit status is collected
+    ZYGOTE_TIMES
+};
+
+// resource usage of the child, as collected by wait4(2)
+enum {
+    ZYGOTE_RUSAGE_UTIME,    // user CPU time in microseconds
+    ZYGOTE_RUSAGE_STIME,    // system CPU time in microseconds
+    ZYGOTE_RUSAGE_MAXRSS,   // maximum resident set size in kilobytes
+    ZYGOTE_RUSAGE_MINFLT,   // page faults served without I/O, e.g., copy-on-write
+    ZYGOTE_RUSAGE_MAJFLT,   // page faults that needed I/O
+    ZYGOTE_RUSAGE_NVCSW,    // voluntary context switches
+    ZYGOTE_RUSAGE_NIVCSW,   // involuntary context switches
+    ZYGOTE_RUSAGES
+};
+
+// usage of the cgroup a child had to itself, as the kernel accounts it
+enum {
+    ZYGOTE_CGROUP_USAGE_USEC,       // CPU time in microseconds
+    ZYGOTE_CGROUP_USER_USEC,        // of which in user mode
+    ZYGOTE_CGROUP_SYSTEM_USEC,      // of which in kernel mode
+    ZYGOTE_CGROUP_THROTTLED_USEC,   // time held back by cpu.max
+    ZYGOTE_CGROUP_MEMORY_PEAK,      // bytes of memory charged at most
+    ZYGOTE_CGROUP_IO_RBYTES,        // bytes read from block devices
+    ZYGOTE_CGROUP_IO_WBYTES,        // bytes written to block devices
+    ZYGOTE_CGROUP_STATS
+};
+
+// capabilities negotiated between grow and the zygote
+#define ZYGOTE_CAP_OPTIONS      0x00000001  // understands ZYGOTE_SECTION_OPTION
+#define ZYGOTE_CAP_TIMING       0x00000002  // reaps with ZYGOTE_REPLY_RUSAGE on timing=1
+#define ZYGOTE_CAP_THREAD       0x00000004  // from the client, that it won't signal
+                                            // a pid sent with it, from the zygote,
+                                            // that the pid serves other requests too
+#define ZYGOTE_CAP_PIPELINE     0x00000008  // from the client, that more frames may
+                                            // follow on the connection, from the
+                                            // zygote, that it reads them
+
+#endif /* _ZYGOTE_PROTOCOL_H */
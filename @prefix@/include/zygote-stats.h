@@ -0,0 +1,114 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Live statistics of a zygote process
+ *
+ * The zygote keeps its counters in a file next to its socket, named after it
+ * with ZYGOTE_STATS_SUFFIX appended, which it maps shared and updates with
+ * plain stores as it goes.  Any process may map the file read-only and take
+ * consistent snapshots with zygote_stats_read() without ever blocking or
+ * slowing down the zygote: the zygote makes seq odd while it updates the
+ * page, and even again when done, so a reader simply retries until it copies
+ * the page with the same even seq before and after.
+ *
+ * With replicas of the zygote sharing its socket, the file has a page for
+ * each of them, as many as the first one says, which all readers should add
+ * up.  A page is zeroed until its replica starts.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#ifndef _ZYGOTE_STATS_H
+#define _ZYGOTE_STATS_H
+
+#include <string.h>
+
+#define ZYGOTE_STATS_SUFFIX     ".stats"
+#define ZYGOTE_STATS_MAGIC      0x5a594753
+#define ZYGOTE_STATS_VERSION    7
+
+// histograms have a bucket for every power of two microseconds
+#define ZYGOTE_STATS_BUCKETS    32
+// shared objects counted separately
+#define ZYGOTE_STATS_CODES      64
+#define ZYGOTE_STATS_PATH_MAX   240
+
+typedef struct {
+    unsigned int seq;               // odd while the zygote is updating
+    unsigned int magic;             // ZYGOTE_STATS_MAGIC
+    unsigned int version;           // ZYGOTE_STATS_VERSION
+    int pid;                        // of the zygote
+    long long started;              // time(2) when the zygote started
+    int replicas;                   // pages in the file, one for each replica
+
+    unsigned long long requests;    // received
+    unsigned long long rejected;    // malformed, or failed to dispatch
+    unsigned long long forked;      // served by a child forked on demand
+    unsigned long long pooled;      // served by a warm child
+    unsigned long long cached;      // served by a sub-zygote already loaded
+    unsigned long long loaded;      // served by a sub-zygote loaded for it
+    unsigned long long threaded;    // served on a thread of the executor
+    unsigned long long worked;      // served by a worker kept for the code
+    unsigned long long memoized;    // answered with the result of an earlier run
+    unsigned long long coalesced;   // waited for the same run already going on
+    unsigned long long queued;      // had to wait for their turn
+    unsigned long long busy;        // turned away with the queue full
+    unsigned long long completed;   // children that have exited
+    unsigned long long failed;      // exited with non-zero status, or killed
+
+    int in_flight;                  // children still running a request
+    int pool_ready;                 // warm children waiting
+    int sub_zygotes;                // shared objects loaded
+    int queue_len;                  // requests waiting for their turn
+
+    char placement[16];             // policy placing children on CPUs
+    int data_node;                  // NUMA node of the zygote's data, or -1
+    unsigned long long local;       // children placed on the node of the data
+    unsigned long long remote;      // children placed on other nodes
+
+    // bucket i counts durations in [2^i - 1, 2^(i+1) - 1) microseconds
+    unsigned long long fork_us[ZYGOTE_STATS_BUCKETS];   // of fork() itself
+    unsigned long long run_us[ZYGOTE_STATS_BUCKETS];    // from dispatch to exit
+
+    struct {
+        char path[ZYGOTE_STATS_PATH_MAX];
+        unsigned long long hits;
+    } codes[ZYGOTE_STATS_CODES];    // by requests, empty where path[0] == 0
+    unsigned long long other_hits;  // requests for shared objects not in codes
+} zygote_stats_t;
+
+// copy a consistent snapshot of the shared page, giving up after so many
+// tries, or if it's not a stats page we know
+static inline int zygote_stats_read(const zygote_stats_t* shared, zygote_stats_t* copy) {
+    unsigned int seq;
+    int tries;
+    for (tries = 0; tries < 1000; tries++) {
+        seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(copy, (const void *) shared, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        if (copy->magic != ZYGOTE_STATS_MAGIC || copy->version != ZYGOTE_STATS_VERSION)
+            return -1;
+        return 0;
+    }
+    return -1;
+}
+
+#endif /* _ZYGOTE_STATS_H */
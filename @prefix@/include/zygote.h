@@ -0,0 +1,324 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Zygote Process Library
+ *
+ * There are programs you want to run multiple times with slight variations,
+ * but are wasting a lot of time going through the same start up procedure,
+ * such as loading a set of data into memory.  Using libzygote, you can easily
+ * eliminate this inefficiency with minimal changes to the code.  You will
+ * first run your start up code once and libzygote will keep it alive as a
+ * "zygote" process.  Whenever you want to feed the rest of your code, you can
+ * use libzygote's "grow" command, and grow your zygote into an actual process.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#ifndef _ZYGOTE_H
+#define _ZYGOTE_H
+
+// of the protocol grow speaks, see zygote-protocol.h; grow of version 2, that
+// of the first releases, is still served
+#define ZYGOTE_VERSION 0x00000004
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+/**
+ * zygote() will turn this into a zygote process that is accesible through a
+ * Unix domain socket created at the given socket_path, and wait for runnable
+ * shared objects containing run() to arrive.  Prior to calling zygote(),
+ * finish all the time-consuming loading or start up code, and pass any
+ * pointers the subsequent code will have to use.  Pointers given after
+ * socket_path, will be passed to run() later as objc and objv.  The argument
+ * list must be NULL-terminated.
+ */
+int zygote(char* socket_path, ... /*, NULL */);
+
+/**
+ * The zygote process can be tuned with the following environment variables:
+ *
+ *   ZYGOTE_POOL_SIZE   Number of children to fork ahead of time and keep
+ *                      warm, so grow requests don't have to wait for fork().
+ *                      Used children are replaced whenever the zygote is idle.
+ *                      (default: 0, i.e., fork after accepting a request)
+ *
+ *   ZYGOTE_CODE_CACHE_SIZE
+ *                      Number of runnable shared objects to keep loaded in
+ *                      sub-zygotes, which skip dlopen() and static
+ *                      constructors for later grows of the same code.  A
+ *                      changed shared object invalidates its sub-zygote, and
+ *                      the least recently used one is evicted when full.
+ *                      (default: 0, i.e., load the code in every child)
+ *
+ *   ZYGOTE_FAST_EXIT   Whether grown children flush stdio, report the exit
+ *                      status and _exit() as soon as run() returns, instead of
+ *                      returning from zygote() into main() and running atexit
+ *                      handlers and destructors for the whole loaded state.
+ *                      C++ streams not synced with stdio must be flushed by
+ *                      run() itself in this mode.  (default: 1)
+ *
+ *   ZYGOTE_BACKLOG     Length of the queue of connections waiting to be
+ *                      accepted by the zygote.  (default: SOMAXCONN)
+ *
+ *   ZYGOTE_MAX_IN_FLIGHT
+ *                      Number of children allowed to run requests at the same
+ *                      time; the rest wait for their turn in order.  With
+ *                      ZYGOTE_REPLICAS, each replica gets an even share of
+ *                      it, at least one.  (default: 0, i.e., no limit)
+ *
+ *   ZYGOTE_QUEUE_SIZE  Number of requests allowed to wait for their turn,
+ *                      split evenly among the replicas like the former.
+ *                      Those arriving with the queue full are turned away at
+ *                      once, and grow exits with ZYGOTE_EXIT_BUSY (75), so
+ *                      callers can back off.  (default: 128)
+ *
+ *   ZYGOTE_PRIORITIES  Priority classes of clients, by user or @group, e.g.,
+ *                      "alice=interactive @builders=batch 1001=batch", taken
+ *                      from the peer credentials of the connection.  Waiting
+ *                      requests take turns by weighted fair queuing across
+ *                      users and classes, with interactive getting 4 times
+ *                      the share of normal, and normal 4 times that of batch.
+ *                      Children of interactive requests get 5 less nice if
+ *                      permitted, and those of batch ones 10 more and
+ *                      SCHED_BATCH.  grow --priority asks for a lower class,
+ *                      or any if run by the zygote's own user.
+ *                      (default: every client is normal)
+ *
+ *   ZYGOTE_CGROUP      Path to a cgroup v2 directory delegated to the zygote,
+ *                      which must not be in it itself, to run grown children
+ *                      in leaves of.  Linux only.  (default: unset, i.e., no
+ *                      cgroups)
+ *
+ *   ZYGOTE_CGROUP_LEAVES
+ *                      "child" for a leaf for each child, named grow-PID and
+ *                      removed once reaped, whose usage grow --timing shows,
+ *                      or "class" for a leaf shared by each priority class.
+ *                      (default: child)
+ *
+ *   ZYGOTE_CGROUP_CPU_MAX, ZYGOTE_CGROUP_MEMORY_HIGH, ZYGOTE_CGROUP_IO_MAX
+ *                      Written as they are to cpu.max, memory.high and io.max
+ *                      of every leaf.  (default: unset, i.e., no limits)
+ *
+ *   ZYGOTE_PLACEMENT   "round-robin" or "least-loaded" to pin every child to a
+ *                      CPU of its own among those the zygote may run on, or
+ *                      "data-node" to pin it to the CPUs of the NUMA node
+ *                      holding most of the objects passed to zygote().  Linux
+ *                      only.  (default: none, i.e., left to the scheduler)
+ *
+ *   ZYGOTE_REPLICAS    Number of zygotes accepting from the socket, forked
+ *                      from the first one once loaded, each forking children
+ *                      on its own.  The first one respawns those that die,
+ *                      and its statistics count them all.  (default: 1)
+ *
+ *   ZYGOTE_NUMA_REPLICAS
+ *                      1 to have replicas on every NUMA node, at least one
+ *                      each, which move their data there so children read
+ *                      local memory.  Linux only.  (default: 0)
+ *
+ *   ZYGOTE_THREADS     Number of worker threads of the executor, a child
+ *                      forked once to serve requests for code defining
+ *                      run_thread() without forking, or 0 to always fork.
+ *                      (default: 4)
+ *
+ *   ZYGOTE_MEMORY_PRESSURE
+ *                      Percentage of the last 10 seconds tasks stalled on
+ *                      memory, as "some avg10" of /proc/pressure/memory, at or
+ *                      above which requests wait until the running children
+ *                      finish.  Linux only.  (default: 0, i.e., ignored)
+ *
+ *   ZYGOTE_MIN_AVAILABLE
+ *                      MiB of MemAvailable in /proc/meminfo, below which
+ *                      requests wait until the running children finish.  Linux
+ *                      only.  (default: 0, i.e., ignored)
+ *
+ *   ZYGOTE_ARENA       MiB of address space each grown child reserves to
+ *                      serve its malloc() from, leaving the heap it shares
+ *                      with the zygote untouched; free() of memory allocated
+ *                      before the fork does nothing.  Linux only.  (default: 0,
+ *                      i.e., use the zygote's allocator)
+ *
+ *   ZYGOTE_DIRTY_REPORT
+ *                      Whether to log how many pages each run() copied from
+ *                      the zygote, by mapping and by region given to
+ *                      zygote_register() or passed as objv.  With 2, the
+ *                      registered regions are also made read-only during
+ *                      run() to log the instructions writing to them.  grow
+ *                      --dirty asks for the same report for a single request.
+ *                      Linux only.  (default: 0)
+ *
+ *   ZYGOTE_PARALLEL    Number of processes zygote_parallel_for() spreads its
+ *                      ranges over, counting the one calling it.  (default: 0,
+ *                      i.e., as many as the CPUs the zygote may run on)
+ *
+ *   ZYGOTE_RESULT_CACHE
+ *                      MiB of memory to keep what runs of code defining
+ *                      zygote_pure write to stdout and stderr in, with their
+ *                      exit status, forgetting the least recently used ones
+ *                      beyond it.  Only runs with stdin from a regular file,
+ *                      /dev/null or none are kept, and not while the code or
+ *                      stdin changed in the last two seconds.  Linux only.
+ *                      (default: 0, i.e., run every request)
+ *
+ *   ZYGOTE_RESULT_ENV  Names of the variables of grow's environment, separated
+ *                      by spaces, that results of pure code are kept apart by.
+ *                      (default: "LANG LC_ALL TZ")
+ *
+ *   ZYGOTE_STATS       Whether to keep live counters, gauges and latency
+ *                      histograms in a file named after the socket with .stats
+ *                      appended, for zygote-top or any reader of
+ *                      zygote-stats.h to map.  (default: 1)
+ */
+
+/**
+ * zygote_register() names a region of memory the zygote hands over to run(),
+ * e.g., an object passed as objv, for the reports of ZYGOTE_DIRTY_REPORT and
+ * grow --dirty, which only know the address of each objv otherwise.  Call it
+ * before zygote().  Returns -1 if too many regions were registered.
+ */
+int zygote_register(const char* name, const void* addr, size_t len);
+
+/**
+ * run() is the function you'll need to fit the rest of your code into.  The
+ * first two arguments, objc and objv are the pointers passed to zygote()
+ * from the zygote process, argc and argv correspond to the command line
+ * arguments given to the grow command.  argv[0] is the path to the shared
+ * object.  Its return value becomes the exit status of grow, and unless
+ * ZYGOTE_FAST_EXIT=0, the child exits right after it returns.
+ */
+int run(int objc, void* objv[], int argc, char* argv[]);
+
+/**
+ * run_thread() is what code defines instead of, or besides, run() to be run
+ * on a worker thread of the executor, a process forked from the zygote once
+ * and shared by all such requests, sparing a fork() and exit for each.  Code
+ * defining it promises not to modify objv nor anything else of the process,
+ * such as the working directory, environment, signal handlers or standard
+ * file descriptors, and to leave exit() alone, as others run alongside.  What
+ * grow passes comes in stdio instead, and the streams are closed once it
+ * returns.  A crash takes down every request running in the executor.
+ */
+typedef struct {
+    FILE* in;               // stdin of grow, or NULL
+    FILE* out;              // stdout of grow, or NULL
+    FILE* err;              // stderr of grow, or NULL
+    const char* cwd;        // working directory of grow, or NULL
+    char* const* envp;      // environment of grow, or NULL
+} zygote_stdio_t;
+int run_thread(int objc, void* objv[], int argc, char* argv[], zygote_stdio_t* stdio);
+
+/**
+ * zygote_pure is what code defines, e.g., "const int zygote_pure = 1;", to
+ * declare that what run() writes to stdout and stderr, and its exit status,
+ * depend on nothing but objv, argv, stdin, and the variables named by
+ * ZYGOTE_RESULT_ENV.  With ZYGOTE_RESULT_CACHE, the zygote keeps them for a
+ * request, and answers the same request again without running it, while
+ * those arriving before the first one is done wait for it.
+ */
+extern const int zygote_pure;
+
+/**
+ * zygote_input() gives run() the input a fuzzer put in shared memory for this
+ * execution, when the code is served with grow --forkserver to one that
+ * passes inputs that way, e.g., AFL++ setting __AFL_SHM_FUZZ_ID, storing its
+ * length in len.  Otherwise it returns NULL, and the input comes from stdin or
+ * a file named in argv as usual.
+ */
+const unsigned char* zygote_input(size_t* len);
+
+
+/**
+ * zygote_shard() tells run() which of the shards it runs on, when grow
+ * --shards=N has it run in N children at once, storing N in count.  Otherwise
+ * it returns 0, with count 1.  zygote_reduction() gives the buffer shared by
+ * all the shards, zeroed and len bytes long as grow --reduction asked, for
+ * them to leave their partial results in, or NULL without shards.
+ */
+int zygote_shard(int* count);
+void* zygote_reduction(size_t* len);
+
+/**
+ * reduce() is what code may define besides run() to combine the partial
+ * results of its shards, called once all of them exited with 0, with the same
+ * arguments, in the process that forked them.  Its return value becomes the
+ * exit status of grow, which is that of the first shard failing otherwise.
+ */
+int reduce(int objc, void* objv[], int argc, char* argv[]);
+
+/**
+ * zygote_parallel_for() calls fn(lo, hi, ctx) over consecutive ranges covering
+ * [begin, end), spread over the caller and helpers it forks, which see all it
+ * sees copy-on-write.  Each process takes ranges from a share of its own, and
+ * then from the back of the others', until none are left.  What fn writes
+ * stays in the process it ran in, except in memory from zygote_scratch(),
+ * mapped before the call, where results can go back to the caller.  Returns
+ * once every range is done, with 0, or -1 if a helper died, possibly in the
+ * middle of one.  Called again from fn, it runs the whole range itself.
+ */
+int zygote_parallel_for(long begin, long end, void (*fn)(long lo, long hi, void* ctx), void* ctx);
+
+/**
+ * zygote_scratch() maps len bytes of zeroed memory shared with the helpers of
+ * later zygote_parallel_for() calls, to munmap() once done, or returns NULL.
+ */
+void* zygote_scratch(size_t len);
+
+/**
+ * zygote_shared_cache() maps size bytes of memory shared by every process
+ * forked afterwards, as a hash table for values one run() derives to be found
+ * by the others, instead of being lost when its child exits.  Call it before
+ * zygote().  A key and its value take up to entry_size bytes together, and
+ * once the slots a key may go in are taken, publishing it evicts one not
+ * looked up lately.  No call ever waits for another process, and one dying in
+ * the middle of publishing leaves the others unaffected.  Returns NULL if the
+ * memory can't be mapped.
+ *
+ * zygote_shared_cache_get() copies up to len bytes of the value of the key
+ * into value, and returns its whole length, or -1 if it isn't there.
+ * zygote_shared_cache_put() publishes the value of the key, replacing any
+ * before, and returns 0, or -1 if they are too large together, or all the
+ * slots it may go in are being written.
+ */
+typedef struct zygote_shared_cache zygote_shared_cache_t;
+zygote_shared_cache_t* zygote_shared_cache(size_t size, size_t entry_size);
+long zygote_shared_cache_get(zygote_shared_cache_t* cache, const void* key, size_t key_len,
+        void* value, size_t len);
+int zygote_shared_cache_put(zygote_shared_cache_t* cache, const void* key, size_t key_len,
+        const void* value, size_t value_len);
+
+/**
+ * Define ZYGOTE_DISABLED if you want to skip the zygote process mechanism, and
+ * simply invoke the run() that exists in the same executable or address space.
+ *
+ * NOTE: You will need to pass -rdynamic flag to the linker for libzygote to be
+ * able to locate your run() function using dlopen().
+ */
+#ifdef ZYGOTE_DISABLED
+#define zygote(args...) zygote_skip(args)
+int zygote_skip(char* socket_path, ... /*, NULL */);
+#endif /* ZYGOTE_DISABLED */
+
+
+#ifdef __cplusplus 
+}
+#endif
+
+#endif /* _ZYGOTE_H */
@@ -27,59 +27,159 @@
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <getopt.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
+#include <poll.h>
 
 extern char* *environ;
 
-#include "zygote.h"
+#include "zygote-protocol.h"
 
 // read_fd/write_fd taken from Unix Network Programming
 // See-Also: http://stackoverflow.com/a/2358843/390044
-#define HAVE_MSGHDR_MSG_CONTROL
-static ssize_t write_fd(int fd, void *ptr, size_t nbytes, int sendfd) {
-    struct msghdr   msg;
+// extended to send several file descriptors along with the first piece of a buffer
+static ssize_t send_fds(int fd, void *ptr, size_t nbytes, int *sendfds, int nfds, int flags) {
+    struct msghdr   msg = {0};
     struct iovec    iov[1];
-
-#ifdef  HAVE_MSGHDR_MSG_CONTROL
     union {
       struct cmsghdr    cm;
-      char              control[CMSG_SPACE(sizeof(int))];
+      char              control[CMSG_SPACE(5 * sizeof(int))];
     } control_un;
     struct cmsghdr  *cmptr;
 
     msg.msg_control = control_un.control;
-    msg.msg_controllen = sizeof(control_un.control);
-
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
     cmptr = CMSG_FIRSTHDR(&msg);
-    cmptr->cmsg_len = CMSG_LEN(sizeof(int));
+    cmptr->cmsg_len = CMSG_LEN(nfds * sizeof(int));
     cmptr->cmsg_level = SOL_SOCKET;
     cmptr->cmsg_type = SCM_RIGHTS;
-    *((int *) CMSG_DATA(cmptr)) = sendfd;
-#else
-    msg.msg_accrights = (caddr_t) &sendfd;
-    msg.msg_accrightslen = sizeof(int);
-#endif
-
-    msg.msg_name = NULL;
-    msg.msg_namelen = 0;
+    memcpy(CMSG_DATA(cmptr), sendfds, nfds * sizeof(int));
 
     iov[0].iov_base = ptr;
     iov[0].iov_len = nbytes;
     msg.msg_iov = iov;
     msg.msg_iovlen = 1;
 
-    return(sendmsg(fd, &msg, 0));
+    return sendmsg(fd, &msg, flags);
+}
+
+// and the whole buffer
+static int write_fds(int fd, void *ptr, size_t nbytes, int *sendfds, int nfds) {
+    char*           p = (char *) ptr;
+    ssize_t         n;
+
+    // a frame larger than the socket buffer goes out in several pieces
+    if ((n = send_fds(fd, p, nbytes, sendfds, nfds, 0)) == -1)
+        return -1;
+    for (p += n, nbytes -= n; nbytes > 0; p += n, nbytes -= n)
+        if ((n = write(fd, p, nbytes)) == -1)
+            return -1;
+    return 0;
+}
+/* end write_fds */
+
+// read exactly nbytes, or fail
+static int read_all(int fd, void* ptr, size_t nbytes) {
+    char* p = (char *) ptr;
+    while (nbytes > 0) {
+        ssize_t n = read(fd, p, nbytes);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        nbytes -= n;
+    }
+    return 0;
+}
+
+
+// A growable buffer for building a request frame
+static char* frame = NULL;
+static size_t frame_len = 0;
+static size_t frame_cap = 0;
+
+static void append(void* ptr, size_t nbytes) {
+    if (frame_len + nbytes > frame_cap) {
+        frame_cap = (frame_len + nbytes) * 2;
+        frame = (char *) realloc(frame, frame_cap);
+    }
+    memcpy(frame + frame_len, ptr, nbytes);
+    frame_len += nbytes;
+}
+
+// append a section of NUL-terminated strings
+static void append_section(int type, int count, char* strs[]) {
+    zygote_section_t section = { type, 0 };
+    size_t offset = frame_len;
+    int i;
+    append(&section, sizeof(section));
+    for (i=0; i<count; i++)
+        append(strs[i], strlen(strs[i]) + 1);
+    section.length = frame_len - offset - sizeof(section);
+    memcpy(frame + offset, &section, sizeof(section));
+}
+
+
+// nanoseconds of CLOCK_MONOTONIC, as timestamped by the zygote
+static long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// show where the time went, from connecting to the child being reaped
+static void print_timing(long long times[], long long rusage[], int has_rusage, long long cgroup[], int has_cgroup) {
+    static const char* names[ZYGOTE_TIMES] = {
+        "connect", "sent", "accept", "receive", "dispatch", "start",
+        "load", "run", "return", "exit", "reap",
+    };
+    long long prev = times[ZYGOTE_TIME_CONNECT];
+    int order[ZYGOTE_TIMES];
+    int i, j, n = 0;
+    // in the order they happened, e.g., the zygote may accept before grow is
+    // done sending
+    for (i=0; i<ZYGOTE_TIMES; i++) {
+        if (times[i] == 0)
+            continue;
+        for (j = n++; j > 0 && times[order[j-1]] > times[i]; j--)
+            order[j] = order[j-1];
+        order[j] = i;
+    }
+    fprintf(stderr, "grow: %10s %10s  %s\n", "ms", "+ms", "since connect");
+    for (j=0; j<n; j++) {
+        i = order[j];
+        fprintf(stderr, "grow: %10.3f %10.3f  %s\n",
+                (times[i] - times[ZYGOTE_TIME_CONNECT]) / 1e6, (times[i] - prev) / 1e6, names[i]);
+        prev = times[i];
+    }
+    if (has_rusage)
+        fprintf(stderr, "grow: %.3f ms user, %.3f ms sys, %lld KiB max RSS, "
+                "%lld minor + %lld major faults, %lld voluntary + %lld involuntary switches\n",
+                rusage[ZYGOTE_RUSAGE_UTIME] / 1e3, rusage[ZYGOTE_RUSAGE_STIME] / 1e3,
+                rusage[ZYGOTE_RUSAGE_MAXRSS], rusage[ZYGOTE_RUSAGE_MINFLT], rusage[ZYGOTE_RUSAGE_MAJFLT],
+                rusage[ZYGOTE_RUSAGE_NVCSW], rusage[ZYGOTE_RUSAGE_NIVCSW]);
+    if (has_cgroup)
+        fprintf(stderr, "grow: cgroup: %.3f ms CPU (%.3f ms user, %.3f ms sys), %.3f ms throttled, "
+                "%lld KiB peak memory, %lld KiB read, %lld KiB written\n",
+                cgroup[ZYGOTE_CGROUP_USAGE_USEC] / 1e3, cgroup[ZYGOTE_CGROUP_USER_USEC] / 1e3,
+                cgroup[ZYGOTE_CGROUP_SYSTEM_USEC] / 1e3, cgroup[ZYGOTE_CGROUP_THROTTLED_USEC] / 1e3,
+                cgroup[ZYGOTE_CGROUP_MEMORY_PEAK] >> 10,
+                cgroup[ZYGOTE_CGROUP_IO_RBYTES] >> 10, cgroup[ZYGOTE_CGROUP_IO_WBYTES] >> 10);
 }
-/* end write_fd */
 
 
 static pid_t pid = -1;
+static int pid_shared = 0;
 static void forward_signal(int sig) {
-    if (pid == -1)
+    if (pid == -1 || pid_shared)
         return;
     kill(pid, sig);
 }
@@ -92,68 +192,728 @@ static void forward_signal(int sig) {
 
 // See-Also: http://www.thomasstover.com/uds.html
 // See-Also: https://github.com/martylamb/nailgun/blob/master/nailgun-client/ng.c
-int main(int argc, char* argv[]) {
+static int connect_zygote(char* socket_path) {
     struct sockaddr_un unix_socket_name = {0};
+    int socket_fd;
+    unix_socket_name.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= UNIX_PATH_MAX - 1) {
+        fprintf(stderr, "%s: pathname too long", socket_path);
+        return -1;
+    }
+    strcpy(unix_socket_name.sun_path, socket_path);
+    socket_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        perror(socket_path);
+        return -1;
+    }
+    if (connect(socket_fd, (struct sockaddr*)&unix_socket_name, sizeof(unix_socket_name))) {
+        perror(socket_path);
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+
+// A run of grow --batch, for a line of arguments, answered by its number
+typedef struct {
+    char* args;             // the line, till the run is done
+    int line;               // its number, counting blank ones
+    int done;
+    int busy;               // turned away, to be sent again
+    int status;
+    int connection_fd;      // the run was sent on
+    FILE* out;              // its stdout to merge, or NULL
+    long long sent;         // when its frame was built
+    long long latency;      // from then till ZYGOTE_REPLY_EXIT
+} batch_run_t;
+
+// A connection to the zygote with a frame going out, and replies coming in
+typedef struct {
+    int fd;
+    int frames;             // sent on it and yet to exit
+    char* out;
+    size_t out_len, out_off;
+    int out_fds[3];
+    int fds_sent;
+    char* in;
+    size_t in_len, in_cap;
+} batch_connection_t;
+
+static batch_run_t* runs = NULL;
+static int runs_len = 0, runs_cap = 0;
+static int runs_done = 0;
+static int runs_merged = 0;         // whose stdout went to ours
+static int* retries = NULL;         // numbers of runs turned away
+static int retries_len = 0, retries_cap = 0;
+static int busy_count = 0;
+static int in_flight = 0;
+static int held = 0;                // from sending more, after a busy reply
+static int pipelining = -1;         // whether the zygote reads more frames on a
+                                    // connection, or -1 till it answers the first
+static batch_connection_t* connections = NULL;
+static int connections_len = 0;
+static char* batch_dir = NULL;      // of the files for each run's output, or NULL
+                                    // to merge stdouts in the order of the lines
+static int null_fd = -1;
+
+// runs merged in order may finish this many times the number in flight ahead of
+// the oldest one still running, each holding on to a temporary file
+#define BATCH_MERGE_AHEAD 8
+
+// read the next non-blank line of arguments as a new run, or return -1 at the end
+static int read_run(FILE* input) {
+    static char* line = NULL;
+    static size_t cap = 0;
+    static int line_no = 0;
+    ssize_t n;
+    batch_run_t* run;
+    while ((n = getline(&line, &cap, input)) != -1) {
+        line_no++;
+        if (n > 0 && line[n - 1] == '\n')
+            line[--n] = '\0';
+        if (strspn(line, " \t") < (size_t) n)
+            break;
+    }
+    if (n == -1)
+        return -1;
+    if (runs_len == runs_cap) {
+        runs_cap = runs_cap * 2 + 64;
+        runs = (batch_run_t *) realloc(runs, runs_cap * sizeof(batch_run_t));
+    }
+    run = &runs[runs_len];
+    memset(run, 0, sizeof(*run));
+    run->args = strdup(line);
+    run->line = line_no;
+    run->connection_fd = -1;
+    return runs_len++;
+}
+
+// open where the run's stdout and stderr go
+static int open_outputs(int i, int fds[3]) {
+    char path[PATH_MAX];
+    batch_run_t* run = &runs[i];
+    fds[0] = null_fd;
+    if (batch_dir == NULL) {
+        // merged later, with stderr going straight to ours
+        if (run->out == NULL && (run->out = tmpfile()) == NULL) {
+            perror("tmpfile");
+            return -1;
+        }
+        fds[1] = fileno(run->out);
+        fds[2] = 2;
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/%d.out", batch_dir, run->line);
+    if ((fds[1] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+        perror(path);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%d.err", batch_dir, run->line);
+    if ((fds[2] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+        perror(path);
+        close(fds[1]);
+        return -1;
+    }
+    return 0;
+}
+
+// send as much of the connection's frame as it takes without blocking, the
+// descriptors going with the first piece
+static int send_frame(batch_connection_t* c) {
+    ssize_t n;
+    while (c->out_off < c->out_len) {
+        if (!c->fds_sent)
+            n = send_fds(c->fd, c->out + c->out_off, c->out_len - c->out_off, c->out_fds, 3,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+        else
+            n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if (!c->fds_sent && batch_dir != NULL) {
+            // the files are the run's now
+            close(c->out_fds[1]);
+            close(c->out_fds[2]);
+        }
+        c->fds_sent = 1;
+        c->out_off += n;
+    }
+    return 0;
+}
+
+// put run i with its arguments after the given ones in a frame on the connection
+static int start_run(batch_connection_t* c, int i, size_t prefix_len, int argc, char* argv[],
+        int num_options, char* options[]) {
+    zygote_frame_t header = { ZYGOTE_VERSION, 0, i + 1, ZYGOTE_CAP_OPTIONS | ZYGOTE_CAP_THREAD };
+    batch_run_t* run = &runs[i];
+    char* line = strdup(run->args);
+    char* *args = (char* *) malloc((argc + strlen(line) / 2 + 1) * sizeof(char*));
+    char* arg;
+    int n = 0;
+    if (open_outputs(i, c->out_fds) == -1) {
+        free(line);
+        free(args);
+        return -1;
+    }
+    while (n < argc) {
+        args[n] = argv[n];
+        n++;
+    }
+    for (arg = strtok(line, " \t"); arg != NULL; arg = strtok(NULL, " \t"))
+        args[n++] = arg;
+    if (pipelining != 0)
+        header.caps |= ZYGOTE_CAP_PIPELINE;
+    frame_len = prefix_len;
+    append_section(ZYGOTE_SECTION_ARGV, n, args);
+    if (num_options > 0)
+        append_section(ZYGOTE_SECTION_OPTION, num_options, options);
+    header.length = frame_len - sizeof(header);
+    memcpy(frame, &header, sizeof(header));
+    free(line);
+    free(args);
+    c->out = (char *) realloc(c->out, frame_len);
+    memcpy(c->out, frame, frame_len);
+    c->out_len = frame_len;
+    c->out_off = 0;
+    c->fds_sent = 0;
+    c->frames++;
+    run->connection_fd = c->fd;
+    run->sent = now();
+    in_flight++;
+    return 0;
+}
+
+// copy the stdout of the runs done so far to ours, in the order of their lines
+static void merge_outputs(void) {
+    char buf[65536];
+    size_t n;
+    batch_run_t* run;
+    while (runs_merged < runs_len && runs[runs_merged].done) {
+        run = &runs[runs_merged++];
+        if (run->out == NULL)
+            continue;
+        rewind(run->out);
+        while ((n = fread(buf, 1, sizeof(buf), run->out)) > 0)
+            fwrite(buf, 1, n, stdout);
+        fclose(run->out);
+        run->out = NULL;
+    }
+    fflush(stdout);
+}
+
+static void finish_run(int i, int status) {
+    batch_run_t* run = &runs[i];
+    run->done = 1;
+    run->status = status;
+    run->latency = now() - run->sent;
+    free(run->args);
+    run->args = NULL;
+    runs_done++;
+    merge_outputs();
+}
+
+static void handle_reply(batch_connection_t* c, zygote_reply_t* record, char* payload) {
+    batch_run_t* run;
+    int status, caps = 0;
+    if (record->id < 1 || record->id > runs_len)
+        return;
+    run = &runs[record->id - 1];
+    // ignore what we don't understand
+    switch (record->type) {
+        case ZYGOTE_REPLY_PID:
+            if (pipelining == -1) {
+                if (record->length >= 2 * sizeof(int))
+                    memcpy(&caps, payload + sizeof(int), sizeof(int));
+                pipelining = (caps & ZYGOTE_CAP_PIPELINE) != 0;
+            }
+            break;
+        case ZYGOTE_REPLY_REPORT:
+            fputs(payload, stderr);
+            break;
+        case ZYGOTE_REPLY_BUSY:
+            run->busy = 1;
+            break;
+        case ZYGOTE_REPLY_EXIT:
+            memcpy(&status, payload, sizeof(int));
+            c->frames--;
+            in_flight--;
+            // a zygote turning away the first run says nothing of pipelining
+            if (pipelining == -1)
+                pipelining = 0;
+            if (run->busy) {
+                // send it again once another one is done
+                run->busy = 0;
+                run->connection_fd = -1;
+                busy_count++;
+                held = 1;
+                if (retries_len == retries_cap) {
+                    retries_cap = retries_cap * 2 + 16;
+                    retries = (int *) realloc(retries, retries_cap * sizeof(int));
+                }
+                retries[retries_len++] = record->id - 1;
+                break;
+            }
+            held = 0;
+            finish_run(record->id - 1, status);
+            break;
+    }
+}
+
+// handle the whole records received on the connection, or return -1 when it's gone
+static int recv_replies(batch_connection_t* c) {
+    static char* payload = NULL;
+    static size_t payload_cap = 0;
+    zygote_reply_t record;
+    size_t off = 0;
+    ssize_t n;
+    int gone = 0;
+    for (;;) {
+        if (c->in_len == c->in_cap) {
+            c->in_cap = c->in_cap * 2 + 4096;
+            c->in = (char *) realloc(c->in, c->in_cap);
+        }
+        n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            // after what came before
+            gone = 1;
+            break;
+        }
+        c->in_len += n;
+    }
+    while (c->in_len - off >= sizeof(record)) {
+        memcpy(&record, c->in + off, sizeof(record));
+        if (record.length < 0)
+            return -1;
+        if (c->in_len - off - sizeof(record) < (size_t) record.length)
+            break;
+        if (record.length + 1 > payload_cap) {
+            payload_cap = record.length + 1 < sizeof(int) * 2 ? sizeof(int) * 2 : record.length + 1;
+            payload = (char *) realloc(payload, payload_cap);
+        }
+        memset(payload, 0, payload_cap);
+        memcpy(payload, c->in + off + sizeof(record), record.length);
+        handle_reply(c, &record, payload);
+        off += sizeof(record) + record.length;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return gone ? -1 : 0;
+}
+
+// close the connection, giving up on the runs still waiting for replies on it
+// when it's lost
+static void drop_connection(char* socket_path, int k, int lost) {
+    batch_connection_t* c = &connections[k];
+    int i;
+    if (lost && (c->frames > 0 || pipelining != 0))
+        fprintf(stderr, "%s: connection lost\n", socket_path);
+    if (c->frames > 0) {
+        for (i=runs_merged; i<runs_len; i++)
+            if (!runs[i].done && runs[i].connection_fd == c->fd) {
+                finish_run(i, -1);
+                in_flight--;
+            }
+    }
+    if (c->out_off < c->out_len && !c->fds_sent && batch_dir != NULL) {
+        close(c->out_fds[1]);
+        close(c->out_fds[2]);
+    }
+    close(c->fd);
+    free(c->out);
+    free(c->in);
+    connections[k] = connections[--connections_len];
+}
+
+static int compare_latency(const void* a, const void* b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+// show how the runs exited, and how long they took
+static void print_summary(long long elapsed) {
+    long long* latencies = (long long *) malloc((runs_len + 1) * sizeof(long long));
+    int* counted = (int *) calloc(runs_len + 1, sizeof(int));
+    int i, j, count, n = 0;
+    fprintf(stderr, "grow: %d runs in %.3f s, %.1f/s", runs_done, elapsed / 1e9,
+            elapsed > 0 ? runs_done / (elapsed / 1e9) : 0);
+    for (i=0; i<runs_len; i++) {
+        if (counted[i] || !runs[i].done)
+            continue;
+        for (j = i, count = 0; j < runs_len; j++)
+            if (runs[j].done && runs[j].status == runs[i].status) {
+                counted[j] = 1;
+                count++;
+            }
+        fprintf(stderr, "%s %d exited %d", n == 0 ? ":" : ",", count, runs[i].status);
+        n++;
+    }
+    fprintf(stderr, "\n");
+    if (busy_count > 0)
+        fprintf(stderr, "grow: %d sent again after the zygote was busy\n", busy_count);
+    for (i = 0, n = 0; i<runs_len; i++)
+        if (runs[i].done)
+            latencies[n++] = runs[i].latency;
+    if (n > 0) {
+        qsort(latencies, n, sizeof(long long), compare_latency);
+        fprintf(stderr, "grow: latency p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                latencies[(n - 1) / 2] / 1e6, latencies[(n - 1) * 9 / 10] / 1e6,
+                latencies[(n - 1) * 99 / 100] / 1e6, latencies[n - 1] / 1e6);
+    }
+    free(latencies);
+    free(counted);
+}
+
+// keep up to procs runs in flight, one for each line of arguments from input,
+// pipelined on the given connection whose frame so far has what they share
+static int run_batch(char* socket_path, int socket_fd, FILE* input, int procs,
+        int argc, char* argv[], int num_options, char* options[]) {
+    size_t prefix_len = frame_len;
+    long long started = now();
+    struct pollfd* polls = (struct pollfd *) malloc((procs + 1) * sizeof(struct pollfd));
+    batch_connection_t* c;
+    int eof = 0, failed = 0;
+    int i, k, n;
+
+    if ((null_fd = open("/dev/null", O_RDONLY)) == -1) {
+        perror("/dev/null");
+        return -1;
+    }
+    if (batch_dir != NULL && mkdir(batch_dir, 0777) == -1 && errno != EEXIST) {
+        perror(batch_dir);
+        return -1;
+    }
+    connections = (batch_connection_t *) calloc(procs + 1, sizeof(batch_connection_t));
+    connections[0].fd = socket_fd;
+    fcntl(socket_fd, F_SETFL, O_NONBLOCK);
+    connections_len = 1;
+
+    for (;;) {
+        // send more while there's room, on the one connection when the zygote
+        // reads pipelined frames, or one for each run otherwise
+        while (in_flight < procs && !held && !(pipelining == -1 && in_flight > 0)) {
+            if (pipelining != 0 && connections[0].out_off < connections[0].out_len)
+                // after the frame going out
+                break;
+            if (retries_len > 0)
+                i = retries[--retries_len];
+            else if (eof || (batch_dir == NULL && runs_len - runs_merged >= procs * BATCH_MERGE_AHEAD))
+                break;
+            else if ((i = read_run(input)) == -1) {
+                eof = 1;
+                break;
+            }
+            if (pipelining != 0) {
+                c = &connections[0];
+            } else {
+                if ((n = connect_zygote(socket_path)) == -1) {
+                    finish_run(i, -1);
+                    continue;
+                }
+                fcntl(n, F_SETFL, O_NONBLOCK);
+                c = &connections[connections_len++];
+                memset(c, 0, sizeof(*c));
+                c->fd = n;
+            }
+            if (start_run(c, i, prefix_len, argc, argv, num_options, options) == -1) {
+                finish_run(i, -1);
+                continue;
+            }
+            send_frame(c);
+        }
+        if (eof && retries_len == 0 && in_flight == 0)
+            break;
+
+        for (k=0; k<connections_len; k++) {
+            polls[k].fd = connections[k].fd;
+            polls[k].events = POLLIN;
+            if (connections[k].out_off < connections[k].out_len)
+                polls[k].events |= POLLOUT;
+        }
+        // send again the runs turned away when nothing else would let them
+        n = poll(polls, connections_len, held && in_flight == 0 ? 100 : -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (n == 0)
+            held = 0;
+        for (k = connections_len - 1; k >= 0; k--) {
+            c = &connections[k];
+            if ((polls[k].revents & POLLOUT) && send_frame(c) == -1) {
+                drop_connection(socket_path, k, 1);
+                continue;
+            }
+            if ((polls[k].revents & (POLLIN | POLLHUP | POLLERR)) && recv_replies(c) == -1) {
+                drop_connection(socket_path, k, 1);
+                continue;
+            }
+            // a connection of its own ends with the run
+            if (pipelining == 0 && c->frames == 0)
+                drop_connection(socket_path, k, 0);
+        }
+        // no more runs without the connection they were pipelined on
+        if (connections_len == 0 && pipelining != 0)
+            break;
+    }
+    while (connections_len > 0)
+        drop_connection(socket_path, connections_len - 1, 0);
+    merge_outputs();
+
+    print_summary(now() - started);
+    if (!eof || retries_len > 0)
+        failed = 1;
+    for (i=0; i<runs_len; i++)
+        if (!runs[i].done || runs[i].status != 0)
+            failed = 1;
+    // like xargs
+    return failed ? 123 : 0;
+}
+
+
+int main(int argc, char* argv[]) {
     int socket_fd;
     char* socket_path;
     int i;
     char code_path[PATH_MAX];
+    char* code_paths[1] = { code_path };
+    char cwd[PATH_MAX] = {0};
+    char* cwds[1] = { cwd };
     char* *env;
-
-    int num;
-#define sendNum(NAME, VALUE) \
-    do { \
-        num = VALUE; \
-        if (write(socket_fd, &num, sizeof(num)) == -1) { perror(#NAME" write"); goto error; } \
-    } while (0)
-
-    char buf[BUFSIZ] = {0};
-#define sendStr(NAME, PTR) \
-    do { \
-        sendNum(NAME length, strlen(PTR)); \
-        if (write(socket_fd, PTR, num) == -1) { perror(#NAME " write"); goto error; } \
-    } while (0)
+    zygote_frame_t header = { ZYGOTE_VERSION, 0, 0, ZYGOTE_CAP_OPTIONS | ZYGOTE_CAP_THREAD };
+    zygote_reply_t record;
+    char* payload = NULL;
+    int payload_cap = 0;
+    int fds[5] = { 0, 1, 2, ZYGOTE_FORKSRV_FD, ZYGOTE_FORKSRV_FD + 1 };
+    int nfds = 3;
+    char* options[16];
+    int num_options = 0;
+    int c;
+    int timing = 0;
+    int own_child = 0;
+    int fork_server = 0;
+    int batch = 0;
+    char shards[32] = "";
+    char reduction[48];
+    char* unit;
+    unsigned long long size;
+    int procs = sysconf(_SC_NPROCESSORS_ONLN);
+    FILE* input = stdin;
+    char priority[32];
+    long long times[ZYGOTE_TIMES] = {0};
+    long long rusage[ZYGOTE_RUSAGES] = {0};
+    int has_rusage = 0;
+    long long cgroup[ZYGOTE_CGROUP_STATS] = {0};
+    int has_cgroup = 0;
+    int zygote_caps = 0;
+    int status = -1;
+    int exited = 0;
+    static struct option long_options[] = {
+        { "dirty",  optional_argument, NULL, 'd' },
+        { "timing", no_argument,       NULL, 't' },
+        { "priority", required_argument, NULL, 'p' },
+        { "thread", no_argument,       NULL, 'T' },
+        { "fork",   no_argument,       NULL, 'F' },
+        { "forkserver", no_argument,   NULL, 'S' },
+        { "shards", required_argument, NULL, 's' },
+        { "reduction", required_argument, NULL, 'r' },
+        { "batch",  no_argument,       NULL, 'b' },
+        { "max-procs", required_argument, NULL, 'P' },
+        { "arg-file", required_argument, NULL, 'a' },
+        { "output-dir", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
 
     // check arguments
-    if (argc < 3) {
+    while ((c = getopt_long(argc, argv, "+d::tp:TFSs:r:bP:a:o:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 't':
+                timing = 1;
+                options[num_options++] = "timing=1";
+                break;
+            case 'p':
+                if (strcmp(optarg, "interactive") != 0 && strcmp(optarg, "normal") != 0 &&
+                        strcmp(optarg, "batch") != 0)
+                    goto usage;
+                snprintf(priority, sizeof(priority), "priority=%s", optarg);
+                options[num_options++] = priority;
+                break;
+            case 'T':
+                options[num_options++] = "thread=1";
+                break;
+            case 'F':
+                own_child = 1;
+                break;
+            case 'S':
+                fork_server = own_child = 1;
+                break;
+            case 's':
+                if (atoi(optarg) <= 0)
+                    goto usage;
+                snprintf(shards, sizeof(shards), "shards=%d", atoi(optarg));
+                options[num_options++] = shards;
+                own_child = 1;
+                break;
+            case 'r':
+                size = strtoull(optarg, &unit, 10);
+                switch (*unit) {
+                    case 'G': size <<= 10;
+                    case 'M': size <<= 10;
+                    case 'K': size <<= 10;
+                    case '\0': break;
+                    default: goto usage;
+                }
+                if (size == 0)
+                    goto usage;
+                snprintf(reduction, sizeof(reduction), "reduction=%llu", size);
+                options[num_options++] = reduction;
+                break;
+            case 'b':
+                batch = 1;
+                break;
+            case 'P':
+                procs = atoi(optarg);
+                if (procs <= 0)
+                    goto usage;
+                break;
+            case 'a':
+                if ((input = fopen(optarg, "r")) == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                batch_dir = optarg;
+                break;
+            case 'd':
+                if (optarg == NULL)
+                    options[num_options++] = "dirty=1";
+                else if (strcmp(optarg, "trap") == 0)
+                    options[num_options++] = "dirty=2";
+                else
+                    goto usage;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    // every run of a batch ends with its exit status, while it serves a fuzzer
+    // for good
+    if (batch && (timing || fork_server))
+        goto usage;
+    // which each fork children of their own
+    if (fork_server && shards[0] != '\0')
+        goto usage;
+    if (own_child) {
+        options[num_options++] = "thread=0";
+        options[num_options++] = "worker=0";
+    }
+    if (fork_server) {
+        // as run by an AFL-style fuzzer
+        if (fcntl(ZYGOTE_FORKSRV_FD, F_GETFD) == -1 || fcntl(ZYGOTE_FORKSRV_FD + 1, F_GETFD) == -1) {
+            fprintf(stderr, "grow: --forkserver needs the pipes of a fuzzer on descriptors %d and %d\n",
+                    ZYGOTE_FORKSRV_FD, ZYGOTE_FORKSRV_FD + 1);
+            return 1;
+        }
+        options[num_options++] = "forkserver=1";
+        nfds = 5;
+    }
+    if (argc - optind < 2) {
+usage:
         fprintf(stdout,
                 "grow -- Feed a runnable to grow the libzygote process\n"
-                "Usage: grow ZYGOTE_SOCKET_PATH RUNNABLE_SHARED_OBJECT_PATH [ARG]...\n"
+                "Usage: grow [OPTION]... ZYGOTE_SOCKET_PATH RUNNABLE_SHARED_OBJECT_PATH [ARG]...\n"
+                "  or:  grow --batch [-P N] [OPTION]... ZYGOTE_SOCKET_PATH RUNNABLE_SHARED_OBJECT_PATH [ARG]...\n"
+                "\n"
+                "  -d, --dirty         report the pages run() copies from the zygote\n"
+                "      --dirty=trap    also report the instructions writing to the regions\n"
+                "                      registered with zygote_register()\n"
+                "  -t, --timing        show when each step of the request happened, and\n"
+                "                      the resources used by the child\n"
+                "  -p, --priority=CLASS\n"
+                "                      ask for the turns and scheduling of CLASS, one of\n"
+                "                      interactive, normal or batch, but no higher than\n"
+                "                      the zygote grants to this user\n"
+                "  -T, --thread        run run_thread() on a thread of the zygote's executor\n"
+                "                      instead of forking a child, e.g., for code the\n"
+                "                      zygote can't look into\n"
+                "  -F, --fork          run in a child forked for this request alone, rather\n"
+                "                      than on a thread or in a worker kept by the zygote\n"
+                "  -S, --forkserver    serve as the fork server of an AFL-style fuzzer,\n"
+                "                      running the code for every input it sends, until\n"
+                "                      it's done\n"
+                "  -s, --shards=N      run the code in N children at once, each on the\n"
+                "                      shard zygote_shard() tells, followed by reduce()\n"
+                "                      of the code, if any, once they all succeed\n"
+                "  -r, --reduction=SIZE\n"
+                "                      size of the buffer from zygote_reduction() the\n"
+                "                      shards share, in bytes or with K, M or G, 1M by\n"
+                "                      default, 1G at most\n"
+                "  -b, --batch         run the code once for each line of arguments read\n"
+                "                      from stdin, appended to the ARGs, and print a\n"
+                "                      summary of the exit statuses and latencies\n"
+                "  -P, --max-procs=N   keep up to N runs of a batch going at a time, as\n"
+                "                      many as there are processors by default\n"
+                "  -a, --arg-file=FILE read the lines of arguments from FILE instead\n"
+                "  -o, --output-dir=DIR\n"
+                "                      write the stdout and stderr of the run for line K\n"
+                "                      to DIR/K.out and DIR/K.err, instead of merging the\n"
+                "                      stdouts in the order of the lines, and the stderrs\n"
+                "                      as they come\n"
+                "\n"
+                "Exits with the status of run(), or 75 if the zygote is too busy to take\n"
+                "the request.  A batch exits with 0 if every run exited with 0, and 123\n"
+                "otherwise.  Its runs get /dev/null as stdin, and are sent again when\n"
+                "the zygote is too busy.\n"
                 "\n"
                 "For more info, see: https://github.com/netj/libzygote/#readme\n"
                 );
         return 1;
     }
-    socket_path = argv[1];
-    if (realpath(argv[2], code_path) == NULL) {
-        perror(argv[2]);
+    socket_path = argv[optind];
+    if (realpath(argv[optind + 1], code_path) == NULL) {
+        perror(argv[optind + 1]);
         return -1;
     }
 
     // open socket
-    unix_socket_name.sun_family = AF_UNIX;
-    if (strlen(socket_path) >= UNIX_PATH_MAX - 1) {
-        fprintf(stderr, "%s: pathname too long", socket_path);
+    times[ZYGOTE_TIME_CONNECT] = now();
+    socket_fd = connect_zygote(socket_path);
+    if (socket_fd == -1)
         return -1;
-    }
-    strcpy(unix_socket_name.sun_path, socket_path);
-    socket_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (socket_fd == -1) {
-        perror(socket_path);
-        return -1;
-    }
-    if (connect(socket_fd, (struct sockaddr*)&unix_socket_name, sizeof(unix_socket_name))) {
-        perror(socket_path);
-        close(socket_fd);
-        socket_fd = -1;
-        return -1;
-    }
 
-    // send libzygote version
-    sendNum(version, ZYGOTE_VERSION);
+    // build a frame with the whole request
+    append(&header, sizeof(header));
+    append_section(ZYGOTE_SECTION_CODE, 1, code_paths);
+    for (i = 0, env = environ; *env; env++)
+        i++;
+    append_section(ZYGOTE_SECTION_ENV, i, environ);
+    getcwd(cwd, sizeof(cwd));
+    append_section(ZYGOTE_SECTION_CWD, 1, cwds);
+    if (batch)
+        return run_batch(socket_path, socket_fd, input, procs,
+                argc - optind - 2, argv + optind + 2, num_options, options);
+    append_section(ZYGOTE_SECTION_ARGV, argc - optind - 2, argv + optind + 2);
+    if (num_options > 0)
+        append_section(ZYGOTE_SECTION_OPTION, num_options, options);
+    header.length = frame_len - sizeof(header);
+    memcpy(frame, &header, sizeof(header));
+
+    // and send it with our stdin, stdout, stderr in one go
+    if (write_fds(socket_fd, frame, frame_len, fds, nfds) == -1) { perror("request write"); goto error; }
+    times[ZYGOTE_TIME_SENT] = now();
 
-    // get pid
-    if (read(socket_fd, &pid, sizeof(pid)) == -1) { perror("pid read"); goto error; }
+    // handle replies until we get the exit status, or the reaper's with timing
     signal(SIGHUP,  forward_signal);
     signal(SIGINT,  forward_signal);
     signal(SIGQUIT, forward_signal);
@@ -162,39 +922,67 @@ int main(int argc, char* argv[]) {
     signal(SIGUSR2, forward_signal);
     signal(SIGALRM, forward_signal);
     signal(SIGTERM, forward_signal);
-
-    // send environ
-    for (i = 0, env = environ; *env; env++)
-        i++;
-    sendNum(envc, i);
-    for (env = environ; *env; env++) {
-        sendStr(environ_i, *env);
-    }
-
-    // send cwd
-    getcwd(buf, sizeof(buf));
-    sendStr(cwd, buf);
-
-    // send argc
-    sendNum(argc, argc - 2);
-
-    // send code_path
-    sendStr(argv_0, code_path);
-
-    // send argv
-    for (i=3; i<argc; i++) {
-        sendStr(argv_i, argv[i]);
+    for (;;) {
+        if (read_all(socket_fd, &record, sizeof(record)) == -1) {
+            if (exited)
+                break;
+            fprintf(stderr, "%s: %s\n", socket_path, pid == -1 ? "request refused" : "connection lost");
+            goto error;
+        }
+        if (record.length < 0)
+            goto error;
+        if (record.length + 1 > payload_cap) {
+            payload_cap = record.length + 1 < sizeof(int) * 2 ? sizeof(int) * 2 : record.length + 1;
+            payload = (char *) realloc(payload, payload_cap);
+        }
+        memset(payload, 0, payload_cap);
+        if (read_all(socket_fd, payload, record.length) == -1)
+            goto error;
+        // ignore what we don't understand
+        switch (record.type) {
+            case ZYGOTE_REPLY_PID:
+                memcpy(&pid, payload, sizeof(int));
+                if (record.length >= 2 * sizeof(int))
+                    memcpy(&zygote_caps, payload + sizeof(int), sizeof(int));
+                // don't signal the executor shared with other requests
+                pid_shared = (zygote_caps & ZYGOTE_CAP_THREAD) != 0;
+                break;
+            case ZYGOTE_REPLY_REPORT:
+                fputs(payload, stderr);
+                break;
+            case ZYGOTE_REPLY_TIMING:
+                // merge what the child and its reaper know
+                for (i=0; i<ZYGOTE_TIMES && (i + 1) * sizeof(long long) <= record.length; i++)
+                    if (((long long *) payload)[i] != 0 && i != ZYGOTE_TIME_CONNECT && i != ZYGOTE_TIME_SENT)
+                        times[i] = ((long long *) payload)[i];
+                break;
+            case ZYGOTE_REPLY_RUSAGE:
+                for (i=0; i<ZYGOTE_RUSAGES && (i + 1) * sizeof(long long) <= record.length; i++)
+                    rusage[i] = ((long long *) payload)[i];
+                has_rusage = 1;
+                break;
+            case ZYGOTE_REPLY_CGROUP:
+                for (i=0; i<ZYGOTE_CGROUP_STATS && (i + 1) * sizeof(long long) <= record.length; i++)
+                    cgroup[i] = ((long long *) payload)[i];
+                has_cgroup = 1;
+                break;
+            case ZYGOTE_REPLY_BUSY:
+                fprintf(stderr, "%s: busy with %d running and %d waiting, try again later\n",
+                        socket_path, ((int *) payload)[0], ((int *) payload)[1]);
+                break;
+            case ZYGOTE_REPLY_EXIT:
+                memcpy(&status, payload, sizeof(int));
+                exited = 1;
+                pid = -1;
+                break;
+        }
+        if (exited && !(timing && (zygote_caps & ZYGOTE_CAP_TIMING)))
+            break;
     }
-
-    // pass file descriptors
-    if (write_fd(socket_fd, buf, 1, 2) == -1) { perror("stderr send_fd"); goto error; }
-    if (write_fd(socket_fd, buf, 1, 1) == -1) { perror("stdout send_fd"); goto error; }
-    if (write_fd(socket_fd, buf, 1, 0) == -1) { perror("stdin  send_fd"); goto error; }
-
-    // get exit code
-    if (read(socket_fd, &num, sizeof(num)) == -1) { perror("exitcode read"); goto error; }
     close(socket_fd);
-    return num;
+    if (timing)
+        print_timing(times, rusage, has_rusage, cgroup, has_cgroup);
+    return status;
 
 error:
     close(socket_fd);
@@ -0,0 +1,20 @@
+/* echoes back everything a request carries, exiting with argc */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int run(int objc, void* objv[], int argc, char* argv[]) {
+    char buf[BUFSIZ];
+    int i;
+    printf("%s", (char *) objv[0]);
+    for (i=1; i<argc; i++)
+        printf(" [%s]", argv[i]);
+    getcwd(buf, sizeof(buf));
+    printf(" cwd=%s", strrchr(buf, '/') + 1);
+    printf(" GREETING=%s", getenv("GREETING") != NULL ? getenv("GREETING") : "");
+    if (fgets(buf, sizeof(buf), stdin) == NULL)
+        strcpy(buf, "\n");
+    printf(" stdin=%s", buf);
+    return argc;
+}
@@ -0,0 +1,6 @@
+/* zygote for the wire protocol tests */
+#include <zygote.h>
+
+int main(int argc, char* argv[]) {
+    return zygote("zygote.socket", "loaded", NULL);
+}
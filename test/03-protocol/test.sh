@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+# Test script for the wire protocol between grow and the zygote
+set -eu
+
+cd "$(dirname "$0")"
+cc -Wall -o main            $CFLAGS        main.c     $LDFLAGS $LIBS
+cc -Wall -o code.$so        $CFLAGS -fPIC  code.c     $LDFLAGS $sharedflag $LIBS
+cc -Wall -o unframed        $CFLAGS        unframed.c
+
+hr="################################################################################"
+progress() {
+    printf >&2 "### %s ${hr:0:$((80 - ${#1} - 5))}\n" "$1"
+}
+
+# run a command, checking its exit status and what it writes to stdout
+expect() {
+    local status=$1 expected=$2; shift 2
+    local actual=0
+    (set -x; "$@") >out.actual || actual=$?
+    [ $actual -eq $status ] || { echo >&2 "exit status $actual, expected $status"; return 1; }
+    diff -u <(printf "%s" "${expected:+$expected$'\n'}") out.actual
+}
+
+progress "zygote: Launching..."
+rm -f zygote.socket
+./main 2>zygote.log &
+zygote=$!
+trap 'rm -f out.actual input; kill -TERM $zygote; wait $zygote || true' EXIT
+# not just bound, but listening
+let i=1; until grep -qs "listening to" zygote.log || [ $i -gt 50 ]; do sleep 0.1; let ++i; done
+[ -e zygote.socket ]
+
+progress "frame: Testing..."
+echo line >input
+GREETING="hello there" expect 4 "loaded [a b] [] [c] cwd=03-protocol GREETING=hello there stdin=line" \
+    grow zygote.socket code.$so "a b" "" c <input
+expect 1 "loaded cwd=03-protocol GREETING= stdin=" \
+    grow zygote.socket code.$so </dev/null
+progress "frame: OK"
+
+progress "unframed version 2: Testing..."
+GREETING=v2 expect 3 "loaded [x] [y z] cwd=03-protocol GREETING=v2 stdin=line" \
+    ./unframed 2 zygote.socket code.$so x "y z" <input
+progress "unframed version 2: OK"
+
+progress "malformed requests: Testing..."
+expect 255 "" ./unframed 9 zygote.socket code.$so 2>/dev/null
+expect 0 "" ./unframed truncated zygote.socket code.$so
+expect 2 "loaded [still] cwd=03-protocol GREETING= stdin=" \
+    grow zygote.socket code.$so still </dev/null
+grep -q "version mismatch" zygote.log
+grep -q "truncated frame received" zygote.log
+progress "malformed requests: OK"
+
+progress "closed stdio: Testing..."
+# descriptors of a zygote started without stdio come in as 0, 1 and 2
+for env in ZYGOTE_POOL_SIZE=0 ZYGOTE_POOL_SIZE=1; do
+    kill -TERM $zygote; wait $zygote || true
+    rm -f zygote.socket
+    env $env ./main <&- >&- 2>&- &
+    zygote=$!
+    # with nothing logged, until the kernel lists it as listening
+    let i=1; until grep -Eq " 00010000 0001 01 +[0-9]+ zygote\.socket$" /proc/net/unix || [ $i -gt 50 ]; do sleep 0.1; let ++i; done
+    for i in 1 2; do
+        expect 2 "loaded [$env] cwd=03-protocol GREETING= stdin=line" \
+            grow zygote.socket code.$so $env <input
+    done
+done
+progress "closed stdio: OK"
@@ -0,0 +1,100 @@
+/* grow of the first releases, speaking the unframed protocol with the version
+ * given as the first argument, or "truncated" sending half a frame header and
+ * hanging up */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <zygote-protocol.h>
+
+extern char* *environ;
+
+static int socket_fd;
+
+static void send_num(int num) {
+    if (write(socket_fd, &num, sizeof(num)) != sizeof(num)) { perror("write"); exit(255); }
+}
+
+static void send_str(const char* str) {
+    send_num(strlen(str));
+    if (write(socket_fd, str, strlen(str)) != strlen(str)) { perror("write"); exit(255); }
+}
+
+static void send_fd(int fd) {
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = { "", 1 };
+    struct msghdr msg = {0};
+    struct cmsghdr* cmptr;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmptr = CMSG_FIRSTHDR(&msg);
+    cmptr->cmsg_len = CMSG_LEN(sizeof(int));
+    cmptr->cmsg_level = SOL_SOCKET;
+    cmptr->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmptr), &fd, sizeof(int));
+    if (sendmsg(socket_fd, &msg, 0) == -1) { perror("sendmsg"); exit(255); }
+}
+
+int main(int argc, char* argv[]) {
+    struct sockaddr_un address = {0};
+    char code_path[PATH_MAX], cwd[PATH_MAX];
+    char* *env;
+    int version, num, i;
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: unframed VERSION|truncated SOCKET CODE [ARG]...\n");
+        return 2;
+    }
+    // a refused request shows as an error, not a signal
+    signal(SIGPIPE, SIG_IGN);
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[2], sizeof(address.sun_path) - 1);
+    socket_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == -1 || connect(socket_fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        perror(argv[2]);
+        return 255;
+    }
+    if (strcmp(argv[1], "truncated") == 0) {
+        zygote_frame_t header = { ZYGOTE_VERSION, 1024, 1, 0 };
+        if (write(socket_fd, &header, sizeof(header) / 2) == -1) { perror("write"); return 255; }
+        close(socket_fd);
+        return 0;
+    }
+    version = atoi(argv[1]);
+    if (realpath(argv[3], code_path) == NULL) {
+        perror(argv[3]);
+        return 255;
+    }
+
+    send_num(version);
+    if (read(socket_fd, &num, sizeof(num)) != sizeof(num)) {
+        fprintf(stderr, "%s: request refused\n", argv[2]);
+        return 255;
+    }
+    for (i=0, env=environ; *env != NULL; env++)
+        i++;
+    send_num(i);
+    for (env=environ; *env != NULL; env++)
+        send_str(*env);
+    send_str(getcwd(cwd, sizeof(cwd)));
+    send_num(argc - 3);
+    send_str(code_path);
+    for (i=4; i<argc; i++)
+        send_str(argv[i]);
+    send_fd(2);
+    send_fd(1);
+    send_fd(0);
+    if (read(socket_fd, &num, sizeof(num)) != sizeof(num)) {
+        fprintf(stderr, "%s: connection lost\n", argv[2]);
+        return 255;
+    }
+    return num;
+}
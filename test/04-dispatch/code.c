@@ -0,0 +1,18 @@
+/* tells which build of it runs, and how many times run() ran in the process,
+ * after sleeping for the milliseconds given, if any */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef BUILD
+#define BUILD "v1"
+#endif
+
+static int calls = 0;
+
+int run(int objc, void* objv[], int argc, char* argv[]) {
+    if (argc > 1)
+        usleep(atoi(argv[1]) * 1000);
+    printf("%s calls=%d pid=%d\n", BUILD, ++calls, getpid());
+    return 0;
+}
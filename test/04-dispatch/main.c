@@ -0,0 +1,6 @@
+/* zygote for the dispatch tests */
+#include <zygote.h>
+
+int main(int argc, char* argv[]) {
+    return zygote("zygote.socket", "loaded", NULL);
+}
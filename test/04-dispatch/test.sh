@@ -0,0 +1,204 @@
+#!/usr/bin/env bash
+# Test script for how the zygote dispatches requests to the processes
+# serving them
+set -eu
+
+cd "$(dirname "$0")"
+cc -Wall -o main            $CFLAGS        main.c     $LDFLAGS $LIBS
+cc -Wall -o code.$so        $CFLAGS -fPIC  code.c     $LDFLAGS $sharedflag $LIBS
+cc -Wall -o thread.$so      $CFLAGS -fPIC  thread.c   $LDFLAGS $sharedflag $LIBS
+cc -Wall -o slow.$so        $CFLAGS -fPIC  thread.c   $LDFLAGS $sharedflag $LIBS -DLOAD_DELAY=1000
+
+hr="################################################################################"
+progress() {
+    printf >&2 "### %s ${hr:0:$((80 - ${#1} - 5))}\n" "$1"
+}
+
+# launch a zygote with the given environment, shutting down the last one
+zygote=
+launch() {
+    [ -z "$zygote" ] || { kill -TERM $zygote; wait $zygote || true; }
+    rm -f zygote.socket
+    listening=$(grep -s "listening to" zygote.log | wc -l)
+    env "$@" ./main 2>>zygote.log &
+    zygote=$!
+    # not just bound, but listening
+    let i=1; until [ $(grep -s "listening to" zygote.log | wc -l) -gt $listening -o $i -gt 50 ]; do sleep 0.1; let ++i; done
+    [ -e zygote.socket ]
+}
+trap '[ -z "$zygote" ] || { kill -TERM $zygote; wait $zygote || true; }' EXIT
+rm -f zygote.log
+
+# a counter of the zygote's statistics
+count() {
+    zygote-top -1 zygote.socket | grep -Eo "$1 +[0-9]+" | grep -Eo "[0-9]+$"
+}
+
+# what grow prints, without the pid
+run() {
+    (set -x; grow zygote.socket code.$so "$@") | cut -d' ' -f1,2
+}
+
+progress "pool: Testing..."
+launch ZYGOTE_POOL_SIZE=2
+for i in 1 2 3; do
+    [ "$(run)" = "v1 calls=1" ]
+done
+[ $(count pooled) -ge 2 ]
+progress "pool: OK"
+
+progress "code cache: Testing..."
+launch ZYGOTE_CODE_CACHE_SIZE=2
+[ "$(run)" = "v1 calls=1" ]
+[ "$(run)" = "v1 calls=1" ]
+# rebuilding the code must not leave the sub-zygote of the old one in use
+cc -Wall -o code.$so $CFLAGS -fPIC -DBUILD='"v2"' code.c $LDFLAGS $sharedflag $LIBS
+[ "$(run)" = "v2 calls=1" ]
+[ "$(run)" = "v2 calls=1" ]
+[ $(count loaded) -eq 2 ]
+[ $(count cached) -eq 2 ]
+grep -q "evicting sub-zygote" zygote.log
+progress "code cache: OK"
+
+progress "statistics: Testing..."
+kill -TERM $zygote; wait $zygote || true; zygote=
+# a link left where the statistics go is replaced, not followed
+echo untouched >stats.target
+ln -s stats.target zygote.socket.stats
+launch
+run >/dev/null
+run >/dev/null
+[ -f zygote.socket.stats -a ! -L zygote.socket.stats ]
+[ "$(cat stats.target)" = untouched ]
+rm -f stats.target
+[ $(count requests) -eq 2 ]
+[ $(count forked) -eq 2 ]
+zygote-top -1 zygote.socket | grep -Eq "^ +2  .*/code\.$so$"
+progress "statistics: OK"
+
+progress "queue: Testing..."
+launch ZYGOTE_MAX_IN_FLIGHT=1 ZYGOTE_QUEUE_SIZE=1
+run 1000 >out.running &
+running=$!
+sleep 0.3
+run 0 >out.waiting &
+waiting=$!
+sleep 0.3
+# turned away with the queue full
+status=0; grow zygote.socket code.$so 0 || status=$?
+[ $status -eq 75 ]
+wait $running $waiting
+[ "$(cat out.running out.waiting)" = "$(printf 'v2 calls=1\nv2 calls=1')" ]
+rm -f out.running out.waiting
+[ $(count busy) -eq 1 ]
+[ $(count waited) -eq 1 ]
+progress "queue: OK"
+
+progress "replicas: Testing..."
+# the limit holds for all replicas together, with none queued
+launch ZYGOTE_REPLICAS=2 ZYGOTE_MAX_IN_FLIGHT=2 ZYGOTE_QUEUE_SIZE=0
+sleep 0.5
+for i in $(seq 16); do
+    { status=0; grow zygote.socket code.$so 1000 >/dev/null 2>&1 || status=$?; echo $status; } &
+done >statuses
+wait $(jobs -p | grep -vx $zygote)
+[ $(grep -cx 0 statuses) -ge 1 ]
+[ $(grep -cx 0 statuses) -le 2 ]
+[ $(grep -cx 75 statuses) -eq $(( 16 - $(grep -cx 0 statuses) )) ]
+rm -f statuses
+progress "replicas: OK"
+
+progress "NUMA replicas: Testing..."
+# a replica for every node, or none on a single one
+lines=$(wc -l <zygote.log)
+launch ZYGOTE_NUMA_REPLICAS=1
+[ "$(run)" = "v2 calls=1" ]
+sleep 0.5
+log=$(tail -n +$((lines + 1)) zygote.log)
+if [ $(ls -d /sys/devices/system/node/node[0-9]* | wc -l) -gt 1 ]; then
+    grep -Eq "accepting with [0-9]+ replicas" <<<"$log"
+    grep -Eq "replica 0 on node [0-9]+, with [0-9]+ pages moved there" <<<"$log"
+    grep -Eq "replica 1 on node [0-9]+, with [0-9]+ pages moved there" <<<"$log"
+else
+    grep -q "not replicating on a single NUMA node" <<<"$log"
+    ! grep -q "accepting with" <<<"$log"
+fi
+progress "NUMA replicas: OK"
+
+progress "respawning replicas: Testing..."
+# the replicas forked by the zygote, once there are two
+replicas() {
+    let i=1; until [ $(pgrep -P $zygote | wc -l) -eq 2 -o $i -gt 50 ]; do sleep 0.1; let ++i; done
+    pgrep -P $zygote
+}
+launch ZYGOTE_REPLICAS=3
+[ $(replicas | wc -l) -eq 2 ]
+# zygote-top adds up what they all served
+for i in $(seq 12); do
+    grow zygote.socket code.$so 100 >/dev/null &
+done
+wait $(jobs -p | grep -vx $zygote)
+[ $(count requests) -eq 12 ]
+[ $(count forked) -eq 12 ]
+# one that dies comes back
+replica=$(replicas | head -n 1)
+kill -KILL $replica
+sleep 1
+[ $(replicas | wc -l) -eq 2 ]
+[ -z "$(replicas | grep -x $replica)" ]
+grep -q "replica $replica is gone, respawning it" zygote.log
+[ "$(run)" = "v2 calls=1" ]
+progress "respawning replicas: OK"
+
+progress "threads: Testing..."
+launch
+# code defining run_thread() runs on the threads of a single executor
+first=$(grow zygote.socket thread.$so)
+[[ "$first" =~ ^thread\ pid=[0-9]+$ ]]
+[ "$(grow --thread zygote.socket thread.$so)" = "$first" ]
+[ $(count thread) -eq 2 ]
+# unless it asks for a child of its own
+[ "$(grow --fork zygote.socket thread.$so)" = "forked" ]
+# or the code has nothing to run there
+[ "$(grow --thread zygote.socket code.$so | cut -d" " -f1,2)" = "v2 calls=1" ]
+# which goes on serving what it loaded while it loads more
+grow zygote.socket slow.$so >out.slow &
+slow=$!
+sleep 0.2
+start=$(date +%s%N)
+[ "$(grow zygote.socket thread.$so)" = "$first" ]
+[ $(( ($(date +%s%N) - start) / 1000000 )) -lt 500 ]
+wait $slow
+[ "$(cat out.slow)" = "$first" ]
+rm -f out.slow
+[ $(count thread) -eq 4 ]
+progress "threads: OK"
+
+progress "workers: Testing..."
+launch ZYGOTE_WORKERS=1 ZYGOTE_WORKER_REQUESTS=2
+# what run() leaves behind is seen by the next request
+[ "$(run)" = "v2 calls=1" ]
+[ "$(run)" = "v2 calls=2" ]
+# until the worker is recycled
+[ "$(run)" = "v2 calls=1" ]
+[ $(count worker) -eq 3 ]
+# unless grow asks for a child of its own
+[ "$(grow --fork zygote.socket code.$so | cut -d" " -f1,2)" = "v2 calls=1" ]
+[ $(count worker) -eq 3 ]
+progress "workers: OK"
+
+progress "worker reset: Testing..."
+launch ZYGOTE_WORKERS=1 ZYGOTE_WORKER_RESET=1
+first=$(grow zygote.socket code.$so)
+second=$(grow zygote.socket code.$so)
+# nothing left behind by run()
+[ "${first% *}" = "v2 calls=1" ]
+[ "${second% *}" = "v2 calls=1" ]
+if grep -q "without a snapshot" zygote.log; then
+    echo >&2 "worker reset not supported here, the worker was recycled instead"
+else
+    # by the same worker, reset in between
+    [ "${first##* }" = "${second##* }" ]
+fi
+[ $(count worker) -eq 2 ]
+progress "worker reset: OK"
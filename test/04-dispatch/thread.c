@@ -0,0 +1,22 @@
+/* tells whether it ran on a thread of the executor, and in which process,
+ * taking the milliseconds of LOAD_DELAY to load */
+#include <stdio.h>
+#include <unistd.h>
+#include <zygote.h>
+
+#ifdef LOAD_DELAY
+__attribute__((constructor))
+static void load(void) {
+    usleep(LOAD_DELAY * 1000);
+}
+#endif
+
+int run(int objc, void* objv[], int argc, char* argv[]) {
+    printf("forked\n");
+    return 0;
+}
+
+int run_thread(int objc, void* objv[], int argc, char* argv[], zygote_stdio_t* stdio) {
+    fprintf(stdio->out, "thread pid=%d\n", getpid());
+    return 0;
+}
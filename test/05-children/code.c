@@ -0,0 +1,169 @@
+/* does what the first argument says, in a child of the zygote */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zygote.h>
+
+// resident memory of this process in KiB
+static long resident(void) {
+    char line[256];
+    long kb = -1;
+    FILE* status = fopen("/proc/self/status", "r");
+    while (status != NULL && fgets(line, sizeof(line), status) != NULL)
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+            break;
+    if (status != NULL)
+        fclose(status);
+    return kb;
+}
+
+// allocates well beyond the arena, checking nothing gets lost or leaks
+static int allocate(char* greeting) {
+    enum { N = 4096, BLOCK = 4 << 20 };
+    static char* blocks[N];
+    long before;
+    char* p;
+    void* aligned;
+    int i;
+    // what the zygote allocated is left alone
+    free(greeting);
+    for (i=0; i<N; i++) {
+        blocks[i] = (char *) malloc(i % 512 + 1);
+        memset(blocks[i], i & 0xff, i % 512 + 1);
+    }
+    for (i=0; i<N; i+=2) {
+        blocks[i] = (char *) realloc(blocks[i], 1024);
+        if (blocks[i][i % 512] != (char) (i & 0xff))
+            return 1;
+    }
+    if (posix_memalign(&aligned, 4096, 100) != 0 || (size_t) aligned % 4096 != 0)
+        return 1;
+    p = (char *) calloc(1000, 1);
+    for (i=0; i<1000; i++)
+        if (p[i] != 0)
+            return 1;
+    free(p);
+    free(aligned);
+    for (i=0; i<N; i++)
+        free(blocks[i]);
+    // blocks from beyond the arena go back where they came from
+    before = resident();
+    for (i=0; i<64; i++) {
+        p = (char *) malloc(BLOCK);
+        memset(p, 1, BLOCK);
+        free(p);
+    }
+    if (resident() - before > 64 << 10)
+        return 1;
+    printf("%s\n", greeting);
+    return 0;
+}
+
+// prints the line of the cgroup v2 this process is in
+static int cgroup(void) {
+    char line[4096];
+    FILE* cgroups = fopen("/proc/self/cgroup", "r");
+    while (cgroups != NULL && fgets(line, sizeof(line), cgroups) != NULL)
+        if (strncmp(line, "0::", 3) == 0)
+            printf("%s", line);
+    if (cgroups != NULL)
+        fclose(cgroups);
+    return cgroups == NULL;
+}
+
+// prints the CPUs this process may run on
+static int cpus(void) {
+    char line[4096];
+    FILE* status = fopen("/proc/self/status", "r");
+    while (status != NULL && fgets(line, sizeof(line), status) != NULL)
+        if (strncmp(line, "Cpus_allowed_list:", 18) == 0)
+            printf("%s", line + 18 + strspn(line + 18, " \t"));
+    if (status != NULL)
+        fclose(status);
+    return status == NULL;
+}
+
+// adds up the numbers of a range, into the sum the helpers share
+static void add(long lo, long hi, void* ctx) {
+    long sum = 0;
+    long i;
+    for (i=lo; i<hi; i++)
+        sum += i;
+    __atomic_fetch_add((long *) ctx, sum, __ATOMIC_RELAXED);
+}
+
+// prints the sum of the numbers below n, spread over the helpers
+static int sum(long n) {
+    long* total = (long *) zygote_scratch(sizeof(long));
+    if (total == NULL || zygote_parallel_for(0, n, add, total) == -1)
+        return 1;
+    printf("%ld\n", *total);
+    munmap(total, sizeof(long));
+    return 0;
+}
+
+// leaves the number of its shard, counting from 1, where reduce() adds it up
+static int shard(int ms) {
+    size_t len;
+    int count, i = zygote_shard(&count);
+    long* partial = (long *) zygote_reduction(&len);
+    if (partial == NULL || len < count * sizeof(long))
+        return 1;
+    partial[i] = i + 1;
+    usleep(ms * 1000);
+    return 0;
+}
+
+int run(int objc, void* objv[], int argc, char* argv[]) {
+    char value[256];
+    long len;
+    int i;
+    if (argc == 2 && strcmp(argv[1], "exit") == 0) {
+        // left in the buffer of stdout
+        printf("bye");
+    } else if (argc == 2 && strcmp(argv[1], "allocate") == 0) {
+        return allocate((char *) objv[0]);
+    } else if (argc == 3 && strcmp(argv[1], "touch") == 0) {
+        // a byte on each of the first pages of the table
+        for (i=0; i<atoi(argv[2]); i++)
+            ((char *) objv[1])[i << 12] = 2;
+    } else if (argc == 2 && strcmp(argv[1], "cgroup") == 0) {
+        return cgroup();
+    } else if (argc == 2 && strcmp(argv[1], "cpus") == 0) {
+        return cpus();
+    } else if (argc == 3 && strcmp(argv[1], "sum") == 0) {
+        return sum(atol(argv[2]));
+    } else if (argc >= 2 && argc <= 3 && strcmp(argv[1], "shard") == 0) {
+        return shard(argc == 3 ? atoi(argv[2]) : 0);
+    } else if (argc == 4 && strcmp(argv[1], "put") == 0) {
+        // for the children after this one
+        if (zygote_shared_cache_put((zygote_shared_cache_t *) objv[2], argv[2], strlen(argv[2]), argv[3], strlen(argv[3])) == -1) {
+            perror("zygote_shared_cache_put");
+            return 1;
+        }
+    } else if (argc == 3 && strcmp(argv[1], "get") == 0) {
+        len = zygote_shared_cache_get((zygote_shared_cache_t *) objv[2], argv[2], strlen(argv[2]), value, sizeof(value));
+        if (len == -1)
+            return 1;
+        printf("%.*s\n", (int) len, value);
+    } else {
+        fprintf(stderr, "usage: %s exit | allocate | touch PAGES | cgroup | cpus | sum N | shard [MS] | put KEY VALUE | get KEY\n", argv[0]);
+        return 2;
+    }
+    return 0;
+}
+
+// prints how many shards there were, what they added up to, and in how large
+// a buffer
+int reduce(int objc, void* objv[], int argc, char* argv[]) {
+    size_t len;
+    long* partial = (long *) zygote_reduction(&len);
+    long sum = 0;
+    int count, i;
+    for (zygote_shard(&count), i = 0; i < count; i++)
+        sum += partial[i];
+    printf("%d shards, sum %ld, %zu bytes\n", count, sum, len);
+    return 0;
+}
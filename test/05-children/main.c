@@ -0,0 +1,25 @@
+/* zygote whose state says goodbye when the process holding it exits, with a
+ * table for children to write to, and a cache they all share */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zygote.h>
+
+static char table[64 << 12] __attribute__((aligned(1 << 12)));
+
+static void goodbye(void) {
+    printf(" atexit");
+}
+
+int main(int argc, char* argv[]) {
+    char* greeting = strdup("allocated by the zygote");
+    zygote_shared_cache_t* cache = zygote_shared_cache(1 << 20, 256);
+    if (cache == NULL) {
+        perror("zygote_shared_cache");
+        return 1;
+    }
+    atexit(goodbye);
+    memset(table, 1, sizeof(table));
+    zygote_register("table", table, sizeof(table));
+    return zygote("zygote.socket", greeting, table, cache, NULL);
+}
@@ -0,0 +1,18 @@
+/* greets the arguments, noting each time it really ran in runs */
+#include <stdio.h>
+#include <zygote.h>
+
+const int zygote_pure = 1;
+
+int run(int objc, void* objv[], int argc, char* argv[]) {
+    FILE* runs = fopen("runs", "a");
+    int i;
+    if (runs != NULL) {
+        fprintf(runs, "%s\n", argc > 1 ? argv[1] : "");
+        fclose(runs);
+    }
+    for (i=1; i<argc; i++)
+        printf("hello %s\n", argv[i]);
+    fprintf(stderr, "greeted %d\n", argc - 1);
+    return argc - 1;
+}
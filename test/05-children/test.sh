@@ -0,0 +1,166 @@
+#!/usr/bin/env bash
+# Test script for how grown children run, and what they share with each
+# other
+set -eu
+
+cd "$(dirname "$0")"
+cc -Wall -o main            $CFLAGS        main.c     $LDFLAGS $LIBS
+cc -Wall -o code.$so        $CFLAGS -fPIC  code.c     $LDFLAGS $sharedflag $LIBS
+cc -Wall -o pure.$so        $CFLAGS -fPIC  pure.c     $LDFLAGS $sharedflag $LIBS
+
+hr="################################################################################"
+progress() {
+    printf >&2 "### %s ${hr:0:$((80 - ${#1} - 5))}\n" "$1"
+}
+
+# launch a zygote with the given environment, shutting down the last one
+zygote=
+launch() {
+    [ -z "$zygote" ] || { kill -TERM $zygote; wait $zygote || true; }
+    rm -f zygote.socket
+    listening=$(grep -s "listening to" zygote.log | wc -l)
+    env "$@" ./main >/dev/null 2>>zygote.log &
+    zygote=$!
+    # not just bound, but listening
+    let i=1; until [ $(grep -s "listening to" zygote.log | wc -l) -gt $listening -o $i -gt 50 ]; do sleep 0.1; let ++i; done
+    [ -e zygote.socket ]
+}
+trap '[ -z "$zygote" ] || { kill -TERM $zygote; wait $zygote || true; }; rm -f runs' EXIT
+rm -f zygote.log runs
+
+# a counter of the zygote's statistics
+count() {
+    zygote-top -1 zygote.socket | grep -Eo "$1 +[0-9]+" | grep -Eo "[0-9]+$"
+}
+
+progress "fast exit: Testing..."
+# what's left in stdio is flushed, but the zygote's atexit handlers don't run
+launch
+[ "$(grow zygote.socket code.$so exit)" = "bye" ]
+launch ZYGOTE_FAST_EXIT=0
+[ "$(grow zygote.socket code.$so exit)" = "bye atexit" ]
+progress "fast exit: OK"
+
+progress "arena: Testing..."
+# a megabyte of arena, full long before run() is done
+launch ZYGOTE_ARENA=1
+[ "$(grow zygote.socket code.$so allocate)" = "allocated by the zygote" ]
+progress "arena: OK"
+
+progress "dirty: Testing..."
+launch
+grow --dirty zygote.socket code.$so touch 3 2>dirty.report
+grep -Eq "^ +3 +of 64 pages of table" dirty.report
+# and where each of them was written from
+grow --dirty=trap zygote.socket code.$so touch 3 2>dirty.report
+[ $(grep -Ec "^write to table\+0x(0|[0-9a-f]*000) by 0x[0-9a-f]+ run\+0x[0-9a-f]+ \(.*/code\.$so\)$" dirty.report) -eq 3 ]
+# with none asked for
+[ -z "$(grow zygote.socket code.$so touch 3 2>&1)" ]
+rm -f dirty.report
+progress "dirty: OK"
+
+progress "cgroup: Testing..."
+# under a cgroup v2 of our own, if we may make one
+mount=$(awk '$3 == "cgroup2" { print $2; exit }' /proc/self/mounts)
+cgroup=$(sed -n 's|^0::/*|/|p' /proc/self/cgroup)
+cgroup=${cgroup%/}/libzygote-test.$$
+if [ -n "$mount" ] && mkdir "$mount$cgroup" 2>/dev/null; then
+    mkdir "$mount$cgroup"/zygote "$mount$cgroup"/children
+    # a leaf for each child, gone with it
+    launch ZYGOTE_CGROUP="$mount$cgroup"/children
+    echo $zygote >"$mount$cgroup"/zygote/cgroup.procs
+    out=$(grow --timing zygote.socket code.$so cgroup 2>err.actual)
+    [[ "$out" =~ ^0::$cgroup/children/grow-[0-9]+$ ]]
+    grep -q "^grow: cgroup: " err.actual
+    [ -z "$(find "$mount$cgroup"/children -mindepth 1 -type d)" ]
+    # or one for each priority class, gone with the zygote
+    launch ZYGOTE_CGROUP="$mount$cgroup"/children ZYGOTE_CGROUP_LEAVES=class
+    echo $zygote >"$mount$cgroup"/zygote/cgroup.procs
+    [ "$(grow zygote.socket code.$so cgroup)" = "0::$cgroup/children/normal" ]
+    [ "$(grow -p batch zygote.socket code.$so cgroup)" = "0::$cgroup/children/batch" ]
+    # once the last child is reaped
+    let i=1; until grep -qx "populated 0" "$mount$cgroup"/children/batch/cgroup.events || [ $i -gt 50 ]; do sleep 0.1; let ++i; done
+    kill -TERM $zygote; wait $zygote || true; zygote=
+    [ -z "$(find "$mount$cgroup"/children -mindepth 1 -type d)" ]
+    rmdir "$mount$cgroup"/zygote "$mount$cgroup"/children "$mount$cgroup"
+    rm -f err.actual
+    progress "cgroup: OK"
+else
+    progress "cgroup: skipped without a cgroup v2 to make"
+fi
+
+progress "placement: Testing..."
+# the CPUs in a list like 0-3,6
+expand() { local r; for r in ${1//,/ }; do seq ${r%-*} ${r#*-}; done; }
+launch
+[ "$(grow zygote.socket code.$so cpus)" = "$(sed -n 's/^Cpus_allowed_list:\s*//p' /proc/$zygote/status)" ]
+# pinned to one of the CPUs the zygote may run on, a different one each time
+# if it may run on more than one
+for policy in round-robin least-loaded; do
+    launch ZYGOTE_PLACEMENT=$policy
+    allowed=$(expand $(sed -n 's/^Cpus_allowed_list:\s*//p' /proc/$zygote/status))
+    first=$(grow zygote.socket code.$so cpus)
+    second=$(grow zygote.socket code.$so cpus)
+    grep -qx "$first" <<<"$allowed"
+    grep -qx "$second" <<<"$allowed"
+    [ $policy != round-robin -o $(wc -l <<<"$allowed") -eq 1 -o "$first" != "$second" ]
+    zygote-top -1 zygote.socket | grep -Eq "^ +placed +2 .* by $policy,"
+done
+progress "placement: OK"
+
+progress "shards: Testing..."
+launch
+[ "$(grow --shards=4 zygote.socket code.$so shard)" = "4 shards, sum 10, 1048576 bytes" ]
+# with a reduction no larger than 1 GiB
+[ "$(grow --shards=2 --reduction=4G zygote.socket code.$so shard)" = "2 shards, sum 3, 1073741824 bytes" ]
+# each counted against the children in flight, no more than those
+launch ZYGOTE_MAX_IN_FLIGHT=2
+[ "$(grow --shards=4 zygote.socket code.$so shard)" = "2 shards, sum 3, 1048576 bytes" ]
+grow --shards=2 zygote.socket code.$so shard 500 >/dev/null &
+sleep 0.2
+grow zygote.socket code.$so exit >/dev/null
+wait $!
+[ $(count waited) -eq 1 ]
+progress "shards: OK"
+
+progress "parallel for: Testing..."
+# the same sum whether spread over helpers or not
+for parallel in 1 4; do
+    launch ZYGOTE_PARALLEL=$parallel
+    for n in 0 1 7 1000 1000000; do
+        [ "$(grow zygote.socket code.$so sum $n)" = $(( n * (n - 1) / 2 )) ]
+    done
+done
+progress "parallel for: OK"
+
+progress "memoized results: Testing..."
+# output and exit status of a run, from a zygote keeping those of pure code
+replay() {
+    local status=0
+    grow zygote.socket pure.$so "$@" </dev/null 2>&1 || status=$?
+    echo "exit $status"
+}
+launch ZYGOTE_RESULT_CACHE=16
+# results of code changed in the last two seconds aren't kept
+i=$(( $(stat -c %Z pure.$so) + 3 - $(date +%s) )); [ $i -le 0 ] || sleep $i
+first=$(replay world moon)
+second=$(replay world moon)
+[ "$first" = "$(printf 'hello world\nhello moon\ngreeted 2\nexit 2')" ]
+[ "$second" = "$first" ]
+[ "$(cat runs)" = world ]
+# other arguments make another run
+[ "$(replay sun)" = "$(printf 'hello sun\ngreeted 1\nexit 1')" ]
+[ "$(cat runs)" = "$(printf 'world\nsun')" ]
+[ $(count memo) -eq 1 ]
+progress "memoized results: OK"
+
+progress "shared cache: Testing..."
+# what one child puts is there for the next ones
+launch
+status=0; grow zygote.socket code.$so get greeting || status=$?
+[ $status -eq 1 ]
+grow zygote.socket code.$so put greeting hello
+[ "$(grow zygote.socket code.$so get greeting)" = hello ]
+grow zygote.socket code.$so put greeting bonjour
+[ "$(grow zygote.socket code.$so get greeting)" = bonjour ]
+progress "shared cache: OK"
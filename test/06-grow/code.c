@@ -0,0 +1,20 @@
+/* echoes its arguments, exiting with how many there were, after sleeping for
+ * the milliseconds following "sleep", or adding its niceness after "nice" */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+int run(int objc, void* objv[], int argc, char* argv[]) {
+    int i;
+    if (argc > 2 && strcmp(argv[1], "sleep") == 0)
+        usleep(atoi(argv[2]) * 1000);
+    printf("ran");
+    for (i=1; i<argc; i++)
+        printf(" %s", argv[i]);
+    if (argc > 1 && strcmp(argv[1], "nice") == 0)
+        printf(" %d", getpriority(PRIO_PROCESS, 0));
+    printf("\n");
+    return argc - 1;
+}
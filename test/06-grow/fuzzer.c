@@ -0,0 +1,48 @@
+/* a fuzzer as far as the fork-server protocol of AFL goes, running the
+ * command after the number of executions given as its target, and telling the
+ * exit status of each, and that of the target once it hangs up */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <zygote-protocol.h>
+
+int main(int argc, char* argv[]) {
+    int ctl[2], st[2];
+    int i, status;
+    uint32_t msg = 0;
+    pid_t target, pid;
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s EXECUTIONS COMMAND...\n", argv[0]);
+        return 2;
+    }
+    if (pipe(ctl) == -1 || pipe(st) == -1) { perror("pipe"); return 255; }
+    target = fork();
+    if (target == 0) {
+        dup2(ctl[0], ZYGOTE_FORKSRV_FD);
+        dup2(st[1], ZYGOTE_FORKSRV_FD + 1);
+        close(ctl[0]); close(ctl[1]); close(st[0]); close(st[1]);
+        execvp(argv[2], argv + 2);
+        perror(argv[2]);
+        _exit(255);
+    }
+    close(ctl[0]);
+    close(st[1]);
+    if (read(st[0], &msg, sizeof(msg)) != sizeof(msg)) { fprintf(stderr, "no hello\n"); return 1; }
+    for (i=0; i<atoi(argv[1]); i++) {
+        if (write(ctl[1], &msg, sizeof(msg)) != sizeof(msg) ||
+                read(st[0], &pid, sizeof(pid)) != sizeof(pid) ||
+                read(st[0], &status, sizeof(status)) != sizeof(status)) {
+            fprintf(stderr, "fork server gone\n");
+            return 1;
+        }
+        printf("exit %d\n", WEXITSTATUS(status));
+        fflush(stdout);
+    }
+    close(ctl[1]);
+    waitpid(target, &status, 0);
+    printf("target %d\n", WEXITSTATUS(status));
+    return 0;
+}
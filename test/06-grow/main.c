@@ -0,0 +1,6 @@
+/* zygote for the tests of grow's options */
+#include <zygote.h>
+
+int main(int argc, char* argv[]) {
+    return zygote("zygote.socket", NULL);
+}
@@ -0,0 +1,115 @@
+#!/usr/bin/env bash
+# Test script for the options of grow
+set -eu
+
+cd "$(dirname "$0")"
+cc -Wall -o main            $CFLAGS        main.c     $LDFLAGS $LIBS
+cc -Wall -o code.$so        $CFLAGS -fPIC  code.c     $LDFLAGS $sharedflag $LIBS
+cc -Wall -o fuzzer          $CFLAGS        fuzzer.c   $LDFLAGS $LIBS
+
+hr="################################################################################"
+progress() {
+    printf >&2 "### %s ${hr:0:$((80 - ${#1} - 5))}\n" "$1"
+}
+
+# launch a zygote with the given environment, shutting down the last one
+zygote=
+launch() {
+    [ -z "$zygote" ] || { kill -TERM $zygote; wait $zygote || true; }
+    rm -f zygote.socket
+    listening=$(grep -s "listening to" zygote.log | wc -l)
+    env "$@" ./main 2>>zygote.log &
+    zygote=$!
+    # not just bound, but listening
+    let i=1; until [ $(grep -s "listening to" zygote.log | wc -l) -gt $listening -o $i -gt 50 ]; do sleep 0.1; let ++i; done
+    [ -e zygote.socket ]
+}
+trap '[ -z "$zygote" ] || { kill -TERM $zygote; wait $zygote || true; }; rm -f out.actual err.actual' EXIT
+rm -f zygote.log
+
+# a counter of the zygote's statistics
+count() {
+    zygote-top -1 zygote.socket | grep -Eo "$1 +[0-9]+" | grep -Eo "[0-9]+$"
+}
+
+progress "timing: Testing..."
+launch
+status=0; out=$(grow --timing zygote.socket code.$so a b 2>err.actual) || status=$?
+[ $status -eq 2 ]
+[ "$out" = "ran a b" ]
+# every step, each once, and the resources the child used
+for step in connect sent accept receive dispatch start load run return exit reap; do
+    [ $(grep -Ec "^grow: +[0-9.]+ +[0-9.]+  $step$" err.actual) -eq 1 ]
+done
+grep -Eq "^grow: [0-9.]+ ms user, [0-9.]+ ms sys, [0-9]+ KiB max RSS" err.actual
+# and nothing of it without asking
+grow zygote.socket code.$so a b 2>err.actual || true
+[ ! -s err.actual ]
+progress "timing: OK"
+
+progress "priority: Testing..."
+launch ZYGOTE_MAX_IN_FLIGHT=1
+# batch children run niced
+[ "$(grow --priority=batch zygote.socket code.$so nice || true)" = "ran nice $(( $(nice) + 10 > 19 ? 19 : $(nice) + 10 ))" ]
+[ "$(grow zygote.socket code.$so nice || true)" = "ran nice $(nice)" ]
+# the interactive request waiting takes its turn before the batch ones
+grow zygote.socket code.$so sleep 500 >order || true &
+sleep 0.2
+for i in 1 2 3; do
+    grow -p batch zygote.socket code.$so batch >>order || true &
+    sleep 0.05
+done
+grow -p interactive zygote.socket code.$so interactive >>order || true &
+wait $(jobs -p | grep -vx $zygote)
+[ "$(cat order)" = "$(printf 'ran sleep 500\nran interactive\nran batch\nran batch\nran batch')" ]
+rm -f order
+progress "priority: OK"
+
+progress "fork server: Testing..."
+launch
+# a child forked for every execution by the one that loaded the code
+[ "$(./fuzzer 3 grow --forkserver zygote.socket code.$so a b)" = "$(printf 'ran a b\nexit 2\n%.0s' 1 2 3; echo target 0)" ]
+grep -q "code.$so: fuzzer gone after 3 executions" zygote.log
+# but only for a fuzzer
+status=0; grow --forkserver zygote.socket code.$so a b 2>err.actual || status=$?
+[ $status -ne 0 ]
+grep -q "needs the pipes of a fuzzer" err.actual
+progress "fork server: OK"
+
+progress "pipelining: Testing..."
+# frames on a single connection are read no faster than they can be queued,
+# so none is turned away however many are sent
+launch ZYGOTE_MAX_IN_FLIGHT=1 ZYGOTE_QUEUE_SIZE=1
+status=0; seq 20 | sed 's/^/sleep 20 /' | grow --batch -P 8 zygote.socket code.$so >out.actual 2>err.actual || status=$?
+[ $status -eq 123 ]
+[ "$(cat out.actual)" = "$(seq 20 | sed 's/^/ran sleep 20 /')" ]
+grep -q "^grow: 20 runs in .*: 20 exited 3$" err.actual
+[ $(count requests) -eq 20 ]
+[ $(count busy) -eq 0 ]
+progress "pipelining: OK"
+
+progress "batch: Testing..."
+launch
+# the stdouts in the order of the lines, however the runs finish
+status=0; printf '200 a\n100 b\n0\n' | grow --batch -P 3 zygote.socket code.$so sleep >out.actual 2>err.actual || status=$?
+[ $status -eq 123 ]
+[ "$(cat out.actual)" = "$(printf 'ran sleep 200 a\nran sleep 100 b\nran sleep 0')" ]
+grep -q "^grow: 3 runs in .*: 2 exited 3, 1 exited 2$" err.actual
+grep -Eq "^grow: latency p50 [0-9.]+ ms, p90 [0-9.]+ ms, p99 [0-9.]+ ms, max [0-9.]+ ms$" err.actual
+# or the lines from a file, and the output of each run in files named after
+# its line
+printf 'a\n\nb c\n' >args
+rm -rf out && mkdir out
+status=0; grow --batch --arg-file=args --output-dir=out zygote.socket code.$so </dev/null >out.actual 2>err.actual || status=$?
+[ $status -eq 123 ]
+[ ! -s out.actual ]
+[ "$(cat out/1.out)" = "ran a" ]
+[ "$(cat out/3.out)" = "ran b c" ]
+[ ! -e out/2.out ]
+[ ! -s out/1.err -a ! -s out/3.err ]
+grep -q "^grow: 2 runs in .*: 1 exited 1, 1 exited 2$" err.actual
+rm -rf args out
+# with every run ending in its exit status, there's no timing to show
+status=0; grow --batch --timing zygote.socket code.$so </dev/null >/dev/null 2>&1 || status=$?
+[ $status -eq 1 ]
+progress "batch: OK"
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Hash table shared by the children of the zygote
+ *
+ * zygote_shared_cache() maps the table before the fork, so every child finds
+ * what the others published, without touching the heap it shares with the
+ * zygote copy-on-write.  Slots of a fixed size are addressed openly, a key
+ * going in any of the PROBE slots from the one its hash picks.  Each slot has
+ * a state word with a version that is odd while a process, whose pid is in the
+ * upper half, writes to it, having claimed it with a compare-and-swap.
+ * Readers copy a slot out and check the version didn't change meanwhile, so
+ * no one ever waits, and a slot left odd by a process that died is claimed
+ * again by the next writer.  Once all the slots a key may go in are taken,
+ * a clock hand sweeps them, evicting the first not looked up since it last
+ * passed.  A key published by two processes at once may end up in two slots,
+ * the later of which is found only once the other is evicted.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "zygote.h"
+
+// slots a key may go in, and attempts at one before giving up
+#define PROBE 16
+#define TRIES 4
+#define CACHE_LINE 64
+
+typedef struct {
+    uint64_t state;         // version, odd while the pid in the upper half writes
+    uint64_t hash;          // of the key, or 0 if empty
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t referenced;    // looked up since the clock hand passed
+    uint32_t unused;
+    // the key and the value follow
+} slot_t;
+
+struct zygote_shared_cache {
+    uint64_t hand;          // of the clock
+    size_t slots;
+    size_t stride;          // of a slot with its key and value
+    size_t entry_size;
+};
+
+#define VERSION(state)      ((uint32_t) (state))
+#define WRITER(state)       ((pid_t) ((state) >> 32))
+#define STATE(pid, version) (((uint64_t) (pid) << 32) | (uint32_t) (version))
+
+static slot_t* slot_at(zygote_shared_cache_t* cache, size_t i) {
+    return (slot_t *) ((char *) cache + CACHE_LINE + (i % cache->slots) * cache->stride);
+}
+
+// FNV-1a hash of the key, never 0
+static uint64_t hash_key(const void* key, size_t key_len) {
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char* p = (const unsigned char *) key;
+    size_t i;
+    for (i=0; i<key_len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+zygote_shared_cache_t* zygote_shared_cache(size_t size, size_t entry_size) {
+    zygote_shared_cache_t* cache;
+    size_t stride = (sizeof(slot_t) + entry_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    if (size < CACHE_LINE + stride || entry_size > UINT32_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    // zeroed, i.e., all slots empty
+    cache = (zygote_shared_cache_t *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cache == MAP_FAILED)
+        return NULL;
+    cache->slots = (size - CACHE_LINE) / stride;
+    cache->stride = stride;
+    cache->entry_size = entry_size;
+    return cache;
+}
+
+// whether the slot holds the key, and if so, copy up to len bytes of its value
+// and store its length, all as of the same version
+static int read_slot(zygote_shared_cache_t* cache, slot_t* slot, uint64_t hash,
+        const void* key, size_t key_len, void* value, size_t len, long* value_len) {
+    uint64_t state;
+    uint32_t n;
+    int i;
+    for (i=0; i<TRIES; i++) {
+        state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (VERSION(state) & 1)
+            return 0;
+        if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash ||
+                __atomic_load_n(&slot->key_len, __ATOMIC_RELAXED) != key_len)
+            return 0;
+        n = __atomic_load_n(&slot->value_len, __ATOMIC_RELAXED);
+        if (key_len + n <= cache->entry_size && memcmp(slot + 1, key, key_len) == 0) {
+            if (len > 0)
+                memcpy(value, (char *) (slot + 1) + key_len, n < len ? n : len);
+            *value_len = n;
+        } else {
+            *value_len = -1;
+        }
+        // no writer came in between
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->state, __ATOMIC_RELAXED) == state)
+            return *value_len != -1;
+    }
+    return 0;
+}
+
+long zygote_shared_cache_get(zygote_shared_cache_t* cache, const void* key, size_t key_len,
+        void* value, size_t len) {
+    uint64_t hash = hash_key(key, key_len);
+    slot_t* slot;
+    long value_len;
+    int i;
+    if (key_len > cache->entry_size)
+        return -1;
+    for (i=0; i<PROBE && i<cache->slots; i++) {
+        slot = slot_at(cache, hash + i);
+        if (read_slot(cache, slot, hash, key, key_len, value, len, &value_len)) {
+            if (!__atomic_load_n(&slot->referenced, __ATOMIC_RELAXED))
+                __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+            return value_len;
+        }
+    }
+    return -1;
+}
+
+// whether the slot is free to be claimed: written by no one, or by a process
+// that's gone
+static int settled(uint64_t state) {
+    return !(VERSION(state) & 1) || (kill(WRITER(state), 0) == -1 && errno == ESRCH);
+}
+
+// pick the slot for the key among those it may go in: one holding the key
+// already, or else an empty one, or else the one the clock hand evicts
+static slot_t* pick_slot(zygote_shared_cache_t* cache, uint64_t hash, const void* key, size_t key_len,
+        uint64_t* state) {
+    slot_t* slot;
+    slot_t* empty = NULL;
+    uint64_t empty_state = 0;
+    size_t i, n, start;
+    long value_len;
+    n = PROBE < cache->slots ? PROBE : cache->slots;
+    for (i=0; i<n; i++) {
+        slot = slot_at(cache, hash + i);
+        *state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (read_slot(cache, slot, hash, key, key_len, NULL, 0, &value_len))
+            return slot;
+        if (empty == NULL && settled(*state) &&
+                ((VERSION(*state) & 1) || __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == 0)) {
+            empty = slot;
+            empty_state = *state;
+        }
+    }
+    if (empty != NULL) {
+        *state = empty_state;
+        return empty;
+    }
+    // give those referenced a second chance
+    start = __atomic_fetch_add(&cache->hand, 1, __ATOMIC_RELAXED);
+    for (i=0; i<2*n; i++) {
+        slot = slot_at(cache, hash + (start + i) % n);
+        *state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (!settled(*state))
+            continue;
+        if (__atomic_load_n(&slot->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&slot->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        return slot;
+    }
+    return NULL;
+}
+
+int zygote_shared_cache_put(zygote_shared_cache_t* cache, const void* key, size_t key_len,
+        const void* value, size_t value_len) {
+    uint64_t hash = hash_key(key, key_len);
+    uint64_t state;
+    uint32_t version;
+    slot_t* slot;
+    int i;
+    if (key_len + value_len > cache->entry_size) {
+        errno = E2BIG;
+        return -1;
+    }
+    for (i=0; i<TRIES; i++) {
+        slot = pick_slot(cache, hash, key, key_len, &state);
+        if (slot == NULL)
+            break;
+        // odd from here, whether it was settled even, or left odd
+        version = VERSION(state) + ((VERSION(state) & 1) ? 2 : 1);
+        if (!__atomic_compare_exchange_n(&slot->state, &state, STATE(getpid(), version),
+                    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        // readers check the version after reading all of these
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->key_len, (uint32_t) key_len, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->value_len, (uint32_t) value_len, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+        memcpy(slot + 1, key, key_len);
+        memcpy((char *) (slot + 1) + key_len, value, value_len);
+        __atomic_store_n(&slot->state, STATE(0, version + 1), __ATOMIC_RELEASE);
+        return 0;
+    }
+    errno = EBUSY;
+    return -1;
+}
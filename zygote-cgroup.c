@@ -0,0 +1,251 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Running grown children in cgroup v2 leaves
+ *
+ * The zygote is given a cgroup delegated to it, which it must not be a member
+ * of itself, as cgroup v2 only lets leaves have both processes and limits.
+ * Each grown child moves itself, before anything else, either into a leaf of
+ * its own named after its pid, which its reaper removes after collecting what
+ * the child used, or into a leaf shared by its priority class, which the
+ * zygote creates up front and removes when it exits.
+ *
+ * The reapers may be signal handlers, so collecting and removing a leaf only
+ * uses system calls and hand-rolled string handling.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "zygote-protocol.h"
+#include "zygote-internal.h"
+
+#ifdef __linux__
+
+#define MAX_CLASSES 8
+
+static char cgroup_path[PATH_MAX] = "";
+static size_t cgroup_path_len = 0;
+static int per_child = 1;
+static const char* cpu_max = NULL;
+static const char* memory_high = NULL;
+static const char* io_max = NULL;
+static char* class_names[MAX_CLASSES];
+static int classes_len = 0;
+
+// build cgroup_path/name/file where name is the leaf, or the pid if NULL
+static char* leaf_path(char* buf, const char* name, pid_t pid, const char* file) {
+    char digits[16];
+    char* p = buf;
+    int n = 0;
+    memcpy(p, cgroup_path, cgroup_path_len);
+    p += cgroup_path_len;
+    *p++ = '/';
+    if (name == NULL) {
+        memcpy(p, "grow-", 5);
+        p += 5;
+        do digits[n++] = '0' + pid % 10; while ((pid /= 10) > 0);
+        while (n > 0)
+            *p++ = digits[--n];
+    } else {
+        memcpy(p, name, strlen(name));
+        p += strlen(name);
+    }
+    if (file != NULL) {
+        *p++ = '/';
+        memcpy(p, file, strlen(file));
+        p += strlen(file);
+    }
+    *p = '\0';
+    return buf;
+}
+
+static int write_file(const char* path, const char* value) {
+    int fd = open(path, O_WRONLY);
+    ssize_t n;
+    if (fd == -1)
+        return -1;
+    n = write(fd, value, strlen(value));
+    close(fd);
+    return n == -1 ? -1 : 0;
+}
+
+// create a leaf with the limits, or reuse it
+static int make_leaf(const char* name, pid_t pid) {
+    char path[PATH_MAX + 64];
+    if (mkdir(leaf_path(path, name, pid, NULL), 0755) == -1 && errno != EEXIST) {
+        perror(path);
+        return -1;
+    }
+    if (cpu_max != NULL && write_file(leaf_path(path, name, pid, "cpu.max"), cpu_max) == -1)
+        perror(path);
+    if (memory_high != NULL && write_file(leaf_path(path, name, pid, "memory.high"), memory_high) == -1)
+        perror(path);
+    if (io_max != NULL && write_file(leaf_path(path, name, pid, "io.max"), io_max) == -1)
+        perror(path);
+    return 0;
+}
+
+int zygote_cgroup_enable(const char* path, int leaf_per_child, const char* classes[], int num_classes) {
+    static const char* controllers[] = { "+cpu", "+memory", "+io" };
+    const char* *limits[] = { &cpu_max, &memory_high, &io_max };
+    char file[PATH_MAX + 64];
+    struct stat st;
+    int i;
+    if (strlen(path) >= sizeof(cgroup_path) || stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "zygote: %s: not a cgroup directory\n", path);
+        return -1;
+    }
+    strcpy(cgroup_path, path);
+    cgroup_path_len = strlen(path);
+    per_child = leaf_per_child;
+    cpu_max = getenv("ZYGOTE_CGROUP_CPU_MAX");
+    memory_high = getenv("ZYGOTE_CGROUP_MEMORY_HIGH");
+    io_max = getenv("ZYGOTE_CGROUP_IO_MAX");
+    // let the leaves have limits, one controller at a time as some may not
+    // be delegated
+    snprintf(file, sizeof(file), "%s/cgroup.subtree_control", cgroup_path);
+    for (i=0; i<sizeof(controllers)/sizeof(*controllers); i++)
+        if (write_file(file, controllers[i]) == -1 && *limits[i] != NULL) {
+            fprintf(stderr, "zygote: %s: ignoring the %s limit without the controller\n",
+                    cgroup_path, controllers[i] + 1);
+            *limits[i] = NULL;
+        }
+    if (per_child)
+        return 0;
+    for (i=0; i<num_classes && i<MAX_CLASSES; i++) {
+        class_names[i] = strdup(classes[i]);
+        if (make_leaf(class_names[i], 0) == -1)
+            return -1;
+        classes_len = i + 1;
+    }
+    return 0;
+}
+
+int zygote_cgroup_enter(int class) {
+    char path[PATH_MAX + 64];
+    const char* name = NULL;
+    pid_t pid = getpid();
+    if (cgroup_path_len == 0)
+        return 0;
+    if (per_child) {
+        if (make_leaf(NULL, pid) == -1)
+            return -1;
+    } else {
+        if (class < 0 || class >= classes_len)
+            return -1;
+        name = class_names[class];
+    }
+    if (write_file(leaf_path(path, name, pid, "cgroup.procs"), "0") == -1) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static long long parse_number(const char* p) {
+    long long value = 0;
+    for (; *p >= '0' && *p <= '9'; p++)
+        value = value * 10 + (*p - '0');
+    return value;
+}
+
+// the number following key and a space or '=', summed over all lines
+static long long sum_field(const char* text, const char* key) {
+    size_t len = strlen(key);
+    long long sum = 0;
+    const char* p = text;
+    while ((p = strstr(p, key)) != NULL) {
+        if ((p == text || p[-1] == ' ' || p[-1] == '\n') && (p[len] == ' ' || p[len] == '=')) {
+            p += len + 1;
+            sum += parse_number(p);
+        } else {
+            p += len;
+        }
+    }
+    return sum;
+}
+
+static ssize_t read_file(const char* path, char* buf, size_t size) {
+    int fd = open(path, O_RDONLY);
+    ssize_t n;
+    if (fd == -1)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+int zygote_cgroup_reaped(pid_t pid, long long stats[]) {
+    char path[PATH_MAX + 64];
+    char text[4096];
+    if (cgroup_path_len == 0 || !per_child)
+        return -1;
+    memset(stats, 0, ZYGOTE_CGROUP_STATS * sizeof(long long));
+    if (read_file(leaf_path(path, NULL, pid, "cpu.stat"), text, sizeof(text)) == -1)
+        return -1;
+    stats[ZYGOTE_CGROUP_USAGE_USEC]     = sum_field(text, "usage_usec");
+    stats[ZYGOTE_CGROUP_USER_USEC]      = sum_field(text, "user_usec");
+    stats[ZYGOTE_CGROUP_SYSTEM_USEC]    = sum_field(text, "system_usec");
+    stats[ZYGOTE_CGROUP_THROTTLED_USEC] = sum_field(text, "throttled_usec");
+    if (read_file(leaf_path(path, NULL, pid, "memory.peak"), text, sizeof(text)) > 0)
+        stats[ZYGOTE_CGROUP_MEMORY_PEAK] = parse_number(text);
+    if (read_file(leaf_path(path, NULL, pid, "io.stat"), text, sizeof(text)) > 0) {
+        stats[ZYGOTE_CGROUP_IO_RBYTES] = sum_field(text, "rbytes");
+        stats[ZYGOTE_CGROUP_IO_WBYTES] = sum_field(text, "wbytes");
+    }
+    rmdir(leaf_path(path, NULL, pid, NULL));
+    return 0;
+}
+
+void zygote_cgroup_cleanup(void) {
+    char path[PATH_MAX + 64];
+    int i;
+    for (i=0; i<classes_len; i++)
+        rmdir(leaf_path(path, class_names[i], 0, NULL));
+    classes_len = 0;
+}
+
+#else /* __linux__ */
+
+int zygote_cgroup_enable(const char* path, int leaf_per_child, const char* classes[], int num_classes) {
+    fprintf(stderr, "zygote: cgroups are only on Linux\n");
+    return -1;
+}
+
+int zygote_cgroup_enter(int class) {
+    return 0;
+}
+
+int zygote_cgroup_reaped(pid_t pid, long long stats[]) {
+    return -1;
+}
+
+void zygote_cgroup_cleanup(void) {
+}
+
+#endif /* __linux__ */
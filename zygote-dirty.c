@@ -0,0 +1,560 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Copy-on-write dirtiness reports
+ *
+ * A grown child shares all its pages with the zygote until it writes to them,
+ * and each first write costs a page fault and a copy.  To find out which ones
+ * run() copies, every page of the address space is looked up in
+ * /proc/self/pagemap before and after run(): a page that was mapped but not
+ * exclusive to the child before, i.e., still shared with the zygote, and is
+ * exclusive afterwards has been copied.  Pages mapped for the first time are
+ * counted separately as new.  The copies are broken down by mapping, and by
+ * the regions registered with zygote_register() or passed as objv.
+ *
+ * In trap mode, registered regions are also made read-only while run() runs,
+ * and the first write to each of their pages is reported with the address of
+ * the instruction doing it, before the page is made writable again.
+ *
+ * All bookkeeping here uses mmap() directly, so as not to disturb the heap
+ * being measured.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#ifdef __linux__
+#include <ucontext.h>
+#endif
+
+#include "zygote.h"
+#include "zygote-internal.h"
+
+#define MAX_REGIONS     64
+#define MAX_TRAPS       32
+
+typedef struct {
+    const char* name;
+    uintptr_t start, end;
+    long copied;
+} region_t;
+
+static region_t regions[MAX_REGIONS];
+static int num_regions = 0;
+static char objv_names[MAX_REGIONS][24];
+
+int zygote_register(const char* name, const void* addr, size_t len) {
+    if (num_regions == MAX_REGIONS) {
+        errno = ENOMEM;
+        return -1;
+    }
+    regions[num_regions].name = name;
+    regions[num_regions].start = (uintptr_t) addr;
+    regions[num_regions].end = (uintptr_t) addr + len;
+    num_regions++;
+    return 0;
+}
+
+#ifdef __linux__
+
+// pagemap(5) entry bits
+#define PM_PRESENT      (1ULL << 63)
+#define PM_SWAPPED      (1ULL << 62)
+#define PM_EXCLUSIVE    (1ULL << 56)
+
+// mappings larger than this, e.g., reservations of sanitizers, are skipped
+#define MAX_MAPPING_SIZE (1ULL << 36)
+
+typedef struct {
+    uintptr_t start, end;
+    char* desc;         // permissions and name, as in /proc/self/maps
+    int prot;           // as in desc
+    unsigned char* shared;  // 2 bits per page: 1 present, 2 shared
+} mapping_t;
+
+struct zygote_dirty {
+    int trap;
+    long page_size;
+    char* maps;         // text of /proc/self/maps before run()
+    size_t maps_size;
+    mapping_t* mappings;
+    size_t mappings_size;
+    int num_mappings;
+    unsigned char* bits;
+    size_t bits_size;
+    void* scratch;
+    size_t scratch_size;
+    struct sigaction old_action;
+};
+
+typedef struct {
+    void* addr;
+    void* ip;
+} trap_t;
+static trap_t traps[MAX_TRAPS];
+static volatile int num_traps = 0;
+static int traps_lost = 0;
+static long trap_page_size;
+static zygote_dirty_t* trapping = NULL;
+
+static void* map_anonymous(size_t size) {
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// read the whole /proc/self/maps into a NUL-terminated mmap'ed buffer
+static char* read_maps(size_t* size) {
+    size_t cap = 1 << 20;
+    for (;;) {
+        char* buf = map_anonymous(cap);
+        size_t len = 0;
+        ssize_t n;
+        int fd;
+        if (buf == NULL)
+            return NULL;
+        if ((fd = open("/proc/self/maps", O_RDONLY)) == -1) {
+            munmap(buf, cap);
+            return NULL;
+        }
+        while (len < cap - 1 && (n = read(fd, buf + len, cap - 1 - len)) > 0)
+            len += n;
+        close(fd);
+        if (len < cap - 1) {
+            buf[len] = '\0';
+            *size = cap;
+            return buf;
+        }
+        munmap(buf, cap);
+        cap *= 2;
+    }
+}
+
+// parse a line of /proc/self/maps in place, returning the next one
+static char* parse_maps_line(char* line, uintptr_t* start, uintptr_t* end, char* *desc) {
+    char* next = strchr(line, '\n');
+    char* p;
+    if (next != NULL)
+        *next++ = '\0';
+    *start = strtoull(line, &p, 16);
+    *end = strtoull(p + 1, &p, 16);
+    *desc = p + 1;
+    return next;
+}
+
+// shorten the rest of a line of /proc/self/maps to permissions and name
+static char* describe_mapping(char* desc) {
+    char* perms_end = strchr(desc, ' ');
+    char* name = perms_end;
+    int field;
+    if (perms_end == NULL)
+        return desc;
+    // skip offset, device and inode
+    for (field = 0; field < 3 && name != NULL; field++)
+        name = strchr(name + 1, ' ');
+    if (name == NULL)
+        return desc;
+    while (*name == ' ')
+        name++;
+    memmove(perms_end + 1, name, strlen(name) + 1);
+    return desc;
+}
+
+// call visit for each range of pagemap entries of [start, end)
+static int scan_pagemap(int fd, long page_size, uintptr_t start, uintptr_t end,
+        uint64_t* entries, size_t max_entries,
+        void (*visit)(void* arg, uintptr_t addr, uint64_t* entries, size_t n), void* arg) {
+    uintptr_t addr;
+    for (addr = start; addr < end; ) {
+        size_t n = (end - addr) / page_size;
+        ssize_t got;
+        if (n > max_entries)
+            n = max_entries;
+        got = pread(fd, entries, n * sizeof(uint64_t), (addr / page_size) * sizeof(uint64_t));
+        if (got <= 0)
+            return -1;
+        n = got / sizeof(uint64_t);
+        visit(arg, addr, entries, n);
+        addr += n * page_size;
+    }
+    return 0;
+}
+
+static void record_before(void* arg, uintptr_t addr, uint64_t* entries, size_t n) {
+    mapping_t* m = (mapping_t *) arg;
+    size_t first = (addr - m->start) / trap_page_size;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        size_t page = first + i;
+        int bits = 0;
+        if (entries[i] & (PM_PRESENT | PM_SWAPPED))
+            bits = (entries[i] & PM_EXCLUSIVE) ? 1 : 3;
+        m->shared[page / 4] |= bits << (2 * (page % 4));
+    }
+}
+
+// page-aligned extent of a region
+#define region_pages(r, page_size, start, end) \
+    do { \
+        start = (r)->start & ~((page_size) - 1); \
+        end = ((r)->end + (page_size) - 1) & ~((page_size) - 1); \
+    } while (0)
+
+// protection of a mapping from the permissions in /proc/self/maps
+static int parse_prot(const char* desc) {
+    int prot = PROT_NONE;
+    if (desc[0] == 'r')
+        prot |= PROT_READ;
+    if (desc[1] == 'w')
+        prot |= PROT_WRITE;
+    if (desc[2] == 'x')
+        prot |= PROT_EXEC;
+    return prot;
+}
+
+// protection the page at addr had before run(), or -1 if it wasn't mapped
+static int prot_before(zygote_dirty_t* d, uintptr_t addr) {
+    int i;
+    for (i = 0; i < d->num_mappings; i++)
+        if (addr >= d->mappings[i].start && addr < d->mappings[i].end)
+            return d->mappings[i].prot;
+    return -1;
+}
+
+// make the writable pages of the registered regions read-only, or restore
+// them as they were, mapping by mapping
+static void protect_regions(zygote_dirty_t* d, int read_only) {
+    uintptr_t start, end, lo, hi;
+    int i, j;
+    for (i = 0; i < num_regions; i++) {
+        region_pages(&regions[i], d->page_size, start, end);
+        for (j = 0; j < d->num_mappings; j++) {
+            mapping_t* m = &d->mappings[j];
+            if (m->end <= start || m->start >= end || !(m->prot & PROT_WRITE))
+                continue;
+            lo = m->start > start ? m->start : start;
+            hi = m->end < end ? m->end : end;
+            if (mprotect((void *) lo, hi - lo, read_only ? m->prot & ~PROT_WRITE : m->prot) == -1 && read_only)
+                perror("zygote: mprotect");
+        }
+    }
+}
+
+static void onWriteTrap(int sig, siginfo_t* info, void* context) {
+    uintptr_t addr = (uintptr_t) info->si_addr;
+    uintptr_t start, end;
+    void* ip = NULL;
+    int i, prot;
+    for (i = 0; i < num_regions; i++) {
+        region_pages(&regions[i], trap_page_size, start, end);
+        if (addr >= start && addr < end)
+            break;
+    }
+    // not ours, or not writable anyway: let the fault happen again without us
+    if (i == num_regions || trapping == NULL ||
+            (prot = prot_before(trapping, addr)) == -1 || !(prot & PROT_WRITE)) {
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+#if defined(__x86_64__)
+    ip = (void *) ((ucontext_t *) context)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+    ip = (void *) ((ucontext_t *) context)->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+    ip = (void *) ((ucontext_t *) context)->uc_mcontext.pc;
+#endif
+    if (num_traps < MAX_TRAPS) {
+        traps[num_traps].addr = (void *) addr;
+        traps[num_traps].ip = ip;
+        num_traps++;
+    } else {
+        traps_lost++;
+    }
+    mprotect((void *) (addr & ~(trap_page_size - 1)), trap_page_size, prot);
+}
+
+zygote_dirty_t* zygote_dirty_begin(int objc, void* objv[], int trap) {
+    zygote_dirty_t* d;
+    char* line;
+    size_t total_pages = 0, max_entries;
+    int i, fd;
+    uintptr_t start, end;
+    char* desc;
+
+    trap_page_size = sysconf(_SC_PAGESIZE);
+    if ((d = map_anonymous(sizeof(zygote_dirty_t))) == NULL)
+        return NULL;
+    d->trap = trap;
+    d->page_size = trap_page_size;
+
+    // objv pointers not covered by a registered region get its page at least
+    for (i = 0; i < objc; i++) {
+        int j;
+        for (j = 0; j < num_regions; j++)
+            if ((uintptr_t) objv[i] >= regions[j].start && (uintptr_t) objv[i] < regions[j].end)
+                break;
+        if (j < num_regions || num_regions == MAX_REGIONS)
+            continue;
+        snprintf(objv_names[num_regions], sizeof(objv_names[0]), "objv[%d]", i);
+        zygote_register(objv_names[num_regions], objv[i], 1);
+    }
+    for (i = 0; i < num_regions; i++)
+        regions[i].copied = 0;
+
+    // remember which pages are still shared with the zygote
+    if ((d->maps = read_maps(&d->maps_size)) == NULL)
+        goto error;
+    for (line = d->maps; line != NULL && *line != '\0'; d->num_mappings++)
+        line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL;
+    // fewer than that are kept, but all of it gets unmapped
+    d->mappings_size = d->num_mappings * sizeof(mapping_t) + 1;
+    if ((d->mappings = map_anonymous(d->mappings_size)) == NULL)
+        goto error;
+    for (i = 0, line = d->maps; line != NULL && *line != '\0'; ) {
+        line = parse_maps_line(line, &start, &end, &desc);
+        if (end - start > MAX_MAPPING_SIZE || strstr(desc, "[vsyscall]") != NULL)
+            continue;
+        d->mappings[i].start = start;
+        d->mappings[i].end = end;
+        d->mappings[i].desc = desc;
+        d->mappings[i].prot = parse_prot(desc);
+        total_pages += (end - start) / d->page_size;
+        i++;
+    }
+    d->num_mappings = i;
+    d->bits_size = total_pages / 4 + d->num_mappings + 1;
+    if ((d->bits = map_anonymous(d->bits_size)) == NULL)
+        goto error;
+    max_entries = 4096;
+    d->scratch_size = max_entries * sizeof(uint64_t);
+    if ((d->scratch = map_anonymous(d->scratch_size)) == NULL)
+        goto error;
+    if ((fd = open("/proc/self/pagemap", O_RDONLY)) == -1)
+        goto error;
+    for (i = 0, total_pages = 0; i < d->num_mappings; i++) {
+        mapping_t* m = &d->mappings[i];
+        m->shared = d->bits + total_pages / 4 + i;
+        total_pages += (m->end - m->start) / d->page_size;
+        scan_pagemap(fd, d->page_size, m->start, m->end, d->scratch, max_entries, record_before, m);
+    }
+    close(fd);
+
+    // catch the first write to every page of the registered regions
+    if (trap) {
+        struct sigaction action = {0};
+        num_traps = traps_lost = 0;
+        action.sa_sigaction = onWriteTrap;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        trapping = d;
+        sigaction(SIGSEGV, &action, &d->old_action);
+        protect_regions(d, 1);
+    }
+    return d;
+
+error:
+    perror("zygote: dirty report");
+    zygote_dirty_free(d);
+    return NULL;
+}
+
+typedef struct {
+    zygote_dirty_t* d;
+    int next;           // first mapping from before not yet passed
+    long copied, fresh;
+} tally_t;
+
+static void tally_after(void* arg, uintptr_t addr, uint64_t* entries, size_t n) {
+    tally_t* t = (tally_t *) arg;
+    zygote_dirty_t* d = t->d;
+    size_t i;
+    int j;
+    for (i = 0; i < n; i++, addr += d->page_size) {
+        mapping_t* m;
+        int was = 0;
+        if (!(entries[i] & (PM_PRESENT | PM_SWAPPED)))
+            continue;
+        // pages are visited in address order, and so are the mappings
+        while (t->next < d->num_mappings && d->mappings[t->next].end <= addr)
+            t->next++;
+        m = &d->mappings[t->next];
+        if (t->next < d->num_mappings && m->start <= addr) {
+            size_t page = (addr - m->start) / d->page_size;
+            was = (m->shared[page / 4] >> (2 * (page % 4))) & 3;
+        }
+        if (was == 3 && (entries[i] & PM_EXCLUSIVE)) {
+            t->copied++;
+            for (j = 0; j < num_regions; j++)
+                if (addr + d->page_size > regions[j].start && addr < regions[j].end)
+                    regions[j].copied++;
+        } else if (was == 0) {
+            t->fresh++;
+        }
+    }
+}
+
+// describe the code at ip as precisely as the dynamic symbol tables allow
+static void describe_ip(void* ip, char* buf, size_t size) {
+    Dl_info info;
+    if (ip != NULL && dladdr(ip, &info) && info.dli_fname != NULL) {
+        if (info.dli_sname != NULL)
+            snprintf(buf, size, "%p %s+0x%lx (%s)", ip, info.dli_sname,
+                    (unsigned long) ((char *) ip - (char *) info.dli_saddr), info.dli_fname);
+        else
+            snprintf(buf, size, "%p %s+0x%lx", ip, info.dli_fname,
+                    (unsigned long) ((char *) ip - (char *) info.dli_fbase));
+    } else {
+        snprintf(buf, size, "%p", ip);
+    }
+}
+
+#define appendReport(args...) \
+    do { \
+        if (len < size) \
+            len += snprintf(report + len, size - len, args); \
+    } while (0)
+
+size_t zygote_dirty_end(zygote_dirty_t* d, char* report, size_t size) {
+    size_t len = 0, maps_size, max_entries;
+    char* maps;
+    char* line;
+    uintptr_t start, end;
+    char* desc;
+    tally_t t = {0};
+    long total_copied = 0, total_fresh = 0;
+    int i, j, fd = -1;
+    char where[PATH_MAX + 64];
+
+    if (d == NULL)
+        return 0;
+    if (d->trap) {
+        protect_regions(d, 0);
+        sigaction(SIGSEGV, &d->old_action, NULL);
+        trapping = NULL;
+    }
+
+    // compare every page mapped now with what it was before
+    t.d = d;
+    max_entries = d->scratch_size / sizeof(uint64_t);
+    if ((maps = read_maps(&maps_size)) == NULL || (fd = open("/proc/self/pagemap", O_RDONLY)) == -1) {
+        appendReport("cannot read pagemap: %s\n", strerror(errno));
+        if (maps != NULL)
+            munmap(maps, maps_size);
+        zygote_dirty_free(d);
+        return len < size ? len : size - 1;
+    }
+    appendReport("%8s %8s  %s\n", "copied", "new", "pages of mapping");
+    for (line = maps; line != NULL && *line != '\0'; ) {
+        line = parse_maps_line(line, &start, &end, &desc);
+        if (end - start > MAX_MAPPING_SIZE || strstr(desc, "[vsyscall]") != NULL)
+            continue;
+        t.copied = t.fresh = 0;
+        scan_pagemap(fd, d->page_size, start, end, d->scratch, max_entries, tally_after, &t);
+        if (t.copied > 0 || t.fresh > 0)
+            appendReport("%8ld %8ld  %lx-%lx %s\n", t.copied, t.fresh,
+                    (unsigned long) start, (unsigned long) end, describe_mapping(desc));
+        total_copied += t.copied;
+        total_fresh += t.fresh;
+    }
+    close(fd);
+    munmap(maps, maps_size);
+    appendReport("%8ld %8ld  in total, %ld bytes each\n", total_copied, total_fresh, d->page_size);
+
+    // by region
+    for (i = 0; i < num_regions; i++) {
+        region_pages(&regions[i], d->page_size, start, end);
+        appendReport("%8ld %8s  of %ld pages of %s at %p\n", regions[i].copied, "",
+                (long) ((end - start) / d->page_size), regions[i].name, (void *) regions[i].start);
+    }
+    for (i = 0; i < num_traps; i++) {
+        for (j = 0; j < num_regions; j++)
+            if ((uintptr_t) traps[i].addr >= regions[j].start && (uintptr_t) traps[i].addr < regions[j].end)
+                break;
+        describe_ip(traps[i].ip, where, sizeof(where));
+        if (j < num_regions)
+            appendReport("write to %s+0x%lx by %s\n", regions[j].name,
+                    (unsigned long) ((uintptr_t) traps[i].addr - regions[j].start), where);
+        else
+            appendReport("write to %p, sharing a page with a region, by %s\n", traps[i].addr, where);
+    }
+    if (traps_lost > 0)
+        appendReport("%d more first writes to the regions not shown\n", traps_lost);
+    zygote_dirty_free(d);
+    return len < size ? len : size - 1;
+}
+
+void zygote_dirty_free(zygote_dirty_t* d) {
+    if (d == NULL)
+        return;
+    if (d->maps != NULL)
+        munmap(d->maps, d->maps_size);
+    if (d->mappings != NULL)
+        munmap(d->mappings, d->mappings_size);
+    if (d->bits != NULL)
+        munmap(d->bits, d->bits_size);
+    if (d->scratch != NULL)
+        munmap(d->scratch, d->scratch_size);
+    munmap(d, sizeof(zygote_dirty_t));
+}
+
+long zygote_dirty_private(void) {
+    char buf[4096];
+    char* p;
+    ssize_t n;
+    int fd;
+    // summed over all mappings by the kernel, far cheaper than the pagemap
+    if ((fd = open("/proc/self/smaps_rollup", O_RDONLY)) == -1)
+        return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    if ((p = strstr(buf, "\nPrivate_Dirty:")) == NULL)
+        return -1;
+    return strtol(p + sizeof("\nPrivate_Dirty:") - 1, NULL, 10) * 1024;
+}
+
+#else /* __linux__ */
+
+zygote_dirty_t* zygote_dirty_begin(int objc, void* objv[], int trap) {
+    fprintf(stderr, "zygote: dirty reports need /proc/self/pagemap\n");
+    return NULL;
+}
+
+size_t zygote_dirty_end(zygote_dirty_t* d, char* report, size_t size) {
+    return 0;
+}
+
+void zygote_dirty_free(zygote_dirty_t* d) {
+}
+
+long zygote_dirty_private(void) {
+    return -1;
+}
+
+#endif /* __linux__ */
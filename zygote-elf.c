@@ -0,0 +1,106 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Looking up what a shared object defines without loading it
+ *
+ * The zygote must not dlopen() the code it is asked to run, as that would
+ * run its constructors and leave it mapped in every child forked afterwards,
+ * so it reads the dynamic symbol table of the file instead.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "zygote-internal.h"
+
+#ifdef __linux__
+#include <elf.h>
+#include <link.h>
+
+#if __ELF_NATIVE_CLASS == 64
+#define ELFCLASS_NATIVE ELFCLASS64
+#else
+#define ELFCLASS_NATIVE ELFCLASS32
+#endif
+
+int zygote_elf_defines(const char* path, const char* symbol) {
+    struct stat st;
+    const char* file;
+    const ElfW(Ehdr)* ehdr;
+    const ElfW(Shdr)* shdr;
+    const ElfW(Shdr)* strtab;
+    const ElfW(Sym)* sym;
+    size_t i, j, n;
+    int fd, found = -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return -1;
+    }
+    file = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+        return -1;
+    ehdr = (const ElfW(Ehdr) *) file;
+    // only objects this process could load
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS_NATIVE ||
+            ehdr->e_shentsize != sizeof(ElfW(Shdr)) ||
+            ehdr->e_shoff + (size_t) ehdr->e_shnum * sizeof(ElfW(Shdr)) > (size_t) st.st_size)
+        goto done;
+    shdr = (const ElfW(Shdr) *) (file + ehdr->e_shoff);
+    found = 0;
+    for (i=0; i<ehdr->e_shnum && !found; i++) {
+        if (shdr[i].sh_type != SHT_DYNSYM || shdr[i].sh_link >= ehdr->e_shnum ||
+                shdr[i].sh_offset + shdr[i].sh_size > (size_t) st.st_size)
+            continue;
+        strtab = &shdr[shdr[i].sh_link];
+        if (strtab->sh_offset + strtab->sh_size > (size_t) st.st_size)
+            continue;
+        sym = (const ElfW(Sym) *) (file + shdr[i].sh_offset);
+        n = shdr[i].sh_size / sizeof(ElfW(Sym));
+        for (j=0; j<n; j++) {
+            // a name inside the table, for a symbol defined here
+            if (sym[j].st_shndx == SHN_UNDEF || sym[j].st_name >= strtab->sh_size)
+                continue;
+            if (strncmp(file + strtab->sh_offset + sym[j].st_name, symbol,
+                        strtab->sh_size - sym[j].st_name) == 0) {
+                found = 1;
+                break;
+            }
+        }
+    }
+done:
+    munmap((void *) file, st.st_size);
+    return found;
+}
+
+#else /* __linux__ */
+
+int zygote_elf_defines(const char* path, const char* symbol) {
+    return -1;
+}
+
+#endif /* __linux__ */
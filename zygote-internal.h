@@ -0,0 +1,144 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Declarations shared between the library's translation units
+ *
+ * Not installed; nothing here is part of the public API.
+ */
+
+#ifndef _ZYGOTE_INTERNAL_H
+#define _ZYGOTE_INTERNAL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// zygote-malloc.c: serve all further allocations of this process from a fresh
+// arena reserving size bytes of address space
+int zygote_arena_enable(size_t size);
+
+// zygote-malloc.c: make code dlopen'ed as handle, even with RTLD_DEEPBIND,
+// allocate through the arena once it's enabled
+int zygote_arena_bind(void* handle);
+
+// zygote-dirty.c: count the pages run() copies from the zygote, between
+// zygote_dirty_begin() and zygote_dirty_end(), which writes a textual report
+// to the given buffer and returns its length.  With trap, registered regions
+// are made read-only in between to catch the instructions writing to them.
+typedef struct zygote_dirty zygote_dirty_t;
+zygote_dirty_t* zygote_dirty_begin(int objc, void* objv[], int trap);
+size_t zygote_dirty_end(zygote_dirty_t* d, char* report, size_t size);
+void zygote_dirty_free(zygote_dirty_t* d);
+
+// zygote-dirty.c: bytes of memory this process has written to on its own,
+// copied from the zygote or newly mapped, or -1 if unknown
+long zygote_dirty_private(void);
+
+// zygote-snapshot.c: take a snapshot of this process to reset it to, which
+// puts back the memory written since, unmaps what's been mapped and closes
+// what's been opened, returning the pages put back, or -1 if it can't be
+// reset, and must not go on.  No other thread may be running then.
+typedef struct zygote_snapshot zygote_snapshot_t;
+zygote_snapshot_t* zygote_snapshot_take(void);
+long zygote_snapshot_restore(zygote_snapshot_t* s);
+
+// zygote-stats.c: publish counters in a file next to the socket, mapped
+// shared, see zygote-stats.h.  Children of the zygote detach from it, and
+// replica i then writes to the page for it.
+enum {
+    ZYGOTE_STATS_REJECTED,
+    ZYGOTE_STATS_FORKED,
+    ZYGOTE_STATS_POOLED,
+    ZYGOTE_STATS_CACHED,
+    ZYGOTE_STATS_LOADED,
+    ZYGOTE_STATS_QUEUED,
+    ZYGOTE_STATS_BUSY,
+    ZYGOTE_STATS_THREADED,
+    ZYGOTE_STATS_WORKED,
+    ZYGOTE_STATS_MEMOIZED,
+    ZYGOTE_STATS_COALESCED,
+};
+int zygote_stats_open(const char* socket_path, int replicas);
+void zygote_stats_close(void);
+void zygote_stats_detach(void);
+void zygote_stats_replica(int i);
+void zygote_stats_request(const char* code_path);
+void zygote_stats_dispatch(int how);
+void zygote_stats_fork(long long ns);
+void zygote_stats_done(long long run_ns, int failed);
+void zygote_stats_gauges(int pool_ready, int sub_zygotes, int queue_len);
+void zygote_stats_placement(const char* policy, int data_node);
+void zygote_stats_placed(int local);
+
+// zygote-cgroup.c: move grown children into cgroup v2 leaves under the given
+// cgroup, one for each child, or for each of the classes.  The reaper of a
+// child with a leaf of its own collects its usage by ZYGOTE_CGROUP_* of
+// zygote-protocol.h, and removes the leaf.
+int zygote_cgroup_enable(const char* path, int leaf_per_child, const char* classes[], int num_classes);
+int zygote_cgroup_enter(int class);
+int zygote_cgroup_reaped(pid_t pid, long long stats[]);
+void zygote_cgroup_cleanup(void);
+
+// zygote-placement.c: pick a CPU for each child by policy, which the child
+// pins itself to, and keep count of the children running on each.  The NUMA
+// nodes this process may run on are listed with the node holding most of the
+// given objects first, and a replica of the zygote moves itself and the pages
+// it can write onto one of them, returning how many it moved.
+enum {
+    ZYGOTE_PLACEMENT_NONE,
+    ZYGOTE_PLACEMENT_ROUND_ROBIN,
+    ZYGOTE_PLACEMENT_LEAST_LOADED,
+    ZYGOTE_PLACEMENT_DATA_NODE,
+};
+int zygote_placement_init(const char* name, int objc, void* objv[]);
+int zygote_placement_data_node(void);
+int zygote_placement_node(int cpu);
+int zygote_placement_pick(void);
+void zygote_placement_done(int cpu);
+int zygote_placement_pin(int cpu);
+int zygote_placement_nodes(int nodes[], int max, int objc, void* objv[]);
+long zygote_placement_replicate(int node);
+
+// zygote-parallel.c: spread zygote_parallel_for() over procs processes, or as
+// many as the CPUs this process may run on, which its helpers run on too
+void zygote_parallel_init(int procs);
+
+// zygote-results.c: results of runs of pure code under the key of their
+// requests, with up to size bytes of their stdout and stderr kept in memory
+// files.  A child gets the other ends of the files for a result it's started
+// for, and the zygote marks it done with the exit status once the child exits
+// normally, unless it's too large to keep, or drops it otherwise.  Replaying a
+// result copies what's left of both files after the given offsets, returning
+// 1 if grow's would block, and a process detaches the one it goes on replaying
+// after forgetting the others.
+typedef struct zygote_result zygote_result_t;
+int zygote_results_init(long long size);
+zygote_result_t* zygote_results_find(const char* key, size_t key_len, unsigned long long hash);
+zygote_result_t* zygote_results_start(const char* key, size_t key_len, unsigned long long hash, int fds[2]);
+int zygote_results_status(zygote_result_t* r);
+int zygote_results_done(zygote_result_t* r, int status);
+void zygote_results_drop(zygote_result_t* r);
+void zygote_results_detach(zygote_result_t* r);
+void zygote_results_trim(void);
+void zygote_results_forget(void);
+int zygote_results_copy(int from, off_t* offset, int to, int block);
+int zygote_results_replay(zygote_result_t* r, int fds[2], off_t offsets[2], int block);
+
+// zygote-elf.c: whether the shared object at path defines the symbol, or -1
+// if it can't tell
+int zygote_elf_defines(const char* path, const char* symbol);
+
+#endif /* _ZYGOTE_INTERNAL_H */
@@ -0,0 +1,468 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Child-local arena allocator
+ *
+ * In a grown child, every malloc() or free() through the allocator inherited
+ * from the zygote writes to free lists and chunk headers in pages shared with
+ * the zygote, and each such write copies a whole page.  When enabled, the
+ * child serves all allocations from a fresh mmap'ed arena of its own instead,
+ * leaving the zygote's heap frozen: free() of memory the zygote allocated
+ * becomes a no-op, and nothing needs to be freed when the child exits.  Once
+ * the arena is full, blocks come from the allocator the program uses
+ * otherwise (normally the C library's) with a header of their own, for free()
+ * to hand them back.
+ *
+ * Nothing is interposed on the allocator of programs linked with libzygote.
+ * Enabling the arena rebinds the relocations of malloc() and friends in every
+ * object loaded so far to the functions here, the C library's own included,
+ * and those of code dlopen'ed later are rebound with zygote_arena_bind().  C++
+ * operator new and delete go through malloc() and free().
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#ifdef __linux__
+#include <link.h>
+#endif
+
+#include "zygote-internal.h"
+
+#ifdef __linux__
+
+// Every block in the arena is a power of two bytes, preceded by a header
+typedef struct {
+    uint32_t cls;       // log2 of the block size
+    uint32_t offset;    // from the start of the block to this header
+    uint64_t magic;
+} arena_header_t;
+#define ARENA_MAGIC     0x7a79676f74654152ULL
+#define ARENA_MIN_CLASS 5
+#define ARENA_CLASSES   48
+
+static char* arena_base = NULL;
+static char* arena_top  = NULL;
+static char* arena_end  = NULL;
+static void* arena_free_lists[ARENA_CLASSES];
+static char  arena_lock = 0;
+static int   arena_enabled = 0;
+
+#define in_arena(p)  ((char *) (p) >= arena_base && (char *) (p) < arena_end)
+
+static void arena_acquire(void) {
+    int spins = 0;
+    while (__atomic_test_and_set(&arena_lock, __ATOMIC_ACQUIRE))
+        if (++spins % 64 == 0)
+            sched_yield();
+}
+
+static void arena_release(void) {
+    __atomic_clear(&arena_lock, __ATOMIC_RELEASE);
+}
+
+static void* arena_alloc(size_t size, size_t align) {
+    size_t need = size + sizeof(arena_header_t) + (align > 16 ? align : 0);
+    arena_header_t* header;
+    char* block;
+    char* p;
+    int cls;
+
+    if (need < size)
+        return NULL;
+    for (cls = ARENA_MIN_CLASS; cls < ARENA_CLASSES && ((size_t) 1 << cls) < need; cls++);
+    if (cls == ARENA_CLASSES)
+        return NULL;
+    arena_acquire();
+    block = (char *) arena_free_lists[cls];
+    if (block != NULL) {
+        arena_free_lists[cls] = *(void* *) block;
+    } else if ((size_t) (arena_end - arena_top) >= ((size_t) 1 << cls)) {
+        block = arena_top;
+        arena_top += (size_t) 1 << cls;
+    }
+    arena_release();
+    if (block == NULL)
+        return NULL;
+    p = block + sizeof(arena_header_t);
+    if (align > 16)
+        p = (char *) (((uintptr_t) p + align - 1) & ~(uintptr_t) (align - 1));
+    header = (arena_header_t *) p - 1;
+    header->cls = cls;
+    header->offset = (char *) header - block;
+    header->magic = ARENA_MAGIC;
+    return p;
+}
+
+static void arena_free(void* ptr) {
+    arena_header_t* header = (arena_header_t *) ptr - 1;
+    char* block;
+    if (header->magic != ARENA_MAGIC)
+        return;
+    block = (char *) header - header->offset;
+    header->magic = 0;
+    arena_acquire();
+    *(void* *) block = arena_free_lists[header->cls];
+    arena_free_lists[header->cls] = block;
+    arena_release();
+}
+
+static size_t arena_usable_size(void* ptr) {
+    arena_header_t* header = (arena_header_t *) ptr - 1;
+    return ((size_t) 1 << header->cls) - header->offset - sizeof(arena_header_t);
+}
+
+// The allocator the program uses otherwise, resolved before any reference to
+// it is rebound to the functions below, which forward to it until the arena
+// is enabled, e.g., in a sub-zygote
+static void* (*next_malloc)(size_t) = NULL;
+static void  (*next_free)(void*) = NULL;
+static void* (*next_calloc)(size_t, size_t) = NULL;
+static void* (*next_realloc)(void*, size_t) = NULL;
+static int   (*next_posix_memalign)(void**, size_t, size_t) = NULL;
+static size_t (*next_malloc_usable_size)(void*) = NULL;
+
+static void resolve_next(void) {
+    if (next_malloc != NULL)
+        return;
+    next_free               = dlsym(RTLD_DEFAULT, "free");
+    next_calloc             = dlsym(RTLD_DEFAULT, "calloc");
+    next_realloc            = dlsym(RTLD_DEFAULT, "realloc");
+    next_posix_memalign     = dlsym(RTLD_DEFAULT, "posix_memalign");
+    next_malloc_usable_size = dlsym(RTLD_DEFAULT, "malloc_usable_size");
+    next_malloc             = dlsym(RTLD_DEFAULT, "malloc");
+}
+
+// Blocks of the next allocator once the arena is full, preceded by a header
+// like those in the arena, telling them apart from what the zygote allocated
+#define FALLBACK_MAGIC  0x7a79676f74654642ULL
+
+static void* fallback_alloc(size_t size, size_t align) {
+    size_t need = size + sizeof(arena_header_t) + (align > 16 ? align : 0);
+    arena_header_t* header;
+    char* block;
+    char* p;
+    if (need < size || (block = (char *) next_malloc(need)) == NULL)
+        return NULL;
+    p = block + sizeof(arena_header_t);
+    if (align > 16)
+        p = (char *) (((uintptr_t) p + align - 1) & ~(uintptr_t) (align - 1));
+    header = (arena_header_t *) p - 1;
+    header->cls = 0;
+    header->offset = (char *) header - block;
+    header->magic = FALLBACK_MAGIC;
+    return p;
+}
+
+// whether ptr came from fallback_alloc(), as the header before any block of
+// the next allocator can be read without copying its page
+static int is_fallback(void* ptr) {
+    return ((arena_header_t *) ptr - 1)->magic == FALLBACK_MAGIC;
+}
+
+static void fallback_free(void* ptr) {
+    arena_header_t* header = (arena_header_t *) ptr - 1;
+    header->magic = 0;
+    next_free((char *) header - header->offset);
+}
+
+static size_t fallback_usable_size(void* ptr) {
+    arena_header_t* header = (arena_header_t *) ptr - 1;
+    return next_malloc_usable_size((char *) header - header->offset) - header->offset - sizeof(arena_header_t);
+}
+
+
+static void* zygote_malloc(size_t size) {
+    void* p;
+    if (!arena_enabled)
+        return next_malloc(size);
+    if ((p = arena_alloc(size, 16)) != NULL)
+        return p;
+    return fallback_alloc(size, 16);
+}
+
+static void zygote_free(void* ptr) {
+    if (ptr == NULL)
+        return;
+    if (!arena_enabled)
+        next_free(ptr);
+    else if (in_arena(ptr))
+        arena_free(ptr);
+    else if (is_fallback(ptr))
+        fallback_free(ptr);
+    // and what the zygote allocated stays where it is
+}
+
+static void* zygote_calloc(size_t nmemb, size_t size) {
+    size_t total = nmemb * size;
+    void* p;
+    if (!arena_enabled)
+        return next_calloc(nmemb, size);
+    if (size != 0 && total / size != nmemb) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((p = zygote_malloc(total)) != NULL)
+        memset(p, 0, total);
+    return p;
+}
+
+static void* zygote_realloc(void* ptr, size_t size) {
+    size_t old_size;
+    void* p;
+    if (!arena_enabled)
+        return next_realloc(ptr, size);
+    if (ptr == NULL)
+        return zygote_malloc(size);
+    if (size == 0) {
+        zygote_free(ptr);
+        return NULL;
+    }
+    if (in_arena(ptr)) {
+        old_size = arena_usable_size(ptr);
+        if (size <= old_size)
+            return ptr;
+    } else if (is_fallback(ptr)) {
+        old_size = fallback_usable_size(ptr);
+    } else {
+        // move what the zygote allocated into the arena, leaving the original
+        old_size = next_malloc_usable_size != NULL ? next_malloc_usable_size(ptr) : size;
+    }
+    p = zygote_malloc(size);
+    if (p == NULL)
+        return NULL;
+    memcpy(p, ptr, old_size < size ? old_size : size);
+    zygote_free(ptr);
+    return p;
+}
+
+static int zygote_posix_memalign(void** memptr, size_t alignment, size_t size) {
+    void* p;
+    if (!arena_enabled)
+        return next_posix_memalign(memptr, alignment, size);
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    if ((p = arena_alloc(size, alignment)) == NULL &&
+            (p = fallback_alloc(size, alignment)) == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+static void* zygote_aligned_alloc(size_t alignment, size_t size) {
+    void* p;
+    int rc = zygote_posix_memalign(&p, alignment < sizeof(void*) ? sizeof(void*) : alignment, size);
+    if (rc != 0) {
+        errno = rc;
+        return NULL;
+    }
+    return p;
+}
+
+static void* zygote_valloc(size_t size) {
+    return zygote_aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+static void* zygote_pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return zygote_aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+static size_t zygote_malloc_usable_size(void* ptr) {
+    if (ptr == NULL)
+        return 0;
+    if (arena_enabled && in_arena(ptr))
+        return arena_usable_size(ptr);
+    if (arena_enabled && is_fallback(ptr))
+        return fallback_usable_size(ptr);
+    return next_malloc_usable_size != NULL ? next_malloc_usable_size(ptr) : 0;
+}
+
+
+// Rebinds the allocator references of the object behind handle, and of the
+// objects loaded along with it, to the functions above.
+static const struct {
+    const char* name;
+    void* fn;
+} allocator_symbols[] = {
+    { "malloc",             (void *) zygote_malloc },
+    { "free",               (void *) zygote_free },
+    { "calloc",             (void *) zygote_calloc },
+    { "realloc",            (void *) zygote_realloc },
+    { "posix_memalign",     (void *) zygote_posix_memalign },
+    { "aligned_alloc",      (void *) zygote_aligned_alloc },
+    { "memalign",           (void *) zygote_aligned_alloc },
+    { "valloc",             (void *) zygote_valloc },
+    { "pvalloc",            (void *) zygote_pvalloc },
+    { "malloc_usable_size", (void *) zygote_malloc_usable_size },
+};
+#define NUM_ALLOCATOR_SYMBOLS (sizeof(allocator_symbols) / sizeof(allocator_symbols[0]))
+
+#if __ELF_NATIVE_CLASS == 64
+#define ELF_R_SYM ELF64_R_SYM
+#else
+#define ELF_R_SYM ELF32_R_SYM
+#endif
+
+// Pages the dynamic linker made read-only after relocation (RELRO)
+typedef struct {
+    ElfW(Dyn)* dynamic;
+    uintptr_t start, end;
+} relro_t;
+
+static int find_relro(struct dl_phdr_info* info, size_t size, void* data) {
+    relro_t* relro = (relro_t *) data;
+    long page = sysconf(_SC_PAGESIZE);
+    const ElfW(Phdr)* dynamic = NULL;
+    const ElfW(Phdr)* gnu_relro = NULL;
+    int i;
+    for (i = 0; i < info->dlpi_phnum; i++)
+        if (info->dlpi_phdr[i].p_type == PT_DYNAMIC)
+            dynamic = &info->dlpi_phdr[i];
+        else if (info->dlpi_phdr[i].p_type == PT_GNU_RELRO)
+            gnu_relro = &info->dlpi_phdr[i];
+    // the object whose dynamic section the link map points to
+    if (dynamic == NULL || (ElfW(Dyn) *) (info->dlpi_addr + dynamic->p_vaddr) != relro->dynamic)
+        return 0;
+    if (gnu_relro != NULL) {
+        // rounded down at both ends, as the dynamic linker does
+        relro->start = (info->dlpi_addr + gnu_relro->p_vaddr) & ~(uintptr_t) (page - 1);
+        relro->end = (info->dlpi_addr + gnu_relro->p_vaddr + gnu_relro->p_memsz) & ~(uintptr_t) (page - 1);
+    }
+    return 1;
+}
+
+static void rebind_slot(ElfW(Addr) base, ElfW(Sym)* symtab, const char* strtab, relro_t* relro,
+        ElfW(Addr) offset, ElfW(Xword) info) {
+    const char* name = strtab + symtab[ELF_R_SYM(info)].st_name;
+    long page = sysconf(_SC_PAGESIZE);
+    void* *slot = (void* *) (base + offset);
+    void* slot_page = (void *) ((uintptr_t) slot & ~(uintptr_t) (page - 1));
+    int read_only = (uintptr_t) slot >= relro->start && (uintptr_t) slot < relro->end;
+    unsigned i;
+    for (i = 0; i < NUM_ALLOCATOR_SYMBOLS; i++) {
+        if (strcmp(name, allocator_symbols[i].name) != 0)
+            continue;
+        if (*slot == allocator_symbols[i].fn)
+            return;
+        // opened up just for the store, and read-only again right after
+        if (read_only && mprotect(slot_page, page, PROT_READ | PROT_WRITE) == -1)
+            return;
+        *slot = allocator_symbols[i].fn;
+        if (read_only)
+            mprotect(slot_page, page, PROT_READ);
+        return;
+    }
+}
+
+static void rebind_object(struct link_map* map) {
+    ElfW(Sym)* symtab = NULL;
+    const char* strtab = NULL;
+    ElfW(Addr) rel[2] = {0, 0}, jmprel = 0;
+    ElfW(Xword) relsz[2] = {0, 0}, pltrelsz = 0, pltrel = 0;
+    ElfW(Dyn)* d;
+    ElfW(Addr) p;
+    relro_t relro = {0};
+    if (map->l_ld == NULL)
+        return;
+    relro.dynamic = map->l_ld;
+    dl_iterate_phdr(find_relro, &relro);
+    // d_ptr is relocated in memory on most, but not all, architectures
+#define dynamic_ptr(d) \
+    ((d)->d_un.d_ptr < map->l_addr ? map->l_addr + (d)->d_un.d_ptr : (d)->d_un.d_ptr)
+    for (d = map->l_ld; d->d_tag != DT_NULL; d++)
+        switch (d->d_tag) {
+            case DT_SYMTAB:   symtab = (ElfW(Sym) *) dynamic_ptr(d); break;
+            case DT_STRTAB:   strtab = (const char *) dynamic_ptr(d); break;
+            case DT_RELA:     rel[0] = dynamic_ptr(d); break;
+            case DT_RELASZ:   relsz[0] = d->d_un.d_val; break;
+            case DT_REL:      rel[1] = dynamic_ptr(d); break;
+            case DT_RELSZ:    relsz[1] = d->d_un.d_val; break;
+            case DT_JMPREL:   jmprel = dynamic_ptr(d); break;
+            case DT_PLTRELSZ: pltrelsz = d->d_un.d_val; break;
+            case DT_PLTREL:   pltrel = d->d_un.d_val; break;
+        }
+#undef dynamic_ptr
+    if (symtab == NULL || strtab == NULL)
+        return;
+    for (p = rel[0]; p < rel[0] + relsz[0]; p += sizeof(ElfW(Rela)))
+        if (((ElfW(Rela) *) p)->r_addend == 0)
+            rebind_slot(map->l_addr, symtab, strtab, &relro, ((ElfW(Rela) *) p)->r_offset, ((ElfW(Rela) *) p)->r_info);
+    for (p = rel[1]; p < rel[1] + relsz[1]; p += sizeof(ElfW(Rel)))
+        rebind_slot(map->l_addr, symtab, strtab, &relro, ((ElfW(Rel) *) p)->r_offset, ((ElfW(Rel) *) p)->r_info);
+    if (pltrel == DT_RELA)
+        for (p = jmprel; p < jmprel + pltrelsz; p += sizeof(ElfW(Rela)))
+            rebind_slot(map->l_addr, symtab, strtab, &relro, ((ElfW(Rela) *) p)->r_offset, ((ElfW(Rela) *) p)->r_info);
+    else
+        for (p = jmprel; p < jmprel + pltrelsz; p += sizeof(ElfW(Rel)))
+            rebind_slot(map->l_addr, symtab, strtab, &relro, ((ElfW(Rel) *) p)->r_offset, ((ElfW(Rel) *) p)->r_info);
+}
+
+int zygote_arena_bind(void* handle) {
+    struct link_map* map;
+    resolve_next();
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &map) == -1)
+        return -1;
+    // objects loaded along with handle come after it in the list
+    for (; map != NULL; map = map->l_next)
+        rebind_object(map);
+    return 0;
+}
+
+int zygote_arena_enable(size_t size) {
+    void* base;
+    void* self;
+    resolve_next();
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    arena_base = arena_top = (char *) base;
+    arena_end = arena_base + size;
+    memset(arena_free_lists, 0, sizeof(arena_free_lists));
+    // every object loaded so far, starting with the program
+    if ((self = dlopen(NULL, RTLD_LAZY)) == NULL || zygote_arena_bind(self) == -1) {
+        munmap(base, size);
+        arena_base = arena_top = arena_end = NULL;
+        errno = ENOSYS;
+        return -1;
+    }
+    __atomic_store_n(&arena_enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#else /* __linux__ */
+
+int zygote_arena_enable(size_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int zygote_arena_bind(void* handle) {
+    return 0;
+}
+
+#endif /* __linux__ */
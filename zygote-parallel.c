@@ -0,0 +1,236 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Fork-join loops over the data of run()
+ *
+ * zygote_parallel_for() forks helpers from the process calling it, which see
+ * all it sees copy-on-write, without any threads to survive fork().  The range
+ * is cut into chunks, and every process, the caller included, gets a share of
+ * consecutive chunks in a slot of memory mapped shared before the fork, with
+ * the first chunk and the end of the share packed in one 64-bit word.  Each
+ * takes chunks from the front of its own share, and once it runs out, steals
+ * the back half of the largest share left with a compare-and-swap on the same
+ * word, as its own new share.  A process finding nothing left to steal is
+ * done, and the caller returns once all helpers have exited.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "zygote.h"
+#include "zygote-internal.h"
+
+// chunks for each process to begin with, so the ones done early can steal
+#define CHUNKS_PER_PROC 64
+#define MAX_PROCS 1024
+
+typedef void (*range_fn_t)(long lo, long hi, void* ctx);
+
+// a share of chunks [first, end) packed in a word, on a cache line of its own
+typedef struct {
+    uint64_t range;
+    char pad[64 - sizeof(uint64_t)];
+} slot_t;
+
+#define PACK(first, end)    (((uint64_t) (first) << 32) | (uint32_t) (end))
+#define FIRST(range)        ((uint32_t) ((range) >> 32))
+#define END(range)          ((uint32_t) (range))
+
+static int num_procs = 0;
+static int in_parallel = 0;         // running ranges of a call already
+#ifdef __linux__
+static cpu_set_t zygote_cpus;
+static int has_zygote_cpus = 0;
+#endif
+
+void zygote_parallel_init(int procs) {
+    num_procs = procs;
+#ifdef __linux__
+    // before children pin themselves to CPUs
+    has_zygote_cpus = sched_getaffinity(0, sizeof(zygote_cpus), &zygote_cpus) == 0;
+#endif
+}
+
+// processes to spread the range over, counting the caller
+static int count_procs(void) {
+    long n = num_procs;
+    if (n <= 0) {
+#ifdef __linux__
+        cpu_set_t cpus;
+        if (has_zygote_cpus)
+            n = CPU_COUNT(&zygote_cpus);
+        else if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+            n = CPU_COUNT(&cpus);
+        else
+#endif
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n < 1)
+        n = 1;
+    if (n > MAX_PROCS)
+        n = MAX_PROCS;
+    return (int) n;
+}
+
+// take the first chunk of the share, if any
+static int take_chunk(slot_t* slot, uint32_t* chunk) {
+    uint64_t range = __atomic_load_n(&slot->range, __ATOMIC_ACQUIRE);
+    while (FIRST(range) < END(range))
+        if (__atomic_compare_exchange_n(&slot->range, &range, PACK(FIRST(range) + 1, END(range)),
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = FIRST(range);
+            return 1;
+        }
+    return 0;
+}
+
+// make the back half of the largest share of the others our own, or return 0
+// when there's none left
+static int steal_chunks(slot_t* slots, int procs, int self) {
+    uint64_t range, largest;
+    uint32_t mid;
+    int i, victim;
+    for (;;) {
+        victim = -1;
+        largest = 0;
+        for (i=0; i<procs; i++) {
+            if (i == self)
+                continue;
+            range = __atomic_load_n(&slots[i].range, __ATOMIC_ACQUIRE);
+            if (FIRST(range) < END(range) &&
+                    (victim == -1 || END(range) - FIRST(range) > END(largest) - FIRST(largest))) {
+                victim = i;
+                largest = range;
+            }
+        }
+        if (victim == -1)
+            return 0;
+        // the single chunk left too
+        mid = FIRST(largest) + (END(largest) - FIRST(largest)) / 2;
+        if (__atomic_compare_exchange_n(&slots[victim].range, &largest, PACK(FIRST(largest), mid),
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&slots[self].range, PACK(mid, END(largest)), __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+}
+
+static void run_chunks(slot_t* slots, int procs, int self, long begin, long end, long grain,
+        range_fn_t fn, void* ctx) {
+    uint32_t chunk;
+    long lo;
+    do {
+        while (take_chunk(&slots[self], &chunk)) {
+            lo = begin + chunk * grain;
+            fn(lo, end - lo < grain ? end : lo + grain, ctx);
+        }
+    } while (steal_chunks(slots, procs, self));
+}
+
+int zygote_parallel_for(long begin, long end, void (*fn)(long lo, long hi, void* ctx), void* ctx) {
+    struct sigaction dfl, saved;
+    slot_t* slots;
+    pid_t* helpers;
+    pid_t pid;
+    long n = end - begin, chunks, grain;
+    int procs, forked, i, status, failed = 0;
+
+    if (n <= 0)
+        return 0;
+    procs = in_parallel ? 1 : count_procs();
+    if (procs > n)
+        procs = (int) n;
+    // loops nested in fn run where they are
+    if (procs == 1) {
+        fn(begin, end, ctx);
+        return 0;
+    }
+    chunks = n < (long) procs * CHUNKS_PER_PROC ? n : (long) procs * CHUNKS_PER_PROC;
+    grain = (n + chunks - 1) / chunks;
+    chunks = (n + grain - 1) / grain;
+
+    slots = (slot_t *) mmap(NULL, procs * sizeof(slot_t), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("zygote_parallel_for: mmap");
+        fn(begin, end, ctx);
+        return 0;
+    }
+    for (i=0; i<procs; i++)
+        slots[i].range = PACK(chunks * i / procs, chunks * (i + 1) / procs);
+    helpers = (pid_t *) malloc(procs * sizeof(pid_t));
+    if (helpers == NULL) {
+        perror("zygote_parallel_for: malloc");
+        munmap(slots, procs * sizeof(slot_t));
+        fn(begin, end, ctx);
+        return 0;
+    }
+
+    // wait for the helpers ourselves, with nothing buffered for them to repeat
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &dfl, &saved);
+    fflush(NULL);
+    for (forked=0; forked<procs-1; forked++) {
+        helpers[forked] = fork();
+        if (helpers[forked] == -1) {
+            // its share is left for the others to steal
+            perror("zygote_parallel_for: fork");
+            break;
+        }
+        if (helpers[forked] == 0) {
+            in_parallel = 1;
+#ifdef __linux__
+            // not held to the single CPU of the child
+            if (has_zygote_cpus)
+                sched_setaffinity(0, sizeof(zygote_cpus), &zygote_cpus);
+#endif
+            run_chunks(slots, procs, forked + 1, begin, end, grain, fn, ctx);
+            fflush(NULL);
+            _exit(0);
+        }
+    }
+    in_parallel = 1;
+    run_chunks(slots, procs, 0, begin, end, grain, fn, ctx);
+    in_parallel = 0;
+    for (i=0; i<forked; i++) {
+        while ((pid = waitpid(helpers[i], &status, 0)) == -1 && errno == EINTR);
+        // maybe in the middle of a chunk
+        if (pid == -1 || status != 0)
+            failed = 1;
+    }
+    sigaction(SIGCHLD, &saved, NULL);
+    free(helpers);
+    munmap(slots, procs * sizeof(slot_t));
+    return failed ? -1 : 0;
+}
+
+void* zygote_scratch(size_t len) {
+    void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Placing grown children on CPUs and NUMA nodes
+ *
+ * The zygote picks a CPU for every request it dispatches, among those it is
+ * allowed to run on, and counts the children running on each.  The child pins
+ * itself before anything else: to that single CPU, or with the data-node
+ * policy, to all CPUs of the node holding the zygote's data, where the pages
+ * it reads are local.  The node of the data is where most of the first pages
+ * of objv are, as move_pages(2) tells.
+ *
+ * A replica of the zygote for another node runs there, prefers its memory,
+ * and moves the pages it has written onto it.  Those still shared with the
+ * zygote it forked from can't be moved, so they are copied on write, by
+ * writing to them.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "zygote-internal.h"
+
+static const char* policy_names[] = { "none", "round-robin", "least-loaded", "data-node" };
+
+#ifdef __linux__
+
+#define MAX_NODES 64
+// of <numaif.h>, which comes with libnuma rather than libc
+#define MPOL_PREFERRED 1
+#define MPOL_MF_MOVE (1 << 1)
+
+static int policy = ZYGOTE_PLACEMENT_NONE;
+static int num_cpus = 0;
+static int* cpus = NULL;        // allowed CPUs
+static int* node_of = NULL;     // by index into cpus
+static int* load = NULL;        // children running, by index into cpus
+static int data_node = -1;
+static int next = 0;
+
+static int cpu_index(int cpu) {
+    int i;
+    for (i=0; i<num_cpus; i++)
+        if (cpus[i] == cpu)
+            return i;
+    return -1;
+}
+
+// the CPUs of a node listed in sysfs, e.g., "0-3,8-11"
+static int read_cpulist(int node, cpu_set_t* set) {
+    char path[64], list[1024], *p, *end;
+    long first, last, cpu;
+    FILE* f;
+    CPU_ZERO(set);
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    if (fgets(list, sizeof(list), f) != NULL) {
+        for (p = list; *p >= '0' && *p <= '9'; p = *end == ',' ? end + 1 : end) {
+            first = last = strtol(p, &end, 10);
+            if (*end == '-')
+                last = strtol(end + 1, &end, 10);
+            for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                CPU_SET(cpu, set);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+// mark the CPUs of each node
+static void read_nodes(void) {
+    cpu_set_t set;
+    int node, i;
+    for (node = 0; node < MAX_NODES; node++)
+        if (read_cpulist(node, &set) == 0)
+            for (i=0; i<num_cpus; i++)
+                if (CPU_ISSET(cpus[i], &set))
+                    node_of[i] = node;
+}
+
+// the node where most of the first pages of objv are
+static int find_data_node(int objc, void* objv[]) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    void* *pages = (void* *) malloc((objc + 1) * sizeof(void *));
+    int* status = (int *) malloc((objc + 1) * sizeof(int));
+    int votes[MAX_NODES] = {0};
+    int i, best = -1;
+    for (i=0; i<objc; i++)
+        pages[i] = (void *) ((uintptr_t) objv[i] & ~(uintptr_t) (page_size - 1));
+    // with no nodes to move to, move_pages(2) only tells where they are
+    if (objc > 0 && syscall(SYS_move_pages, 0, (unsigned long) objc, pages, NULL, status, 0) == 0)
+        for (i=0; i<objc; i++)
+            if (status[i] >= 0 && status[i] < MAX_NODES && ++votes[status[i]] > (best == -1 ? 0 : votes[best]))
+                best = status[i];
+    free(pages);
+    free(status);
+    return best;
+}
+
+// the CPUs this process may run on, and their nodes
+static int load_cpus(void) {
+    cpu_set_t allowed;
+    int i, cpu;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    free(cpus);
+    free(node_of);
+    free(load);
+    num_cpus = CPU_COUNT(&allowed);
+    cpus = (int *) malloc(num_cpus * sizeof(int));
+    node_of = (int *) calloc(num_cpus, sizeof(int));
+    load = (int *) calloc(num_cpus, sizeof(int));
+    for (cpu = 0, i = 0; i < num_cpus && cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[i++] = cpu;
+    next = 0;
+    read_nodes();
+    return 0;
+}
+
+int zygote_placement_init(const char* name, int objc, void* objv[]) {
+    int i;
+    for (policy = 0; policy < sizeof(policy_names)/sizeof(*policy_names); policy++)
+        if (strcmp(name, policy_names[policy]) == 0)
+            break;
+    if (policy == sizeof(policy_names)/sizeof(*policy_names)) {
+        fprintf(stderr, "zygote: %s: unknown placement policy\n", name);
+        return policy = ZYGOTE_PLACEMENT_NONE;
+    }
+    if (policy == ZYGOTE_PLACEMENT_NONE)
+        return policy;
+    if (load_cpus() == -1)
+        return policy = ZYGOTE_PLACEMENT_NONE;
+    data_node = find_data_node(objc, objv);
+    if (data_node == -1)
+        data_node = node_of[0];
+    if (policy == ZYGOTE_PLACEMENT_DATA_NODE) {
+        // fall back to all CPUs if the data is where we may not run
+        for (i=0; i<num_cpus && node_of[i] != data_node; i++);
+        if (i == num_cpus) {
+            fprintf(stderr, "zygote: no CPUs allowed on node %d holding the data\n", data_node);
+            policy = ZYGOTE_PLACEMENT_LEAST_LOADED;
+        }
+    }
+    return policy;
+}
+
+int zygote_placement_data_node(void) {
+    return data_node;
+}
+
+int zygote_placement_node(int cpu) {
+    int i = cpu_index(cpu);
+    return i == -1 ? -1 : node_of[i];
+}
+
+int zygote_placement_pick(void) {
+    int i, j, best = -1;
+    switch (policy) {
+        case ZYGOTE_PLACEMENT_ROUND_ROBIN:
+            best = next;
+            next = (next + 1) % num_cpus;
+            break;
+        case ZYGOTE_PLACEMENT_LEAST_LOADED:
+        case ZYGOTE_PLACEMENT_DATA_NODE:
+            // start after the last pick, so ties are spread around
+            for (j=0; j<num_cpus; j++) {
+                i = (next + j) % num_cpus;
+                if (policy == ZYGOTE_PLACEMENT_DATA_NODE && node_of[i] != data_node)
+                    continue;
+                if (best == -1 || load[i] < load[best])
+                    best = i;
+            }
+            next = (best + 1) % num_cpus;
+            break;
+        default:
+            return -1;
+    }
+    load[best]++;
+    return cpus[best];
+}
+
+void zygote_placement_done(int cpu) {
+    int i = cpu_index(cpu);
+    if (i != -1 && load[i] > 0)
+        load[i]--;
+}
+
+int zygote_placement_pin(int cpu) {
+    cpu_set_t set;
+    int i;
+    CPU_ZERO(&set);
+    if (policy == ZYGOTE_PLACEMENT_DATA_NODE) {
+        // let the scheduler balance within the node
+        for (i=0; i<num_cpus; i++)
+            if (node_of[i] == data_node)
+                CPU_SET(cpus[i], &set);
+    } else {
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+int zygote_placement_nodes(int nodes[], int max, int objc, void* objv[]) {
+    int i, j, n = 0, first;
+    if (num_cpus == 0 && load_cpus() == -1)
+        return 0;
+    first = find_data_node(objc, objv);
+    for (i=0; i<num_cpus && n<max; i++) {
+        for (j=0; j<n && nodes[j] != node_of[i]; j++);
+        if (j < n)
+            continue;
+        nodes[n++] = node_of[i];
+        // the node of the data goes first
+        if (node_of[i] == first && n > 1) {
+            nodes[n-1] = nodes[0];
+            nodes[0] = first;
+        }
+    }
+    return n;
+}
+
+#define PAGES_AT_ONCE 512
+
+// move, or copy on write, the pages of a private writable mapping that are
+// on other nodes
+static long localize(char* start, char* end, int node, long page_size) {
+    void* pages[PAGES_AT_ONCE];
+    int nodes[PAGES_AT_ONCE];
+    int status[PAGES_AT_ONCE];
+    long moved = 0;
+    int i, n, away;
+    volatile char* p;
+    while (start < end) {
+        for (n = 0; n < PAGES_AT_ONCE && start < end; n++, start += page_size)
+            pages[n] = start;
+        // only present pages have a node, and others fault in locally
+        if (syscall(SYS_move_pages, 0, (unsigned long) n, pages, NULL, status, 0) != 0)
+            return -1;
+        for (i = 0, away = 0; i < n; i++)
+            if (status[i] >= 0 && status[i] != node) {
+                pages[away] = pages[i];
+                nodes[away++] = node;
+            }
+        if (away == 0)
+            continue;
+        // pages only this process maps move, but those still shared with the
+        // zygote fail with EACCES, and are copied by writing to them instead
+        syscall(SYS_move_pages, 0, (unsigned long) away, pages, nodes, status, MPOL_MF_MOVE);
+        for (i=0; i<away; i++) {
+            if (status[i] == -EACCES || status[i] == -EBUSY) {
+                p = (volatile char *) pages[i];
+                *p = *p;
+            } else if (status[i] != node) {
+                continue;
+            }
+            moved++;
+        }
+    }
+    return moved;
+}
+
+long zygote_placement_replicate(int node) {
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long start, end;
+    char perms[8], line[1024];
+    cpu_set_t set;
+    long n, moved = 0;
+    FILE* f;
+    // not only the CPUs this process may run on, which may be another node's
+    if (node < 0 || node >= MAX_NODES || read_cpulist(node, &set) == -1 ||
+            sched_setaffinity(0, sizeof(set), &set) == -1) {
+        fprintf(stderr, "zygote: cannot run on node %d\n", node);
+        return -1;
+    }
+    // whatever is allocated from now on comes from the node, when possible
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, (unsigned long) MAX_NODES + 1) == -1)
+        perror("set_mempolicy");
+    f = fopen("/proc/self/maps", "r");
+    if (f == NULL) {
+        perror("/proc/self/maps");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%lx-%lx %7s", &start, &end, perms) != 3 || strcmp(perms, "rw-p") != 0)
+            continue;
+        n = localize((char *) start, (char *) end, node, page_size);
+        if (n > 0)
+            moved += n;
+    }
+    fclose(f);
+    // place children among the CPUs of the node, and count it as the data's
+    if (policy != ZYGOTE_PLACEMENT_NONE && load_cpus() == 0)
+        data_node = node;
+    return moved;
+}
+
+#else /* __linux__ */
+
+int zygote_placement_init(const char* name, int objc, void* objv[]) {
+    if (strcmp(name, policy_names[ZYGOTE_PLACEMENT_NONE]) != 0)
+        fprintf(stderr, "zygote: placing children on CPUs is only on Linux\n");
+    return ZYGOTE_PLACEMENT_NONE;
+}
+
+int zygote_placement_data_node(void) {
+    return -1;
+}
+
+int zygote_placement_node(int cpu) {
+    return -1;
+}
+
+int zygote_placement_pick(void) {
+    return -1;
+}
+
+void zygote_placement_done(int cpu) {
+}
+
+int zygote_placement_pin(int cpu) {
+    return 0;
+}
+
+int zygote_placement_nodes(int nodes[], int max, int objc, void* objv[]) {
+    return 0;
+}
+
+long zygote_placement_replicate(int node) {
+    return -1;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,281 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Results of pure code kept to answer the same requests again
+ *
+ * A child running a request for code that declares itself pure writes its
+ * stdout and stderr to a pair of memory files instead of grow's, and copies
+ * them over once run() is done.  The zygote holds on to the other ends, and
+ * once the child exits normally, keeps them with its exit status under the
+ * key of the request, i.e., everything the run could depend on.  Later
+ * requests with the same key are answered by copying the files to their
+ * stdout and stderr without forking, as long as grow's take it all at once,
+ * or else by a child forked just for copying the rest.  The least recently
+ * used results are forgotten once they take up more than the given size.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "zygote-internal.h"
+
+#ifdef __linux__
+
+struct zygote_result {
+    char* key;
+    size_t key_len;
+    unsigned long long hash;
+    int fds[2];                     // memory files of stdout and stderr
+    int status;                     // exit status, or -1 while still running
+    off_t size;                     // of both files once done
+    unsigned long long used;        // when last served, by the clock below
+    zygote_result_t* next;
+};
+
+#define BUCKETS 4096
+static zygote_result_t* results[BUCKETS];   // chained by the hash of their keys
+static long long max_size = 0;
+static long long total_size = 0;
+static unsigned long long clock_hand = 0;
+
+int zygote_results_init(long long size) {
+    int fd = memfd_create("zygote-result", MFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    close(fd);
+    max_size = size;
+    return 0;
+}
+
+zygote_result_t* zygote_results_find(const char* key, size_t key_len, unsigned long long hash) {
+    zygote_result_t* r;
+    for (r = results[hash % BUCKETS]; r != NULL; r = r->next)
+        if (r->hash == hash && r->key_len == key_len && memcmp(r->key, key, key_len) == 0) {
+            r->used = ++clock_hand;
+            return r;
+        }
+    return NULL;
+}
+
+zygote_result_t* zygote_results_start(const char* key, size_t key_len, unsigned long long hash, int fds[2]) {
+    zygote_result_t* r = (zygote_result_t *) calloc(1, sizeof(zygote_result_t));
+    int i;
+    for (i=0; i<2; i++) {
+        r->fds[i] = memfd_create(i == 0 ? "zygote-stdout" : "zygote-stderr", MFD_CLOEXEC);
+        fds[i] = r->fds[i] == -1 ? -1 : dup(r->fds[i]);
+        if (fds[i] == -1) {
+            perror("memfd_create");
+            if (i > 0) {
+                close(fds[0]);
+                close(r->fds[0]);
+            }
+            if (r->fds[i] != -1)
+                close(r->fds[i]);
+            free(r);
+            return NULL;
+        }
+    }
+    r->key = (char *) malloc(key_len);
+    memcpy(r->key, key, key_len);
+    r->key_len = key_len;
+    r->hash = hash;
+    r->status = -1;
+    r->used = ++clock_hand;
+    r->next = results[hash % BUCKETS];
+    results[hash % BUCKETS] = r;
+    return r;
+}
+
+int zygote_results_status(zygote_result_t* r) {
+    return r->status;
+}
+
+int zygote_results_done(zygote_result_t* r, int status) {
+    struct stat st;
+    int i;
+    r->status = status;
+    for (i=0; i<2; i++)
+        if (fstat(r->fds[i], &st) == 0)
+            r->size += st.st_size;
+    total_size += r->size;
+    // rather than evicting all the others
+    return r->size > max_size ? -1 : 0;
+}
+
+void zygote_results_detach(zygote_result_t* r) {
+    zygote_result_t* *p;
+    for (p = &results[r->hash % BUCKETS]; *p != NULL; p = &(*p)->next)
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+}
+
+void zygote_results_drop(zygote_result_t* r) {
+    zygote_results_detach(r);
+    if (r->status != -1)
+        total_size -= r->size;
+    close(r->fds[0]);
+    close(r->fds[1]);
+    free(r->key);
+    free(r);
+}
+
+void zygote_results_trim(void) {
+    zygote_result_t* r;
+    zygote_result_t* lru;
+    int i;
+    while (total_size > max_size) {
+        // the ones still running aren't counted
+        for (lru = NULL, i = 0; i < BUCKETS; i++)
+            for (r = results[i]; r != NULL; r = r->next)
+                if (r->status != -1 && (lru == NULL || r->used < lru->used))
+                    lru = r;
+        if (lru == NULL)
+            break;
+        zygote_results_drop(lru);
+    }
+}
+
+void zygote_results_forget(void) {
+    zygote_result_t* r;
+    int i;
+    for (i=0; i<BUCKETS; i++)
+        while ((r = results[i]) != NULL) {
+            results[i] = r->next;
+            close(r->fds[0]);
+            close(r->fds[1]);
+            free(r->key);
+            free(r);
+        }
+    total_size = 0;
+}
+
+static int copy_file(int from, off_t* offset, int to, int block) {
+    char buf[65536];
+    struct stat st;
+    off_t size;
+    loff_t off;
+    struct pollfd pfd;
+    size_t len;
+    ssize_t n;
+    int mode, plain = 0;
+    if (fstat(from, &st) == -1)
+        return -1;
+    size = st.st_size;
+    mode = fstat(to, &st) == 0 ? (int) (st.st_mode & S_IFMT) : 0;
+    // a terminal may hold on to what's written, which the zygote can't wait for
+    if (!block && *offset < size && mode != S_IFIFO && mode != S_IFSOCK && mode != S_IFREG)
+        return 1;
+    while (*offset < size) {
+        len = size - *offset < (off_t) sizeof(buf) ? (size_t) (size - *offset) : sizeof(buf);
+        if (!block && mode == S_IFIFO) {
+            // without blocking on a pipe, or touching its flags shared with grow
+            off = *offset;
+            n = splice(from, &off, to, NULL, size - *offset, SPLICE_F_NONBLOCK);
+            if (n > 0)
+                *offset = off;
+        } else if (!block && mode == S_IFSOCK) {
+            n = pread(from, buf, len, *offset);
+            if (n > 0 && (n = send(to, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL)) > 0)
+                *offset += n;
+        } else if (!plain) {
+            n = sendfile(to, from, offset, size - *offset);
+            // not to a file opened for appending, for one
+            if (n == -1 && errno == EINVAL) {
+                plain = 1;
+                continue;
+            }
+        } else {
+            n = pread(from, buf, len, *offset);
+            if (n > 0 && (n = write(to, buf, n)) > 0)
+                *offset += n;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!block)
+                return 1;
+            // grow's may be non-blocking anyway
+            pfd.fd = to;
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (n <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+int zygote_results_copy(int from, off_t* offset, int to, int block) {
+    struct sigaction ignore, saved;
+    int rc;
+    // grow may be gone, which must not kill the zygote, nor a child yet to
+    // exit with the status of its run
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &saved);
+    rc = copy_file(from, offset, to, block);
+    sigaction(SIGPIPE, &saved, NULL);
+    return rc;
+}
+
+int zygote_results_replay(zygote_result_t* r, int fds[2], off_t offsets[2], int block) {
+    int i, n;
+    for (i=0; i<2; i++) {
+        if (fds[i] == -1)
+            continue;
+        n = zygote_results_copy(r->fds[i], &offsets[i], fds[i], block);
+        // the rest after what's already out
+        if (n == 1)
+            return 1;
+    }
+    return 0;
+}
+
+#else /* __linux__ */
+
+int zygote_results_init(long long size) { return -1; }
+zygote_result_t* zygote_results_find(const char* key, size_t key_len, unsigned long long hash) { return NULL; }
+zygote_result_t* zygote_results_start(const char* key, size_t key_len, unsigned long long hash, int fds[2]) { return NULL; }
+int zygote_results_status(zygote_result_t* r) { return -1; }
+int zygote_results_done(zygote_result_t* r, int status) { return -1; }
+void zygote_results_drop(zygote_result_t* r) { }
+void zygote_results_detach(zygote_result_t* r) { }
+void zygote_results_trim(void) { }
+void zygote_results_forget(void) { }
+int zygote_results_copy(int from, off_t* offset, int to, int block) { return -1; }
+int zygote_results_replay(zygote_result_t* r, int fds[2], off_t offsets[2], int block) { return 0; }
+
+#endif /* __linux__ */
@@ -0,0 +1,581 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Snapshots of a worker to reset it to after every run()
+ *
+ * Instead of forking a child for every request, a worker can take a snapshot
+ * of its memory once the code is loaded, and put back after each run() only
+ * the pages written to.  The snapshot is a clone of the worker frozen right
+ * away, which keeps the pristine pages shared copy-on-write for no more than
+ * the cost of a fork, and the worker reads them back from it with
+ * process_vm_readv().  Writes to anonymous memory are caught by
+ * write-protecting it with userfaultfd, so that a thread of the worker logs
+ * every page as it is first written, or dropped with madvise() or munmap(),
+ * and a reset costs in proportion to the pages written rather than the size
+ * of the address space.  Private file mappings, i.e., the data of the loaded
+ * objects, can't be write-protected this way, and are copied back whole.
+ *
+ * Mappings made since the snapshot are unmapped, and descriptors opened since
+ * closed.  But a mapping unmapped or changed since, or a thread still
+ * running, can't be put back, and the process must not go on then.
+ *
+ * All bookkeeping lives in a shared mapping of its own that is left alone,
+ * and nothing from the sync with the logging thread till the end of a reset
+ * may write to any other memory, but the stack.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "zygote-internal.h"
+
+#if defined(__linux__) && defined(SYS_userfaultfd)
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <limits.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
+
+// Linux 6.5, for anonymous pages yet to be touched
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1<<13)
+#endif
+
+#define MAX_MAPPINGS    (1 << 16)
+#define MAX_WRITES      (1 << 20)
+#define MAX_FDS         (1 << 16)
+#define MAPS_SIZE       (16 << 20)
+#define LOGGER_STACK    (256 << 10)
+
+typedef struct {
+    uintptr_t start, end;
+    char perms[5];
+    int tracked;        // write-protected, or else copied back whole
+    size_t seen;        // still mapped as it was
+} mapping_t;
+
+typedef struct {
+    uintptr_t start, end;
+} range_t;
+
+struct zygote_snapshot {
+    size_t size;        // of the mapping holding all this
+    long page_size;
+    pid_t frozen;
+    int uffd;
+    int stop;           // the logger on a snapshot given up
+    uintptr_t brk;
+    volatile char* sentinel;
+    mapping_t* mappings;
+    int num_mappings;
+    range_t* writes;    // logged by the logger
+    volatile size_t num_writes;
+    volatile int overflowed;
+    range_t* clipped;   // to the tracked mappings
+    range_t* unmaps;
+    struct iovec* iov;
+    unsigned char* fds;
+    char* maps;
+    void* logger_stack;
+};
+
+// log the range written to, or dropped
+static void log_write(zygote_snapshot_t* s, uintptr_t start, uintptr_t end) {
+    size_t n = s->num_writes;
+    if (n > 0 && s->writes[n-1].end == start) {
+        s->writes[n-1].end = end;
+        return;
+    }
+    if (n == MAX_WRITES) {
+        s->overflowed = 1;
+        return;
+    }
+    s->writes[n].start = start;
+    s->writes[n].end = end;
+    __atomic_store_n(&s->num_writes, n + 1, __ATOMIC_RELEASE);
+}
+
+// the logger thread, letting each write through once it's logged
+static void* log_writes(void* arg) {
+    zygote_snapshot_t* s = (zygote_snapshot_t *) arg;
+    struct uffd_msg msg;
+    struct uffdio_writeprotect wp;
+    struct pollfd fds[2] = { { s->uffd, POLLIN, 0 }, { s->stop, POLLIN, 0 } };
+    for (;;) {
+        if (poll(fds, 2, -1) == -1 && errno != EINTR)
+            return NULL;
+        if (fds[1].revents != 0)
+            return NULL;
+        if (fds[0].revents == 0)
+            continue;
+        if (read(s->uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return NULL;
+        }
+        switch (msg.event) {
+            case UFFD_EVENT_PAGEFAULT:
+                wp.range.start = msg.arg.pagefault.address & ~((uintptr_t) s->page_size - 1);
+                wp.range.len = s->page_size;
+                wp.mode = 0;
+                log_write(s, wp.range.start, wp.range.start + wp.range.len);
+                // which wakes the writer
+                ioctl(s->uffd, UFFDIO_WRITEPROTECT, &wp);
+                break;
+            case UFFD_EVENT_REMOVE:
+            case UFFD_EVENT_UNMAP:
+                log_write(s, msg.arg.remove.start, msg.arg.remove.end);
+                break;
+        }
+    }
+}
+
+static int write_protect(zygote_snapshot_t* s, uintptr_t start, uintptr_t end, int wp) {
+    struct uffdio_writeprotect range;
+    range.range.start = start;
+    range.range.len = end - start;
+    range.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    return ioctl(s->uffd, UFFDIO_WRITEPROTECT, &range);
+}
+
+// undo the registering and write-protecting of the tracked mappings
+static void unregister_all(zygote_snapshot_t* s) {
+    struct uffdio_range range;
+    int i;
+    for (i=0; i<s->num_mappings; i++) {
+        if (!s->mappings[i].tracked)
+            continue;
+        write_protect(s, s->mappings[i].start, s->mappings[i].end, 0);
+        range.start = s->mappings[i].start;
+        range.len = s->mappings[i].end - s->mappings[i].start;
+        ioctl(s->uffd, UFFDIO_UNREGISTER, &range);
+        s->mappings[i].tracked = 0;
+    }
+}
+
+// read /proc/self/maps into the bookkeeping, without allocating
+static int read_maps(zygote_snapshot_t* s) {
+    size_t len = 0;
+    ssize_t n;
+    int fd = open("/proc/self/maps", O_RDONLY);
+    if (fd == -1)
+        return -1;
+    while (len < MAPS_SIZE - 1 && (n = read(fd, s->maps + len, MAPS_SIZE - 1 - len)) > 0)
+        len += n;
+    close(fd);
+    if (len == MAPS_SIZE - 1)
+        return -1;
+    s->maps[len] = '\0';
+    return 0;
+}
+
+// parse a line of the maps, returning the next one, or NULL at the end
+static char* parse_maps_line(char* line, uintptr_t* start, uintptr_t* end, char perms[5], char* *name) {
+    char* p;
+    int i;
+    if (*line == '\0')
+        return NULL;
+    *start = strtoull(line, &p, 16);
+    *end = strtoull(p + 1, &p, 16);
+    for (p++, i=0; i<4; i++)
+        perms[i] = *p++;
+    perms[4] = '\0';
+    // offset, device and inode before the name
+    for (i=0; i<3 && *p != '\n'; i++) {
+        while (*p == ' ')
+            p++;
+        while (*p != ' ' && *p != '\n')
+            p++;
+    }
+    while (*p == ' ')
+        p++;
+    *name = p;
+    p = strchr(p, '\n');
+    return p != NULL ? p + 1 : *name + strlen(*name);
+}
+
+static int is_stack(const char* name) {
+    return strncmp(name, "[stack]", 7) == 0;
+}
+
+// copy the ranges back from the frozen clone
+static int copy_back(zygote_snapshot_t* s, const range_t* ranges, size_t n) {
+    size_t i, batch, total;
+    while (n > 0) {
+        batch = n < IOV_MAX ? n : IOV_MAX;
+        for (i=0, total=0; i<batch; i++) {
+            s->iov[i].iov_base = (void *) ranges[i].start;
+            s->iov[i].iov_len = ranges[i].end - ranges[i].start;
+            total += s->iov[i].iov_len;
+        }
+        if (process_vm_readv(s->frozen, s->iov, batch, s->iov, batch, 0) != (ssize_t) total)
+            return -1;
+        ranges += batch;
+        n -= batch;
+    }
+    return 0;
+}
+
+// the tracked mapping holding addr, if any
+static mapping_t* tracked_mapping(zygote_snapshot_t* s, uintptr_t addr) {
+    int lo = 0, hi = s->num_mappings - 1, mid;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (addr < s->mappings[mid].start)
+            hi = mid - 1;
+        else if (addr >= s->mappings[mid].end)
+            lo = mid + 1;
+        else
+            return s->mappings[mid].tracked ? &s->mappings[mid] : NULL;
+    }
+    return NULL;
+}
+
+// the logged ranges clipped to the tracked mappings, or overflowed if there
+// are too many of them
+static size_t clip_writes(zygote_snapshot_t* s, size_t n) {
+    mapping_t* m;
+    size_t i, len = 0;
+    uintptr_t start, end;
+    for (i=0; i<n; i++) {
+        for (start = s->writes[i].start; start < s->writes[i].end; start = end) {
+            m = tracked_mapping(s, start);
+            if (m == NULL) {
+                end = start + s->page_size;
+                continue;
+            }
+            end = m->end < s->writes[i].end ? m->end : s->writes[i].end;
+            if (len == MAX_WRITES) {
+                s->overflowed = 1;
+                return 0;
+            }
+            s->clipped[len].start = start;
+            s->clipped[len].end = end;
+            len++;
+        }
+    }
+    return len;
+}
+
+// write-protect again what has been logged, and start over
+static void protect_written(zygote_snapshot_t* s) {
+    size_t i, n;
+    n = s->overflowed ? 0 : clip_writes(s, __atomic_load_n(&s->num_writes, __ATOMIC_ACQUIRE));
+    if (s->overflowed) {
+        for (i=0; i<(size_t) s->num_mappings; i++)
+            if (s->mappings[i].tracked)
+                write_protect(s, s->mappings[i].start, s->mappings[i].end, 1);
+    } else {
+        for (i=0; i<n; i++)
+            write_protect(s, s->clipped[i].start, s->clipped[i].end, 1);
+    }
+    s->num_writes = 0;
+    s->overflowed = 0;
+}
+
+zygote_snapshot_t* zygote_snapshot_take(void) {
+    zygote_snapshot_t* s;
+    struct uffdio_api api;
+    struct uffdio_register reg;
+    pthread_attr_t attr;
+    pthread_t logger;
+    mapping_t* m;
+    uintptr_t start, end;
+    char perms[5];
+    char* name;
+    char* line;
+    size_t size, tracked = 0, copied = 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+    DIR* dir;
+    struct dirent* entry;
+    int fd, uffd;
+    pid_t pid, frozen;
+    int logging = 0;
+
+    uffd = syscall(SYS_userfaultfd, O_CLOEXEC);
+    if (uffd == -1) {
+        perror("userfaultfd");
+        return NULL;
+    }
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP | UFFD_FEATURE_WP_UNPOPULATED |
+        UFFD_FEATURE_EVENT_REMOVE | UFFD_FEATURE_EVENT_UNMAP;
+    if (ioctl(uffd, UFFDIO_API, &api) == -1) {
+        perror("userfaultfd: write-protecting unpopulated pages");
+        close(uffd);
+        return NULL;
+    }
+
+    // all bookkeeping in a mapping never merged with those it keeps
+    size = sizeof(zygote_snapshot_t) + MAX_MAPPINGS * (sizeof(mapping_t) + sizeof(range_t)) +
+        2 * MAX_WRITES * sizeof(range_t) + IOV_MAX * sizeof(struct iovec) + MAX_FDS / 8 +
+        MAPS_SIZE + LOGGER_STACK;
+    size = (size + page_size - 1) & ~(page_size - 1);
+    s = (zygote_snapshot_t *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (s == MAP_FAILED) {
+        perror("mmap");
+        close(uffd);
+        return NULL;
+    }
+    s->size = size;
+    s->page_size = page_size;
+    s->uffd = uffd;
+    s->sentinel = (volatile char *) MAP_FAILED;
+    s->stop = eventfd(0, EFD_CLOEXEC);
+    if (s->stop == -1)
+        goto error;
+    s->mappings = (mapping_t *) (s + 1);
+    s->unmaps = (range_t *) (s->mappings + MAX_MAPPINGS);
+    s->writes = s->unmaps + MAX_MAPPINGS;
+    s->clipped = s->writes + MAX_WRITES;
+    s->iov = (struct iovec *) (s->clipped + MAX_WRITES);
+    s->fds = (unsigned char *) (s->iov + IOV_MAX);
+    s->maps = (char *) (s->fds + MAX_FDS / 8);
+    s->logger_stack = (char *) s + size - LOGGER_STACK;
+    // to sync with the logger by
+    s->sentinel = (volatile char *) mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s->sentinel == MAP_FAILED)
+        goto error;
+    s->sentinel[0] = 0;
+
+    // on a stack of its own, left alone, and detached once the snapshot is
+    // taken
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, s->logger_stack, LOGGER_STACK);
+    if (pthread_create(&logger, &attr, log_writes, s) != 0) {
+        pthread_attr_destroy(&attr);
+        goto error;
+    }
+    pthread_attr_destroy(&attr);
+    logging = 1;
+
+    // keep every private writable mapping, write-protecting what can be
+    s->brk = (uintptr_t) sbrk(0);
+    if (read_maps(s) == -1)
+        goto error;
+    for (line = s->maps; (line = parse_maps_line(line, &start, &end, perms, &name)) != NULL; ) {
+        if (start == (uintptr_t) s || is_stack(name))
+            continue;
+        if (s->num_mappings == MAX_MAPPINGS)
+            goto error;
+        m = &s->mappings[s->num_mappings++];
+        m->start = start;
+        m->end = end;
+        memcpy(m->perms, perms, sizeof(m->perms));
+        m->tracked = 0;
+        if (perms[1] != 'w' || perms[3] != 'p')
+            continue;
+        reg.range.start = start;
+        reg.range.len = end - start;
+        reg.mode = UFFDIO_REGISTER_MODE_WP;
+        if (ioctl(uffd, UFFDIO_REGISTER, &reg) == 0) {
+            if (write_protect(s, start, end, 1) == 0) {
+                m->tracked = 1;
+                tracked += end - start;
+                continue;
+            }
+            ioctl(uffd, UFFDIO_UNREGISTER, &reg.range);
+        }
+        copied += end - start;
+    }
+    // the descriptors to keep
+    if ((dir = opendir("/proc/self/fd")) == NULL)
+        goto error;
+    while ((entry = readdir(dir)) != NULL)
+        if ((fd = atoi(entry->d_name)) < MAX_FDS && fd != dirfd(dir) && entry->d_name[0] != '.')
+            s->fds[fd / 8] |= 1 << (fd % 8);
+    closedir(dir);
+
+    // freeze a clone right away, skipping whatever fork() does, and closing
+    // only its own descriptors, as it shares the bookkeeping
+    pid = getpid();
+    frozen = syscall(SYS_clone, SIGCHLD, 0, NULL, NULL, 0);
+    if (frozen == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != pid)
+            _exit(0);
+#ifdef SYS_close_range
+        syscall(SYS_close_range, 0, ~0U, 0);
+#endif
+        for (;;)
+            pause();
+    }
+    if (frozen == -1) {
+        perror("clone");
+        goto error;
+    }
+    s->frozen = frozen;
+    pthread_detach(logger);
+    // what has been written since is as it was then
+    protect_written(s);
+    fprintf(stderr, "zygote[%d]: snapshot with %zu KiB write-protected, %zu KiB copied back whole\n",
+            pid, tracked >> 10, copied >> 10);
+    return s;
+
+error:
+    // let the writes through, and the logger go, before anything it uses
+    fprintf(stderr, "zygote[%d]: no snapshot of this process\n", getpid());
+    unregister_all(s);
+    if (logging) {
+        eventfd_write(s->stop, 1);
+        pthread_join(logger, NULL);
+    }
+    if (s->stop != -1)
+        close(s->stop);
+    if (s->sentinel != MAP_FAILED)
+        munmap((void *) s->sentinel, page_size);
+    munmap(s, size);
+    close(uffd);
+    return NULL;
+}
+
+long zygote_snapshot_restore(zygote_snapshot_t* s) {
+    uintptr_t start, end, cur, lo, hi;
+    char perms[5];
+    char* name;
+    char* line;
+    size_t num_unmaps = 0, n, i, pages = 0;
+    mapping_t* m;
+    DIR* dir;
+    struct dirent* entry;
+    int j, fd, threads = 0;
+
+    // nothing but this thread and the logger
+    if ((dir = opendir("/proc/self/task")) == NULL)
+        return -1;
+    while ((entry = readdir(dir)) != NULL)
+        if (entry->d_name[0] != '.')
+            threads++;
+    closedir(dir);
+    if (threads > 2)
+        return -1;
+    // close what's been opened since
+    if ((dir = opendir("/proc/self/fd")) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            fd = atoi(entry->d_name);
+            if (entry->d_name[0] != '.' && fd != dirfd(dir) && fd < MAX_FDS && !(s->fds[fd / 8] & (1 << (fd % 8))))
+                close(fd);
+        }
+        closedir(dir);
+    }
+
+    // find what's been mapped since, and make sure nothing else changed
+    syscall(SYS_brk, s->brk);
+    if (read_maps(s) == -1)
+        return -1;
+    for (j=0; j<s->num_mappings; j++)
+        s->mappings[j].seen = 0;
+    j = 0;
+    for (line = s->maps; (line = parse_maps_line(line, &start, &end, perms, &name)) != NULL; ) {
+        if (start == (uintptr_t) s || is_stack(name))
+            continue;
+        while (j < s->num_mappings && s->mappings[j].end <= start)
+            j++;
+        for (cur = start, i = j; i < (size_t) s->num_mappings && s->mappings[i].start < end; i++) {
+            m = &s->mappings[i];
+            if (m->start > cur && num_unmaps < MAX_MAPPINGS) {
+                s->unmaps[num_unmaps].start = cur;
+                s->unmaps[num_unmaps].end = m->start;
+                num_unmaps++;
+            }
+            lo = start > m->start ? start : m->start;
+            hi = end < m->end ? end : m->end;
+            if (strcmp(perms, m->perms) != 0)
+                return -1;
+            m->seen += hi - lo;
+            cur = hi;
+        }
+        if (cur < end && num_unmaps < MAX_MAPPINGS) {
+            s->unmaps[num_unmaps].start = cur;
+            s->unmaps[num_unmaps].end = end;
+            num_unmaps++;
+        }
+    }
+    for (j=0; j<s->num_mappings; j++)
+        if (s->mappings[j].seen != s->mappings[j].end - s->mappings[j].start)
+            return -1;
+    for (i=0; i<num_unmaps; i++)
+        munmap((void *) s->unmaps[i].start, s->unmaps[i].end - s->unmaps[i].start);
+
+    // from here on, the logger must have logged every write that matters
+    s->sentinel[0]++;
+
+    // copy back what's been written
+    n = s->overflowed ? 0 : clip_writes(s, __atomic_load_n(&s->num_writes, __ATOMIC_ACQUIRE));
+    if (s->overflowed) {
+        for (j=0; j<s->num_mappings; j++) {
+            m = &s->mappings[j];
+            if (!m->tracked)
+                continue;
+            write_protect(s, m->start, m->end, 0);
+            s->unmaps[0].start = m->start;
+            s->unmaps[0].end = m->end;
+            if (copy_back(s, s->unmaps, 1) == -1)
+                return -1;
+            pages += (m->end - m->start) / s->page_size;
+        }
+    } else {
+        if (copy_back(s, s->clipped, n) == -1)
+            return -1;
+        for (i=0; i<n; i++)
+            pages += (s->clipped[i].end - s->clipped[i].start) / s->page_size;
+    }
+    // and all that can't be tracked
+    for (j=0; j<s->num_mappings; j++) {
+        m = &s->mappings[j];
+        if (m->tracked || m->perms[1] != 'w' || m->perms[3] != 'p')
+            continue;
+        s->unmaps[0].start = m->start;
+        s->unmaps[0].end = m->end;
+        if (copy_back(s, s->unmaps, 1) == -1)
+            return -1;
+        pages += (m->end - m->start) / s->page_size;
+    }
+    protect_written(s);
+    return pages;
+}
+
+#else /* __linux__ */
+
+zygote_snapshot_t* zygote_snapshot_take(void) {
+    fprintf(stderr, "zygote: snapshots need userfaultfd\n");
+    return NULL;
+}
+
+long zygote_snapshot_restore(zygote_snapshot_t* s) {
+    return -1;
+}
+
+#endif /* __linux__ */
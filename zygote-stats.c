@@ -0,0 +1,245 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Publishing live statistics of the zygote
+ *
+ * Only the zygote itself writes to the page, so updates need no atomic
+ * read-modify-writes, only the seq increments around them to let readers
+ * tell a torn snapshot.  Children stop writing as soon as they are forked,
+ * except replicas of the zygote, which each take over a page of their own.
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "zygote-stats.h"
+#include "zygote-internal.h"
+
+#define begin_update() \
+    do { \
+        __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED); \
+        __atomic_thread_fence(__ATOMIC_RELEASE); \
+    } while (0)
+#define end_update() \
+    __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE)
+
+static zygote_stats_t* stats = NULL;
+static zygote_stats_t* pages = NULL;    // of all replicas, still mapped when detached
+static int num_pages = 0;
+static char* stats_path = NULL;
+
+int zygote_stats_open(const char* socket_path, int replicas) {
+    int fd;
+    void* p;
+    if (replicas < 1)
+        replicas = 1;
+    stats_path = (char *) malloc(strlen(socket_path) + sizeof(ZYGOTE_STATS_SUFFIX));
+    sprintf(stats_path, "%s%s", socket_path, ZYGOTE_STATS_SUFFIX);
+    // a fresh file, never one a link planted there points to
+    if (unlink(stats_path) == -1 && errno != ENOENT)
+        perror(stats_path);
+    fd = open(stats_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if (fd == -1 || ftruncate(fd, replicas * sizeof(zygote_stats_t)) == -1) {
+        perror(stats_path);
+        if (fd != -1)
+            close(fd);
+        free(stats_path);
+        stats_path = NULL;
+        return -1;
+    }
+    p = mmap(NULL, replicas * sizeof(zygote_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(stats_path);
+        unlink(stats_path);
+        free(stats_path);
+        stats_path = NULL;
+        return -1;
+    }
+    stats = pages = (zygote_stats_t *) p;
+    num_pages = replicas;
+    stats->magic = ZYGOTE_STATS_MAGIC;
+    stats->version = ZYGOTE_STATS_VERSION;
+    stats->pid = getpid();
+    stats->started = time(NULL);
+    stats->replicas = replicas;
+    strcpy(stats->placement, "none");
+    stats->data_node = -1;
+    return 0;
+}
+
+void zygote_stats_replica(int i) {
+    if (pages == NULL || i <= 0 || i >= num_pages)
+        return;
+    stats = &pages[i];
+    // a replica taking over from one that went away keeps its counts, but
+    // may find the page in the middle of an update
+    if (stats->seq & 1)
+        stats->seq++;
+    begin_update();
+    if (stats->magic != ZYGOTE_STATS_MAGIC) {
+        stats->magic = ZYGOTE_STATS_MAGIC;
+        stats->version = ZYGOTE_STATS_VERSION;
+        stats->replicas = num_pages;
+        memcpy(stats->placement, pages[0].placement, sizeof(stats->placement));
+        stats->data_node = pages[0].data_node;
+    }
+    stats->pid = getpid();
+    stats->started = time(NULL);
+    stats->in_flight = stats->pool_ready = stats->sub_zygotes = stats->queue_len = 0;
+    end_update();
+}
+
+void zygote_stats_close(void) {
+    if (stats_path != NULL)
+        unlink(stats_path);
+    zygote_stats_detach();
+}
+
+void zygote_stats_detach(void) {
+    stats = NULL;
+    stats_path = NULL;
+}
+
+static int bucket(long long ns) {
+    unsigned long long us = ns > 0 ? ns / 1000 + 1 : 1;
+    int i;
+    for (i = 0; us > 1 && i < ZYGOTE_STATS_BUCKETS - 1; i++)
+        us >>= 1;
+    return i;
+}
+
+// the slot for the code path by FNV-1a hash, or NULL if the table is full
+static unsigned long long* code_hits(const char* path) {
+    unsigned int h = 2166136261u;
+    const char* p;
+    int i, n;
+    for (p = path; *p; p++) {
+        h ^= (unsigned char) *p;
+        h *= 16777619u;
+    }
+    for (n = 0, i = h % ZYGOTE_STATS_CODES; n < ZYGOTE_STATS_CODES; n++, i = (i + 1) % ZYGOTE_STATS_CODES) {
+        if (stats->codes[i].path[0] == '\0') {
+            if (strlen(path) >= ZYGOTE_STATS_PATH_MAX)
+                return NULL;
+            strcpy(stats->codes[i].path, path);
+            return &stats->codes[i].hits;
+        }
+        if (strcmp(stats->codes[i].path, path) == 0)
+            return &stats->codes[i].hits;
+    }
+    return NULL;
+}
+
+void zygote_stats_request(const char* code_path) {
+    unsigned long long* hits;
+    if (stats == NULL)
+        return;
+    begin_update();
+    stats->requests++;
+    if (code_path == NULL)
+        stats->rejected++;
+    else if ((hits = code_hits(code_path)) != NULL)
+        (*hits)++;
+    else
+        stats->other_hits++;
+    end_update();
+}
+
+void zygote_stats_dispatch(int how) {
+    if (stats == NULL)
+        return;
+    begin_update();
+    switch (how) {
+        case ZYGOTE_STATS_FORKED: stats->forked++;   break;
+        case ZYGOTE_STATS_POOLED: stats->pooled++;   break;
+        case ZYGOTE_STATS_CACHED: stats->cached++;   break;
+        case ZYGOTE_STATS_LOADED: stats->loaded++;   break;
+        case ZYGOTE_STATS_THREADED: stats->threaded++; break;
+        case ZYGOTE_STATS_WORKED: stats->worked++;   break;
+        case ZYGOTE_STATS_MEMOIZED: stats->memoized++; break;
+        case ZYGOTE_STATS_COALESCED: stats->coalesced++; break;
+        case ZYGOTE_STATS_QUEUED: stats->queued++;   break;
+        case ZYGOTE_STATS_BUSY:   stats->busy++;     break;
+        default:                  stats->rejected++; break;
+    }
+    // no child runs for a result already there or on its way
+    if (how != ZYGOTE_STATS_REJECTED && how != ZYGOTE_STATS_QUEUED && how != ZYGOTE_STATS_BUSY &&
+            how != ZYGOTE_STATS_MEMOIZED && how != ZYGOTE_STATS_COALESCED)
+        stats->in_flight++;
+    end_update();
+}
+
+void zygote_stats_fork(long long ns) {
+    if (stats == NULL)
+        return;
+    begin_update();
+    stats->fork_us[bucket(ns)]++;
+    end_update();
+}
+
+void zygote_stats_done(long long run_ns, int failed) {
+    if (stats == NULL)
+        return;
+    begin_update();
+    stats->completed++;
+    if (failed)
+        stats->failed++;
+    if (stats->in_flight > 0)
+        stats->in_flight--;
+    stats->run_us[bucket(run_ns)]++;
+    end_update();
+}
+
+void zygote_stats_placement(const char* policy, int data_node) {
+    if (stats == NULL)
+        return;
+    begin_update();
+    snprintf(stats->placement, sizeof(stats->placement), "%s", policy);
+    stats->data_node = data_node;
+    end_update();
+}
+
+void zygote_stats_placed(int local) {
+    if (stats == NULL)
+        return;
+    begin_update();
+    if (local)
+        stats->local++;
+    else
+        stats->remote++;
+    end_update();
+}
+
+void zygote_stats_gauges(int pool_ready, int sub_zygotes, int queue_len) {
+    if (stats == NULL || (stats->pool_ready == pool_ready && stats->sub_zygotes == sub_zygotes &&
+                stats->queue_len == queue_len))
+        return;
+    begin_update();
+    stats->pool_ready = pool_ready;
+    stats->sub_zygotes = sub_zygotes;
+    stats->queue_len = queue_len;
+    end_update();
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2013 Jaeho Shin <netj@cs.stanford.edu>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libzygote -- Watch the live statistics of a zygote
+ *
+ * See: https://github.com/netj/libzygote/#readme
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "zygote-stats.h"
+
+// the upper bound in microseconds of the bucket where the given fraction of
+// the samples falls
+static double percentile(const unsigned long long hist[], double fraction) {
+    unsigned long long total = 0, seen = 0;
+    int i;
+    for (i=0; i<ZYGOTE_STATS_BUCKETS; i++)
+        total += hist[i];
+    if (total == 0)
+        return 0;
+    for (i=0; i<ZYGOTE_STATS_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= fraction * total)
+            break;
+    }
+    return (double) ((1ULL << (i + 1)) - 1);
+}
+
+static void print_latency(const char* name, const unsigned long long hist[]) {
+    printf("%-6s p50 <%10.3f ms   p90 <%10.3f ms   p99 <%10.3f ms\n", name,
+            percentile(hist, .50) / 1e3, percentile(hist, .90) / 1e3, percentile(hist, .99) / 1e3);
+}
+
+// count a replica's page into the first one's
+static void add_stats(zygote_stats_t* total, const zygote_stats_t* s) {
+    int i, j;
+    total->requests  += s->requests;
+    total->rejected  += s->rejected;
+    total->forked    += s->forked;
+    total->pooled    += s->pooled;
+    total->cached    += s->cached;
+    total->loaded    += s->loaded;
+    total->threaded  += s->threaded;
+    total->worked    += s->worked;
+    total->memoized  += s->memoized;
+    total->coalesced += s->coalesced;
+    total->queued    += s->queued;
+    total->busy      += s->busy;
+    total->completed += s->completed;
+    total->failed    += s->failed;
+    total->in_flight   += s->in_flight;
+    total->pool_ready  += s->pool_ready;
+    total->sub_zygotes += s->sub_zygotes;
+    total->queue_len   += s->queue_len;
+    total->local  += s->local;
+    total->remote += s->remote;
+    for (i=0; i<ZYGOTE_STATS_BUCKETS; i++) {
+        total->fork_us[i] += s->fork_us[i];
+        total->run_us[i]  += s->run_us[i];
+    }
+    total->other_hits += s->other_hits;
+    for (i=0; i<ZYGOTE_STATS_CODES; i++) {
+        if (s->codes[i].path[0] == '\0')
+            continue;
+        for (j=0; j<ZYGOTE_STATS_CODES; j++)
+            if (total->codes[j].path[0] == '\0' || strcmp(total->codes[j].path, s->codes[i].path) == 0)
+                break;
+        if (j == ZYGOTE_STATS_CODES) {
+            total->other_hits += s->codes[i].hits;
+            continue;
+        }
+        if (total->codes[j].path[0] == '\0')
+            strcpy(total->codes[j].path, s->codes[i].path);
+        total->codes[j].hits += s->codes[i].hits;
+    }
+}
+
+// take a snapshot of every replica's page, and add them up
+static int read_stats(const zygote_stats_t* shared, int num_pages, zygote_stats_t* total) {
+    zygote_stats_t page;
+    int i;
+    if (zygote_stats_read(&shared[0], total) == -1)
+        return -1;
+    // replicas yet to start have no page
+    for (i=1; i<num_pages && i<total->replicas; i++)
+        if (zygote_stats_read(&shared[i], &page) == 0)
+            add_stats(total, &page);
+    return 0;
+}
+
+static void print_stats(zygote_stats_t* s, zygote_stats_t* prev, double interval) {
+    int order[ZYGOTE_STATS_CODES];
+    int i, j, n = 0;
+    long long uptime = time(NULL) - s->started;
+    printf("zygote[%d]: up %lld:%02lld:%02lld, %d in flight, %d queued, %d warm, %d sub-zygotes",
+            s->pid, uptime / 3600, uptime / 60 % 60, uptime % 60,
+            s->in_flight, s->queue_len, s->pool_ready, s->sub_zygotes);
+    if (s->replicas > 1)
+        printf(", %d replicas", s->replicas);
+    printf("\n");
+    printf("requests %12llu", s->requests);
+    if (prev != NULL)
+        printf("   %10.1f/s", (s->requests - prev->requests) / interval);
+    printf("\n");
+    printf("  forked %12llu   pooled %12llu   cached %12llu   loaded %12llu   rejected %llu\n",
+            s->forked, s->pooled, s->cached, s->loaded, s->rejected);
+    printf("  waited %12llu   busy   %12llu   thread %12llu   worker %12llu\n",
+            s->queued, s->busy, s->threaded, s->worked);
+    if (s->memoized + s->coalesced > 0)
+        printf("  memo   %12llu   joined %12llu\n", s->memoized, s->coalesced);
+    if (strcmp(s->placement, "none") != 0)
+        printf("  placed %12llu   local  %12llu   remote %12llu   by %s, data on node %d\n",
+                s->local + s->remote, s->local, s->remote, s->placement, s->data_node);
+    printf("done     %12llu", s->completed);
+    if (prev != NULL)
+        printf("   %10.1f/s", (s->completed - prev->completed) / interval);
+    printf("   failed %llu\n", s->failed);
+    printf("\n");
+    print_latency("fork", s->fork_us);
+    print_latency("run", s->run_us);
+    printf("\n");
+    // shared objects by the most requests
+    for (i=0; i<ZYGOTE_STATS_CODES; i++) {
+        if (s->codes[i].path[0] == '\0')
+            continue;
+        for (j = n++; j > 0 && s->codes[order[j-1]].hits < s->codes[i].hits; j--)
+            order[j] = order[j-1];
+        order[j] = i;
+    }
+    printf("%12s  %s\n", "requests", "shared object");
+    for (j=0; j<n && j<10; j++)
+        printf("%12llu  %s\n", s->codes[order[j]].hits, s->codes[order[j]].path);
+    if (s->other_hits > 0)
+        printf("%12llu  (others)\n", s->other_hits);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    char* stats_path;
+    int fd, c, num_pages;
+    struct stat st;
+    int once = 0;
+    double delay = 2;
+    void* p;
+    zygote_stats_t* shared;
+    zygote_stats_t snapshot, prev;
+    int has_prev = 0;
+    struct timespec ts;
+
+    // check arguments
+    while ((c = getopt(argc, argv, "1d:")) != -1) {
+        switch (c) {
+            case '1':
+                once = 1;
+                break;
+            case 'd':
+                delay = atof(optarg);
+                if (delay <= 0)
+                    goto usage;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (argc - optind != 1) {
+usage:
+        fprintf(stdout,
+                "zygote-top -- Watch the live statistics of a zygote\n"
+                "Usage: zygote-top [-1] [-d SECONDS] ZYGOTE_SOCKET_PATH\n"
+                "\n"
+                "  -1          print the statistics once, and exit\n"
+                "  -d SECONDS  refresh this often, 2 seconds by default\n"
+                "\n"
+                "For more info, see: https://github.com/netj/libzygote/#readme\n"
+                );
+        return 1;
+    }
+
+    // map the stats page next to the socket
+    stats_path = (char *) malloc(strlen(argv[optind]) + sizeof(ZYGOTE_STATS_SUFFIX));
+    sprintf(stats_path, "%s%s", argv[optind], ZYGOTE_STATS_SUFFIX);
+    fd = open(stats_path, O_RDONLY);
+    if (fd == -1) {
+        perror(stats_path);
+        return 2;
+    }
+    // with a page for each replica
+    num_pages = fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(zygote_stats_t) ?
+        st.st_size / sizeof(zygote_stats_t) : 1;
+    p = mmap(NULL, num_pages * sizeof(zygote_stats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(stats_path);
+        return 2;
+    }
+    shared = (zygote_stats_t *) p;
+
+    ts.tv_sec = (time_t) delay;
+    ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1e9);
+    for (;;) {
+        if (read_stats(shared, num_pages, &snapshot) == -1) {
+            fprintf(stderr, "%s: not readable as zygote statistics\n", stats_path);
+            return 2;
+        }
+        if (once) {
+            print_stats(&snapshot, NULL, 0);
+            return 0;
+        }
+        // clear the screen before every refresh
+        printf("\033[H\033[2J");
+        print_stats(&snapshot, has_prev ? &prev : NULL, delay);
+        prev = snapshot;
+        has_prev = 1;
+        nanosleep(&ts, NULL);
+    }
+}
@@ -32,8 +32,16 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <poll.h>
+#include <stdint.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <fcntl.h>
 // dlopen and dlsym
 #include <dlfcn.h>
 #define DLOPEN_FLAGS  RTLD_LAZY
@@ -52,6 +60,24 @@
 #ifdef __linux__
 #include <sys/prctl.h>
 #endif /* __linux__ */
+// event loop
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#endif /* __linux__ */
+// batch scheduling of children, hidden by glibc without _GNU_SOURCE
+#if defined(__linux__) && !defined(SCHED_BATCH)
+#define SCHED_BATCH 3
+#endif
+// users and groups named in ZYGOTE_PRIORITIES
+#include <pwd.h>
+#include <grp.h>
+// worker threads of the executor
+#include <pthread.h>
+#ifndef RUSAGE_THREAD
+// Linux's, which getrusage() turns down elsewhere
+#define RUSAGE_THREAD 1
+#endif
 
 static FILE* zygote_stderr = NULL;
 static char zygote_hostname[40];
@@ -73,6 +99,7 @@ static char zygote_hostname[40];
     } while (0)
 
 typedef int (*run_t)(int objc, void* objv[], int argc, char* argv[]);
+typedef int (*reduce_t)(int objc, void* objv[], int argc, char* argv[]);
 
 // Workaround for OS X not allowing shared libraries' access to environ
 // See: https://bugzilla.samba.org/show_bug.cgi?id=5412#c1
@@ -87,6 +114,55 @@ extern char* *environ;
 #endif /* __APPLE__ */
 
 #include "zygote.h"
+#include "zygote-protocol.h"
+#include "zygote-internal.h"
+#include "zygote-stats.h"
+
+// stdin, stdout, stderr of grow, and the pipes of a fuzzer with --forkserver
+#define ZYGOTE_REQUEST_FDS 5
+#define FORKSRV_CTL 3
+#define FORKSRV_ST  4
+
+// connection to grow, and the descriptors of the request
+#define ZYGOTE_MAX_FDS (1 + ZYGOTE_REQUEST_FDS)
+
+// internal flag for a frame standing in for an unframed request, whose
+// remainder is still to be received from the connection
+#define ZYGOTE_CAP_UNFRAMED 0x80000000
+
+// A request to grow, parsed in place from a single frame
+typedef struct {
+    char* frame;
+    size_t frame_len;
+    int id;
+    int caps;
+    char* code_path;
+    char* cwd;
+    char* *envp;
+    int argc;
+    char* *argv;
+    char* *optv;
+    int connection_fd;
+    int fds[ZYGOTE_REQUEST_FDS];
+    long long times[ZYGOTE_TIMES];
+    int priority;       // PRIORITY_*
+    int shards;         // children its run is split into, or 0
+    int cpu;            // picked for the child, or -1
+    uid_t uid;          // of the peer
+    long long finish;   // virtual time its turn ends, while it waits
+    char* key;          // of its result, if its run may be memoized
+    size_t key_len;
+    unsigned long long key_hash;
+    zygote_result_t* result;    // started for it, or that it waits for
+    int capture[2];     // memory files its child writes stdout and stderr to
+} request_t;
+
+// nanoseconds of CLOCK_MONOTONIC, which is the same for all processes
+static long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
 static char objvStr[BUFSIZ];
 
@@ -150,6 +226,210 @@ static ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd) {
 }
 /* end read_fd */
 
+// send nbytes in one message with file descriptors attached, and the rest of
+// it without, if the socket buffer didn't take them all at once
+static int send_fds(int fd, void *ptr, size_t nbytes, int *sendfds, int nfds) {
+    struct msghdr   msg = {0};
+    struct iovec    iov[1];
+    union {
+      struct cmsghdr    cm;
+      char              control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+    } control_un;
+    struct cmsghdr  *cmptr;
+    char*           p = (char *) ptr;
+    ssize_t         n;
+
+    if (nfds > 0) {
+        msg.msg_control = control_un.control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmptr = CMSG_FIRSTHDR(&msg);
+        cmptr->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        cmptr->cmsg_level = SOL_SOCKET;
+        cmptr->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmptr), sendfds, nfds * sizeof(int));
+    }
+    iov[0].iov_base = p;
+    iov[0].iov_len = nbytes;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    // the other end may be gone, so never die of SIGPIPE here
+    do n = sendmsg(fd, &msg, MSG_NOSIGNAL); while (n == -1 && errno == EINTR);
+    if (n == -1)
+        return -1;
+    for (p += n, nbytes -= n; nbytes > 0; p += n, nbytes -= n) {
+        n = send(fd, p, nbytes, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            n = 0;
+        else if (n == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// receive up to nbytes, collecting any file descriptors attached to them
+static ssize_t recv_fds(int fd, void *ptr, size_t nbytes, int *recvfds, int *nfds, int flags) {
+    struct msghdr   msg = {0};
+    struct iovec    iov[1];
+    union {
+      struct cmsghdr    cm;
+      char              control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+    } control_un;
+    struct cmsghdr  *cmptr;
+    ssize_t         n;
+
+    msg.msg_control = control_un.control;
+    msg.msg_controllen = sizeof(control_un.control);
+    iov[0].iov_base = ptr;
+    iov[0].iov_len = nbytes;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    *nfds = 0;
+    do n = recvmsg(fd, &msg, flags); while (n == -1 && errno == EINTR);
+    if (n <= 0)
+        return n;
+    for (cmptr = CMSG_FIRSTHDR(&msg); cmptr != NULL; cmptr = CMSG_NXTHDR(&msg, cmptr))
+        if (cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmptr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(recvfds, CMSG_DATA(cmptr), *nfds * sizeof(int));
+        }
+    return n;
+}
+
+// receive exactly nbytes, or fail
+static int recv_all(int fd, void* ptr, size_t nbytes) {
+    char* p = (char *) ptr;
+    while (nbytes > 0) {
+        ssize_t n = read(fd, p, nbytes);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        nbytes -= n;
+    }
+    return 0;
+}
+
+
+// Tunables are taken from the environment of the zygote process
+static long zygote_option(const char* name, long default_value) {
+    char* value = getenv(name);
+    char* end;
+    long num;
+    if (value == NULL || *value == '\0')
+        return default_value;
+    num = strtol(value, &end, 10);
+    if (*end != '\0') {
+        log("zygote: ignoring malformed %s=%s\n", name, value);
+        return default_value;
+    }
+    return num;
+}
+
+
+// split NUL-terminated strings of a section into a NULL-terminated array
+static char* *split_strings(char* p, int length, int reserve, int *count) {
+    char* *strs;
+    char* end = p + length;
+    int n = 0;
+    char* q;
+    for (q = p; q < end; q++)
+        if (*q == '\0')
+            n++;
+    strs = (char* *) malloc((reserve + n + 1) * sizeof(char*));
+    for (n = reserve; p < end; p += strlen(p) + 1)
+        strs[n++] = p;
+    strs[n] = NULL;
+    if (count != NULL)
+        *count = n;
+    return strs;
+}
+
+// parse the sections of a frame without copying them
+static int parse_request(request_t* req, char* frame, size_t frame_len) {
+    zygote_frame_t header;
+    zygote_section_t section;
+    char* p = frame + sizeof(header);
+    char* end = frame + frame_len;
+    char* argp = NULL;
+    int argl = 0;
+
+    memcpy(&header, frame, sizeof(header));
+    req->frame = frame;
+    req->frame_len = frame_len;
+    req->id = header.id;
+    req->caps = header.caps;
+    req->code_path = NULL;
+    req->cwd = NULL;
+    req->envp = NULL;
+    req->optv = NULL;
+    req->key = NULL;
+    req->result = NULL;
+    req->capture[0] = req->capture[1] = -1;
+    while (p + sizeof(section) <= end) {
+        memcpy(&section, p, sizeof(section));
+        p += sizeof(section);
+        if (section.length < 0 || section.length > end - p)
+            return -1;
+        // every string in a section must be NUL-terminated
+        if (section.length > 0 && p[section.length - 1] != '\0')
+            return -1;
+        switch (section.type) {
+            case ZYGOTE_SECTION_CODE:   req->code_path = p;                                         break;
+            case ZYGOTE_SECTION_CWD:    req->cwd = p;                                               break;
+            case ZYGOTE_SECTION_ENV:    req->envp = split_strings(p, section.length, 0, NULL);     break;
+            case ZYGOTE_SECTION_ARGV:   argp = p; argl = section.length;                            break;
+            case ZYGOTE_SECTION_OPTION: req->optv = split_strings(p, section.length, 0, NULL);     break;
+        }
+        p += section.length;
+    }
+    if (req->code_path == NULL)
+        return -1;
+    req->argv = split_strings(argp, argl, 1, &req->argc);
+    req->argv[0] = req->code_path;
+    return 0;
+}
+
+// look up the value of a request option, or NULL if not given
+static char* request_option(request_t* req, const char* name) {
+    size_t len = strlen(name);
+    char* *opt;
+    if (req->optv == NULL)
+        return NULL;
+    // records after the exit status can't be told apart from those of the
+    // next request on a pipelined connection
+    if ((req->caps & ZYGOTE_CAP_PIPELINE) && strcmp(name, "timing") == 0)
+        return NULL;
+    for (opt = req->optv; *opt != NULL; opt++)
+        if (strncmp(*opt, name, len) == 0 && (*opt)[len] == '=')
+            return *opt + len + 1;
+    return NULL;
+}
+
+// send a reply record to the frame with the given id
+static int send_reply(int connection_fd, int id, int type, void* payload, int length) {
+    zygote_reply_t header = { type, id, length };
+    struct iovec iov[2] = {
+        { &header, sizeof(header) },
+        { payload, length },
+    };
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    // grow may be gone, which must not kill the zygote reaping its child
+    return sendmsg(connection_fd, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+// send a reply record about the request back to grow
+static int reply(request_t* req, int type, void* payload, int length) {
+    if (req->caps & ZYGOTE_CAP_UNFRAMED) {
+        // unframed clients only expect the first number of each record
+        if (type != ZYGOTE_REPLY_PID && type != ZYGOTE_REPLY_EXIT)
+            return 0;
+        return write(req->connection_fd, payload, sizeof(int)) == -1 ? -1 : 0;
+    }
+    return send_reply(req->connection_fd, req->id, type, payload, length);
+}
 
 #ifdef _BSD_SOURCE
 #define HAS_ON_EXIT
@@ -157,29 +437,24 @@ static ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd) {
 #ifdef HAS_ON_EXIT
 // Try to reply with the final exit status if possible
 // See: http://www.gnu.org/software/libc/manual/html_mono/libc.html#Cleanups-on-Exit
-static int grow_connection_fd;
+static request_t* grow_request = NULL;
 static void replyWithExitStatus(int status, void* arg) {
-    if (grow_connection_fd != -1)
-        write(grow_connection_fd, &status, sizeof(status));
+    if (grow_request != NULL)
+        reply(grow_request, ZYGOTE_REPLY_EXIT, &status, sizeof(status));
 }
 #endif /* HAS_ON_EXIT */
 
-// See-Also: https://github.com/martylamb/nailgun/blob/master/nailgun-client/ng.c
-static int grow_this_zygote(int connection_fd, int objc, void* objv[]) {
+// receive the remainder of an unframed request one number or string at a time
+static int recv_unframed_request(request_t* req) {
+    int connection_fd = req->connection_fd;
     int i;
-    int fds[3];
-    int argc;
-    char* *argv;
-    char* code_path;
     char* *env;
-    void* handle;
-    run_t run;
-    char* error;
+    char c;
 
     int num;
 #define recvNum(NAME) \
     do { \
-        if (read(connection_fd, &num, sizeof(num)) == -1) { perror(#NAME " read"); goto error; } \
+        if (recv_all(connection_fd, &num, sizeof(num)) == -1) { perror(#NAME " read"); return -1; } \
     } while (0)
 
     int buflen = BUFSIZ;
@@ -191,10 +466,388 @@ static int grow_this_zygote(int connection_fd, int objc, void* objv[]) {
             buflen = num + 1; \
             buf = (char *) realloc(buf, buflen * sizeof(char)); \
         } \
-        if (read(connection_fd, buf, num) == -1) { perror(#NAME " read"); goto error; } \
+        if (recv_all(connection_fd, buf, num) == -1) { perror(#NAME " read"); return -1; } \
         buf[num] = '\0'; \
     } while (0)
 
+    // environ
+    recvNum(envc);
+    env = req->envp = (char* *) malloc((num + 1) * sizeof(char*));
+    for (i=num; i>0; i--, env++) {
+        recvStr(environ_i); *env = strdup(buf);
+    }
+    *env = NULL;
+
+    // cwd
+    recvStr(cwd); req->cwd = strdup(buf);
+
+    // argc and argv, of which the first is the code path
+    recvNum(argc); req->argc = num;
+    if (req->argc < 1)
+        return -1;
+    req->argv = (char* *) malloc((req->argc + 1) * sizeof(char*));
+    recvStr(argv_0); req->code_path = strdup(buf);
+    req->argv[0] = req->code_path;
+    for (i=1; i<req->argc; i++) {
+        recvStr(argv_i); req->argv[i] = strdup(buf);
+    }
+    req->argv[i] = NULL;
+
+    // file descriptors
+    if (read_fd(connection_fd, &c, 1, req->fds+2) == -1) { perror("stderr read_fd"); return -1; }
+    if (read_fd(connection_fd, &c, 1, req->fds+1) == -1) { perror("stdout read_fd"); return -1; }
+    if (read_fd(connection_fd, &c, 1, req->fds+0) == -1) { perror("stdin  read_fd"); return -1; }
+
+    free(buf);
+    return 0;
+#undef recvNum
+#undef recvStr
+}
+
+// whether grown children _exit() right after run() returns
+static int fast_exit = 1;
+
+// MiB of address space grown children allocate from instead of the zygote's heap
+static int arena_size = 0;
+
+// whether to log which pages run() copies: 1 to count them, 2 to also trap
+// writes to registered regions
+static int dirty_report = 0;
+static char dirty_report_buf[1 << 16];
+
+// Priority classes of requests, which decide whose turn comes first while
+// requests wait, and how their children are scheduled
+enum {
+    PRIORITY_INTERACTIVE,
+    PRIORITY_NORMAL,
+    PRIORITY_BATCH,
+    PRIORITIES
+};
+static const char* priority_names[PRIORITIES] = { "interactive", "normal", "batch" };
+// share of the turns each client gets while requests wait
+static const int priority_weights[PRIORITIES] = { 16, 4, 1 };
+// nice increments of the children, negative ones needing CAP_SYS_NICE
+static const int priority_nice[PRIORITIES] = { -5, 0, 10 };
+
+static int priority_by_name(const char* name) {
+    int i;
+    for (i=0; i<PRIORITIES; i++)
+        if (strcmp(name, priority_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// classes of peers given by ZYGOTE_PRIORITIES, e.g., "alice=interactive
+// @builders=batch 1001=batch", checked by uid first, then by primary gid
+typedef struct {
+    int is_group;
+    unsigned int id;
+    int priority;
+} priority_rule_t;
+static priority_rule_t* priority_rules = NULL;
+static int priority_rules_len = 0;
+
+static void parse_priority_rules(const char* spec) {
+    char* copy = strdup(spec);
+    char* word, *value, *name, *end;
+    struct passwd* pw;
+    struct group* gr;
+    priority_rule_t rule;
+    for (word = strtok(copy, " \t,"); word != NULL; word = strtok(NULL, " \t,")) {
+        value = strchr(word, '=');
+        if (value == NULL || (*value++ = '\0', rule.priority = priority_by_name(value)) == -1) {
+            log("zygote: ZYGOTE_PRIORITIES: ignoring %s\n", word);
+            continue;
+        }
+        rule.is_group = word[0] == '@';
+        name = word + rule.is_group;
+        rule.id = strtoul(name, &end, 10);
+        if (*name == '\0' || *end != '\0') {
+            if (!rule.is_group && (pw = getpwnam(name)) != NULL)
+                rule.id = pw->pw_uid;
+            else if (rule.is_group && (gr = getgrnam(name)) != NULL)
+                rule.id = gr->gr_gid;
+            else {
+                log("zygote: ZYGOTE_PRIORITIES: no such %s %s\n", rule.is_group ? "group" : "user", name);
+                continue;
+            }
+        }
+        priority_rules = (priority_rule_t *) realloc(priority_rules, (priority_rules_len + 1) * sizeof(priority_rule_t));
+        priority_rules[priority_rules_len++] = rule;
+    }
+    free(copy);
+}
+
+// decide the class of a request, which may ask for a lower one than its peer
+// has, or any if it comes from the zygote's own user
+static void classify_request(request_t* req) {
+    char* opt;
+    int i, asked, priority = PRIORITY_NORMAL, by_group = -1;
+    uid_t uid = (uid_t) -1;
+    gid_t gid = (gid_t) -1;
+#ifdef __linux__
+    // struct ucred, which glibc hides without _GNU_SOURCE
+    struct { pid_t pid; uid_t uid; gid_t gid; } cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(req->connection_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        uid = cred.uid;
+        gid = cred.gid;
+    }
+#else
+    getpeereid(req->connection_fd, &uid, &gid);
+#endif
+    for (i=0; i<priority_rules_len; i++)
+        if (!priority_rules[i].is_group && priority_rules[i].id == uid)
+            break;
+        else if (priority_rules[i].is_group && priority_rules[i].id == gid && by_group == -1)
+            by_group = i;
+    if (i < priority_rules_len)
+        priority = priority_rules[i].priority;
+    else if (by_group != -1)
+        priority = priority_rules[by_group].priority;
+    opt = request_option(req, "priority");
+    if (opt != NULL && (asked = priority_by_name(opt)) != -1)
+        if (asked >= priority || uid == getuid())
+            priority = asked;
+    req->uid = uid;
+    req->priority = priority;
+}
+
+// schedule this child as its class says
+static void apply_priority(int priority) {
+    int nice;
+    if (priority_nice[priority] != 0) {
+        errno = 0;
+        nice = getpriority(PRIO_PROCESS, 0);
+        // raising it is only for the privileged, so don't complain
+        if (errno == 0 && setpriority(PRIO_PROCESS, 0, nice + priority_nice[priority]) == -1 &&
+                priority_nice[priority] > 0)
+            perror("setpriority");
+    }
+#ifdef SCHED_BATCH
+    if (priority == PRIORITY_BATCH) {
+        struct sched_param param = {0};
+        if (sched_setscheduler(0, SCHED_BATCH, &param) == -1)
+            perror("sched_setscheduler");
+    }
+#endif
+}
+
+// count the pages run() copied, telling grow if it asked, and logging them if
+// asked for every request
+static void report_dirty(request_t* req, zygote_dirty_t* dirty, int asked) {
+    size_t dirty_len;
+    char* line;
+    char* next;
+    dirty_len = zygote_dirty_end(dirty, dirty_report_buf, sizeof(dirty_report_buf));
+    if (asked)
+        reply(req, ZYGOTE_REPLY_REPORT, dirty_report_buf, dirty_len + 1);
+    if (dirty_report > 0) {
+        for (line = dirty_report_buf; *line != '\0'; line = next) {
+            if ((next = strchr(line, '\n')) != NULL)
+                *next++ = '\0';
+            else
+                next = line + strlen(line);
+            log("zygote[%d]: dirty: %s\n", getpid(), line);
+        }
+    }
+}
+
+// Fork server for fuzzers, speaking the protocol of AFL on the pipes passed by
+// grow --forkserver: a hello once, and then, for every 4 bytes the fuzzer
+// writes, a child forked with run() already loaded, whose pid and then wait
+// status go back 4 bytes each.  AFL++ passing inputs in shared memory, a
+// 32-bit length followed by the data, is told the fork server takes them
+// there, and run() finds them with zygote_input().
+#define FORKSRV_OPT_ENABLED     0x80000001
+#define FORKSRV_OPT_SHDMEM_FUZZ 0x01000000
+static unsigned char* fuzz_input = NULL;
+
+const unsigned char* zygote_input(size_t* len) {
+    if (fuzz_input == NULL)
+        return NULL;
+    *len = *(uint32_t *) fuzz_input;
+    return fuzz_input + sizeof(uint32_t);
+}
+
+static void serve_fork_server(request_t* req, run_t run, int objc, void* objv[]) {
+    int ctl_fd = req->fds[FORKSRV_CTL];
+    int st_fd = req->fds[FORKSRV_ST];
+    char* shm_id = getenv("__AFL_SHM_FUZZ_ID");
+    uint32_t msg, hello = 0;
+    unsigned long execs = 0;
+    int status, num;
+    pid_t pid;
+
+    if (shm_id != NULL) {
+        fuzz_input = (unsigned char *) shmat(atoi(shm_id), NULL, SHM_RDONLY);
+        if (fuzz_input == (void *) -1) {
+            perror("shmat");
+            fuzz_input = NULL;
+        } else
+            hello = FORKSRV_OPT_ENABLED | FORKSRV_OPT_SHDMEM_FUZZ;
+    }
+    // wait for each child ourselves
+    signal(SIGCHLD, SIG_DFL);
+    if (write(st_fd, &hello, sizeof(hello)) != sizeof(hello)) {
+        perror("fork server hello");
+        goto done;
+    }
+    // which AFL++ acknowledges with the options it takes
+    if (hello != 0 && read(ctl_fd, &msg, sizeof(msg)) != sizeof(msg))
+        goto done;
+    log("zygote[%d]: %s: serving a fuzzer%s\n", getpid(), req->code_path,
+            fuzz_input != NULL ? " with inputs in shared memory" : "");
+    while (read(ctl_fd, &msg, sizeof(msg)) == sizeof(msg)) {
+        pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            close(ctl_fd);
+            close(st_fd);
+            close(req->connection_fd);
+            num = run(objc, objv, req->argc, req->argv);
+            fflush(NULL);
+            _exit(num);
+        }
+        execs++;
+        if (write(st_fd, &pid, sizeof(pid)) != sizeof(pid) ||
+                waitpid(pid, &status, 0) == -1 ||
+                write(st_fd, &status, sizeof(status)) != sizeof(status))
+            break;
+    }
+    log("zygote[%d]: %s: fuzzer gone after %lu executions\n", getpid(), req->code_path, execs);
+done:
+    num = 0;
+    reply(req, ZYGOTE_REPLY_EXIT, &num, sizeof(num));
+    fflush(NULL);
+    _exit(num);
+}
+
+// Shards of a request, with grow --shards: a child forked for each once the
+// code is loaded, running run() on the shard zygote_shard() tells, and leaving
+// its partial result in the buffer zygote_reduction() gives, shared by them
+// all.  Once they all exit with 0, reduce() of the code, if any, combines them
+// in the process that forked them, whose exit status goes back to grow.
+#define MAX_SHARDS 4096
+#define REDUCTION_SIZE (1 << 20)
+#define MAX_REDUCTION_SIZE (1LL << 30)
+static int shard_index = 0;
+static int shard_count = 1;
+static void* reduction = NULL;
+static size_t reduction_len = 0;
+
+int zygote_shard(int* count) {
+    if (count != NULL)
+        *count = shard_count;
+    return shard_index;
+}
+
+void* zygote_reduction(size_t* len) {
+    if (len != NULL)
+        *len = reduction_len;
+    return reduction;
+}
+
+static void serve_shards(request_t* req, run_t run, int objc, void* objv[], int count, size_t len) {
+    pid_t* pids = (pid_t *) malloc(count * sizeof(pid_t));
+    void* handle;
+    reduce_t reduce;
+    int i, forked = 0, status, num = 0;
+
+    if (pids == NULL) {
+        perror("malloc");
+        num = EXIT_FAILURE;
+        goto done;
+    }
+    // untouched pages of it cost nothing
+    reduction = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reduction == MAP_FAILED) {
+        perror("mmap");
+        reduction = NULL;
+        num = EXIT_FAILURE;
+        goto done;
+    }
+    reduction_len = len;
+    shard_count = count;
+    // wait for each child ourselves
+    signal(SIGCHLD, SIG_DFL);
+    log("zygote[%d]: %s: running %d shards\n", getpid(), req->code_path, count);
+    for (forked=0; forked<count; forked++) {
+        pids[forked] = fork();
+        if (pids[forked] == -1) {
+            perror("fork");
+            num = EXIT_FAILURE;
+            break;
+        }
+        if (pids[forked] == 0) {
+            shard_index = forked;
+            close(req->connection_fd);
+            num = run(objc, objv, req->argc, req->argv);
+            fflush(NULL);
+            _exit(num);
+        }
+    }
+    // the status of the first shard failing, if any
+    for (i=0; i<forked; i++) {
+        int ret;
+        while ((ret = waitpid(pids[i], &status, 0)) == -1 && errno == EINTR);
+        if (num != 0)
+            continue;
+        if (ret == -1) {
+            perror("waitpid");
+            num = EXIT_FAILURE;
+            continue;
+        }
+        if (status == 0)
+            continue;
+        num = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        log("zygote[%d]: %s: shard %d failed with %d\n", getpid(), req->code_path, i, num);
+    }
+    if (num == 0 && (handle = dlopen(req->code_path, RTLD_NOW | RTLD_NOLOAD)) != NULL) {
+        reduce = (reduce_t) dlsym(handle, "reduce");
+        if (reduce != NULL)
+            num = reduce(objc, objv, req->argc, req->argv);
+    }
+done:
+    reply(req, ZYGOTE_REPLY_EXIT, &num, sizeof(num));
+    fflush(NULL);
+    _exit(num);
+}
+
+// stdout and stderr of grow, while run() writes to the memory files of the
+// result kept for its request, to get a copy of them once it's done
+static int captured[2] = { -1, -1 };
+static void copy_captured(void) {
+    off_t offset;
+    int i;
+    fflush(NULL);
+    for (i=0; i<2; i++) {
+        if (captured[i] == -1)
+            continue;
+        offset = 0;
+        zygote_results_copy(i + 1, &offset, captured[i], 1);
+        close(captured[i]);
+        captured[i] = -1;
+    }
+}
+
+// See-Also: https://github.com/martylamb/nailgun/blob/master/nailgun-client/ng.c
+static int grow_this_zygote(request_t* req, run_t run, int objc, void* objv[]) {
+    int i;
+    void* handle = NULL;
+    char* error;
+    int num;
+    int pidcaps[2];
+    char* opt;
+    int dirty_level;
+    zygote_dirty_t* dirty = NULL;
+    int timing;
+    size_t reduction_len;
+    int fd;
+
     char logbuf[BUFSIZ];
 #define resetLogBuf(args...) \
     snprintf(logbuf, sizeof(logbuf), args)
@@ -204,93 +857,257 @@ static int grow_this_zygote(int connection_fd, int objc, void* objv[]) {
         snprintf(logbuf+num, sizeof(logbuf)-num, args); \
     } while (0)
 
-    // verify libzygote version
-    recvNum(version);
-    if (num != ZYGOTE_VERSION) {
-        fprintf(stderr, "zygote[%d]: FATAL: version mismatch, expected %d, but got %d\n", getpid(), ZYGOTE_VERSION, num);
-        goto error;
-    }
+    req->times[ZYGOTE_TIME_START] = now();
 
-    num = getpid();
-    if (write(connection_fd, &num, sizeof(num)) == -1) { perror("pid write"); goto error; }
+    // leave the shards to the scheduler, rather than all on the CPU picked
+    if (req->cpu != -1 && req->shards <= 0)
+        zygote_placement_pin(req->cpu);
+    apply_priority(req->priority);
+    if (zygote_cgroup_enter(req->priority) == -1)
+        log("zygote[%d]: running outside the cgroup for %s requests\n", getpid(), priority_names[req->priority]);
+
+    // keep the heap shared with the zygote untouched from here on
+    if (arena_size > 0)
+        if (zygote_arena_enable((size_t) arena_size << 20) == -1)
+            perror("zygote_arena_enable");
+
+    // tell grow who is going to run the code
+    pidcaps[0] = getpid();
+    pidcaps[1] = ZYGOTE_CAP_OPTIONS | ZYGOTE_CAP_TIMING | ZYGOTE_CAP_PIPELINE;
+    if (reply(req, ZYGOTE_REPLY_PID, pidcaps, sizeof(pidcaps)) == -1) { perror("pid write"); goto error; }
+
+    if (req->caps & ZYGOTE_CAP_UNFRAMED)
+        if (recv_unframed_request(req) == -1)
+            goto error;
 
     // replace environ
-    recvNum(envc);
-    env = environ = (char* *) malloc((num + 1) * sizeof(char*));
-    for (i=num; i>0; i--, env++) {
-        recvStr(environ_i); *env = strdup(buf);
-    }
-    *env = NULL;
+    if (req->envp != NULL)
+        environ = req->envp;
 
     // chdir to cwd
-    recvStr(cwd); chdir(buf);
-    log("zygote[%d]: cd %s\n", getpid(), buf);
-
-    // get argc
-    recvNum(argc); argc = num;
-    argv = (char* *) malloc(argc * sizeof(char*));
-    // get code_path
-    recvStr(argv_0); code_path = argv[0] = strdup(buf);
-    resetLogBuf("zygote[%d]: %s: run( %s; ", getpid(), code_path, objvStr);
-    // get argv
-    for (i=1; i<argc; i++) {
-        recvStr(argv_i); argv[i] = strdup(buf);
-        appendLogBuf("%s ", argv[i]);
+    if (req->cwd != NULL) {
+        chdir(req->cwd);
+        log("zygote[%d]: cd %s\n", getpid(), req->cwd);
     }
+
+    resetLogBuf("zygote[%d]: %s: run( %s; ", getpid(), req->code_path, objvStr);
+    for (i=1; i<req->argc; i++)
+        appendLogBuf("%s ", req->argv[i]);
     appendLogBuf(");\n");
     log("%s", logbuf);
 
-    // dynamically load the code
-    handle = dlopen(code_path, DLOPEN_FLAGS);
-    if (handle == NULL) {
-        fprintf(stderr, "dlopen: %s\n", dlerror());
-        goto error;
+    // dynamically load the code, unless a sub-zygote already did
+    if (run == NULL) {
+        handle = dlopen(req->code_path, DLOPEN_FLAGS);
+        if (handle == NULL) {
+            fprintf(stderr, "dlopen: %s\n", dlerror());
+            goto error;
+        }
+        if (arena_size > 0)
+            zygote_arena_bind(handle);
+        dlerror();
+        run = (run_t) dlsym(handle, "run");
+        if ((error = dlerror()) != NULL) {
+            fprintf(stderr, "dlsym: %s\n", error);
+            goto error;
+        }
+        req->times[ZYGOTE_TIME_LOAD] = now();
     }
-    dlerror();
-    run = (run_t) dlsym(handle, "run");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "dlsym: %s\n", error);
-        goto error;
+
+    // keep the connection clear of stdio, which a zygote started without any
+    // leaves for it
+    if (req->connection_fd < 3) {
+        if ((fd = fcntl(req->connection_fd, F_DUPFD, 3)) == -1) {
+            perror("fcntl");
+            goto error;
+        }
+        close(req->connection_fd);
+        req->connection_fd = fd;
     }
 
-    // receive and dup file descriptors
-    if (read_fd(connection_fd, buf, 1, fds+2) == -1) { perror("stderr read_fd"); goto error; }
-    if (read_fd(connection_fd, buf, 1, fds+1) == -1) { perror("stdout read_fd"); goto error; }
-    if (read_fd(connection_fd, buf, 1, fds+0) == -1) { perror("stdin  read_fd"); goto error; }
-    for (i=0; i<3; i++)
-        if (dup2(fds[i], i) == -1) {
+    // dup file descriptors, unless received where they go already
+    for (i=0; i<3; i++) {
+        if (req->fds[i] == -1)
+            continue;
+        fd = req->fds[i];
+        if (i > 0 && req->capture[i-1] != -1) {
+            captured[i-1] = fd;
+            fd = req->capture[i-1];
+        }
+        if (fd == i)
+            continue;
+        if (dup2(fd, i) == -1) {
             perror("dup2");
             goto error;
         }
+        close(fd);
+    }
+    if (captured[0] != -1 || captured[1] != -1)
+        atexit(copy_captured);
+
+    // fork from here for every input of a fuzzer instead
+    if (request_option(req, "forkserver") != NULL && req->fds[FORKSRV_ST] != -1)
+        serve_fork_server(req, run, objc, objv);
+    // or for every shard
+    if (req->shards > 0) {
+        opt = request_option(req, "reduction");
+        reduction_len = opt != NULL && atoll(opt) > 0 ? (size_t) atoll(opt) : REDUCTION_SIZE;
+        if (reduction_len > MAX_REDUCTION_SIZE)
+            reduction_len = MAX_REDUCTION_SIZE;
+        serve_shards(req, run, objc, objv, req->shards, reduction_len);
+    }
+
+    // count the pages run() copies, if asked by grow or for every request
+    opt = request_option(req, "dirty");
+    dirty_level = opt != NULL ? atoi(opt) : 0;
+    if (dirty_level < dirty_report)
+        dirty_level = dirty_report;
+    if (dirty_level > 0)
+        dirty = zygote_dirty_begin(objc, objv, dirty_level > 1);
 
     // actually run the code
-    num = run(objc, objv, argc, argv);
+    timing = request_option(req, "timing") != NULL;
+    req->times[ZYGOTE_TIME_RUN] = now();
+    num = run(objc, objv, req->argc, req->argv);
+    req->times[ZYGOTE_TIME_RETURN] = now();
 
-    dlclose(handle);
+    if (dirty != NULL)
+        report_dirty(req, dirty, opt != NULL);
+
+    if (fast_exit || captured[0] != -1 || captured[1] != -1) {
+        // skip unwinding through main(), atexit handlers and destructors of
+        // the zygote's state, which would only dirty pages inherited from it,
+        // and copy what a memoized run wrote to grow before its exit status
+        copy_captured();
+        if (timing) {
+            req->times[ZYGOTE_TIME_EXIT] = now();
+            reply(req, ZYGOTE_REPLY_TIMING, req->times, sizeof(req->times));
+        }
+        if (reply(req, ZYGOTE_REPLY_EXIT, &num, sizeof(num)) == -1) perror("exitcode write");
+        _exit(num);
+    }
+
+    if (handle != NULL)
+        dlclose(handle);
+    if (timing) {
+        req->times[ZYGOTE_TIME_EXIT] = now();
+        reply(req, ZYGOTE_REPLY_TIMING, req->times, sizeof(req->times));
+    }
 
     // send back return code when this process exits
 #ifdef HAS_ON_EXIT
-    grow_connection_fd = connection_fd;
+    grow_request = req;
     on_exit(replyWithExitStatus, NULL);
 #else /* HAS_ON_EXIT */
-    if (write(connection_fd, &num, sizeof(num)) == -1) { perror("exitcode write"); goto error; }
+    if (reply(req, ZYGOTE_REPLY_EXIT, &num, sizeof(num)) == -1) { perror("exitcode write"); goto error; }
 #endif /* HAS_ON_EXIT */
 
-    free(buf);
     return num;
 
 error:
     num = EXIT_FAILURE;
-    write(connection_fd, &num, sizeof(num));
-    close(connection_fd);
+    reply(req, ZYGOTE_REPLY_EXIT, &num, sizeof(num));
+    close(req->connection_fd);
+    if (fast_exit) {
+        fflush(NULL);
+        _exit(num);
+    }
     exit(num);
 }
 
 
-static void reapChild(int sig) {
-    int status;
-    pid_t childpid;
-    childpid = waitpid(-1, &status, 0);
+// Connections of children asked for timing=1, kept open by whoever reaps them
+// to send the last timestamp and the resource usage
+typedef struct {
+    pid_t pid;
+    int id;
+    int connection_fd;
+} watcher_t;
+static watcher_t* watchers = NULL;
+static int watchers_len = 0;
+static int watchers_cap = 0;
+
+// keep the connection of the request to be served by the child, if asked to
+static void watch_request(pid_t pid, request_t* req) {
+    int fd;
+    if (req->caps & ZYGOTE_CAP_UNFRAMED || request_option(req, "timing") == NULL)
+        return;
+    if ((fd = dup(req->connection_fd)) == -1)
+        return;
+    if (watchers_len == watchers_cap) {
+        watchers_cap = watchers_cap * 2 + 4;
+        watchers = (watcher_t *) realloc(watchers, watchers_cap * sizeof(watcher_t));
+    }
+    watchers[watchers_len].pid = pid;
+    watchers[watchers_len].id = req->id;
+    watchers[watchers_len].connection_fd = fd;
+    watchers_len++;
+}
+
+// the resource usage as sent in ZYGOTE_REPLY_RUSAGE
+static void fill_rusage(long long rusage[], const struct rusage* usage) {
+    rusage[ZYGOTE_RUSAGE_UTIME]  = usage->ru_utime.tv_sec * 1000000LL + usage->ru_utime.tv_usec;
+    rusage[ZYGOTE_RUSAGE_STIME]  = usage->ru_stime.tv_sec * 1000000LL + usage->ru_stime.tv_usec;
+    rusage[ZYGOTE_RUSAGE_MAXRSS] = usage->ru_maxrss;
+    rusage[ZYGOTE_RUSAGE_MINFLT] = usage->ru_minflt;
+    rusage[ZYGOTE_RUSAGE_MAJFLT] = usage->ru_majflt;
+    rusage[ZYGOTE_RUSAGE_NVCSW]  = usage->ru_nvcsw;
+    rusage[ZYGOTE_RUSAGE_NIVCSW] = usage->ru_nivcsw;
+}
+
+// send what a reaper would after the exit status, for a request served by a
+// process or thread that goes on, with its resource usage since before
+static void reply_usage(request_t* req, int who, const struct rusage* before) {
+    long long times[ZYGOTE_TIMES] = {0};
+    long long rusage[ZYGOTE_RUSAGES];
+    struct rusage usage;
+    if (getrusage(who, &usage) == -1)
+        return;
+    usage.ru_utime.tv_sec  -= before->ru_utime.tv_sec;
+    usage.ru_utime.tv_usec -= before->ru_utime.tv_usec;
+    usage.ru_stime.tv_sec  -= before->ru_stime.tv_sec;
+    usage.ru_stime.tv_usec -= before->ru_stime.tv_usec;
+    usage.ru_minflt -= before->ru_minflt;
+    usage.ru_majflt -= before->ru_majflt;
+    usage.ru_nvcsw  -= before->ru_nvcsw;
+    usage.ru_nivcsw -= before->ru_nivcsw;
+    fill_rusage(rusage, &usage);
+    times[ZYGOTE_TIME_REAP] = now();
+    reply(req, ZYGOTE_REPLY_TIMING, times, sizeof(times));
+    reply(req, ZYGOTE_REPLY_RUSAGE, rusage, sizeof(rusage));
+}
+
+// send what only the reaper knows to a watched child's grow, safe to call
+// from a signal handler
+static void report_reaped(pid_t pid, struct rusage* usage, long long* cgroup) {
+    long long times[ZYGOTE_TIMES] = {0};
+    long long rusage[ZYGOTE_RUSAGES];
+    int i;
+    for (i=0; i<watchers_len; i++)
+        if (watchers[i].pid == pid)
+            break;
+    if (i == watchers_len)
+        return;
+    times[ZYGOTE_TIME_REAP] = now();
+    fill_rusage(rusage, usage);
+    send_reply(watchers[i].connection_fd, watchers[i].id, ZYGOTE_REPLY_TIMING, times, sizeof(times));
+    send_reply(watchers[i].connection_fd, watchers[i].id, ZYGOTE_REPLY_RUSAGE, rusage, sizeof(rusage));
+    if (cgroup != NULL)
+        send_reply(watchers[i].connection_fd, watchers[i].id, ZYGOTE_REPLY_CGROUP,
+                cgroup, ZYGOTE_CGROUP_STATS * sizeof(long long));
+    close(watchers[i].connection_fd);
+    watchers[i] = watchers[--watchers_len];
+}
+
+// children must not hold on to connections of other requests
+static void forget_watchers(void) {
+    int i;
+    for (i=0; i<watchers_len; i++)
+        close(watchers[i].connection_fd);
+    watchers_len = 0;
+}
+
+static void logExitStatus(pid_t childpid, int status) {
     if (status != 0) {
         if (WIFEXITED(status)) {
             log("zygote[%d]: done with exit status = %d\n", childpid, WEXITSTATUS(status));
@@ -300,13 +1117,53 @@ static void reapChild(int sig) {
     }
 }
 
+static int sub_zygote_channel;
+static void report_completion(pid_t pid, int status);
+
+// signals coalesce, so reap every child that has finished
+static void reapChild(int sig) {
+    int status;
+    pid_t childpid;
+    struct rusage usage;
+    long long cgroup[ZYGOTE_CGROUP_STATS];
+    int saved_errno = errno;
+    while ((childpid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        logExitStatus(childpid, status);
+        report_reaped(childpid, &usage, zygote_cgroup_reaped(childpid, cgroup) == 0 ? cgroup : NULL);
+        if (sub_zygote_channel != -1)
+            report_completion(childpid, status);
+    }
+    errno = saved_errno;
+}
+
 static int   zygote_socket_fd = -1;
 static char* zygote_socket_path = NULL;
+
+// replicas of the zygote sharing its socket, the first being the zygote
+// itself, which supervises the others and takes them down with it
+#define MAX_REPLICAS 64
+#define REPLICA_RESPAWN_INTERVAL 1000000000LL
+typedef struct {
+    pid_t pid;          // or 0 while waiting to be respawned
+    int node;           // NUMA node it runs on, or -1
+    long long spawned;  // when it was last forked
+} replica_t;
+static replica_t replicas[MAX_REPLICAS];
+static int replicas_len = 0;
+
 static void cleanup(void) {
+    int i;
+    for (i=1; i<replicas_len; i++)
+        if (replicas[i].pid > 0)
+            kill(replicas[i].pid, SIGTERM);
+    replicas_len = 0;
     if (zygote_socket_fd != -1)
         close(zygote_socket_fd);
-    if (zygote_socket_path != NULL)
+    if (zygote_socket_path != NULL) {
         unlink(zygote_socket_path);
+        zygote_cgroup_cleanup();
+    }
+    zygote_stats_close();
 }
 
 static void cleanupBeforeExit(int sig) {
@@ -315,26 +1172,2416 @@ static void cleanupBeforeExit(int sig) {
 }
 
 
-int zygote(char* socket_path, ...) {
-    struct sockaddr_un address = {0};
-    socklen_t address_length;
-    int socket_fd;
-    va_list ap;
-    int objc, i, num;
-    void* *objv;
-    char socket_path_real[PATH_MAX];
-#ifdef __linux__
-    char argv0_orig[BUFSIZ];
-    char argv0_new[BUFSIZ];
-#endif
+// The zygote is driven by events from a single loop: connections to accept,
+// requests to receive, and children to reap.  On Linux these come from epoll
+// with SIGCHLD delivered through a signalfd, elsewhere from poll() with a
+// self-pipe written by the signal handler.
+#define EVENT(kind, fd)  (((uint64_t) (kind) << 32) | (uint32_t) (fd))
+#define EVENT_KIND(ev)   ((int) ((ev) >> 32))
+#define EVENT_FD(ev)     ((int) (uint32_t) (ev))
+enum {
+    EVENT_LISTEN = 1,
+    EVENT_SIGCHLD,
+    EVENT_CONNECTION,
+    EVENT_SUB_ZYGOTE,
+};
+#define MAX_EVENTS 64
 
-    if (strlen(socket_path) >= sizeof(address.sun_path)) {
-        perror("wait_as_zygote");
+static int events_fd = -1;
+static int sigchld_fd = -1;
+#ifdef __linux__
+static int events_init(void) {
+    sigset_t mask;
+    events_fd = epoll_create1(0);
+    if (events_fd == -1) {
+        perror("epoll_create1");
         return -1;
     }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK);
+    if (sigchld_fd == -1) {
+        perror("signalfd");
+        return -1;
+    }
+    return 0;
+}
 
-    gethostname(zygote_hostname, sizeof(zygote_hostname));
-    zygote_stderr = fdopen(dup(2), "w");
+static int events_add(int fd, uint64_t data) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = data };
+#ifdef EPOLLEXCLUSIVE
+    // wake up only one of the replicas for a connection
+    if (EVENT_KIND(data) == EVENT_LISTEN)
+        ev.events |= EPOLLEXCLUSIVE;
+#endif
+    return epoll_ctl(events_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void events_del(int fd) {
+    epoll_ctl(events_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int events_wait(uint64_t* ready, int max, int timeout) {
+    struct epoll_event evs[MAX_EVENTS];
+    int i, n;
+    n = epoll_wait(events_fd, evs, max < MAX_EVENTS ? max : MAX_EVENTS, timeout);
+    for (i=0; i<n; i++)
+        ready[i] = evs[i].data.u64;
+    return n;
+}
+
+static void events_drain_sigchld(void) {
+    struct signalfd_siginfo si;
+    while (read(sigchld_fd, &si, sizeof(si)) > 0);
+}
+
+// undo in a forked child what the zygote set up for its events
+static void events_close(void) {
+    sigset_t mask;
+    close(events_fd);
+    close(sigchld_fd);
+    events_fd = sigchld_fd = -1;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+#else /* __linux__ */
+static struct pollfd* event_fds = NULL;
+static uint64_t* event_data = NULL;
+static int event_fds_len = 0;
+static int event_fds_cap = 0;
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void notifySigchld(int sig) {
+    int saved_errno = errno;
+    write(sigchld_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+static int events_add(int fd, uint64_t data) {
+    if (event_fds_len == event_fds_cap) {
+        event_fds_cap = event_fds_cap * 2 + 16;
+        event_fds = (struct pollfd *) realloc(event_fds, event_fds_cap * sizeof(struct pollfd));
+        event_data = (uint64_t *) realloc(event_data, event_fds_cap * sizeof(uint64_t));
+    }
+    event_fds[event_fds_len].fd = fd;
+    event_fds[event_fds_len].events = POLLIN;
+    event_data[event_fds_len] = data;
+    event_fds_len++;
+    return 0;
+}
+
+static int events_init(void) {
+    if (pipe(sigchld_pipe) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    signal(SIGCHLD, notifySigchld);
+    fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+    sigchld_fd = sigchld_pipe[0];
+    return 0;
+}
+
+static void events_del(int fd) {
+    int i;
+    for (i=0; i<event_fds_len; i++)
+        if (event_fds[i].fd == fd) {
+            event_fds[i] = event_fds[--event_fds_len];
+            event_data[i] = event_data[event_fds_len];
+            break;
+        }
+}
+
+static int events_wait(uint64_t* ready, int max, int timeout) {
+    int i, n;
+    n = poll(event_fds, event_fds_len, timeout);
+    if (n <= 0)
+        return n;
+    for (i=0, n=0; i<event_fds_len && n<max; i++)
+        if (event_fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            ready[n++] = event_data[i];
+    return n;
+}
+
+static void events_drain_sigchld(void) {
+    char buf[64];
+    while (read(sigchld_fd, buf, sizeof(buf)) > 0);
+}
+
+static void events_close(void) {
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    sigchld_fd = -1;
+    event_fds_len = 0;
+    signal(SIGCHLD, reapChild);
+}
+#endif /* __linux__ */
+
+// Table of live children of the zygote, by pid
+enum {
+    CHILD_GROWN = 1,    // running a request
+    CHILD_POOL,         // warm child waiting for a request
+    CHILD_SUB_ZYGOTE,   // sub-zygote with code loaded
+    CHILD_REPLICA,      // replica of the zygote sharing its socket
+    CHILD_EXECUTOR,     // executor running requests on its threads
+    CHILD_WORKER,       // worker serving requests for its code one by one
+};
+typedef struct {
+    pid_t pid;
+    int role;
+    long long dispatched;   // when a request was dispatched to it
+    long long fork_ns;      // how long it took to fork it
+    int weight;             // children it counts as against max_in_flight
+    int cpu;                // placed on, or -1
+    zygote_result_t* result;    // its run is for, if memoized
+} child_t;
+static child_t* children = NULL;
+static int children_cap = 0;
+static int children_len = 0;
+
+static child_t* find_child(pid_t pid) {
+    unsigned int i, mask = children_cap - 1;
+    if (children_cap == 0)
+        return NULL;
+    for (i = pid & mask; children[i].pid != 0; i = (i + 1) & mask)
+        if (children[i].pid == pid)
+            return &children[i];
+    return NULL;
+}
+
+static child_t* add_child(pid_t pid, int role) {
+    unsigned int i, mask;
+    child_t* old = children;
+    int old_cap = children_cap;
+    // keep the open-addressed table at most half full
+    if (2 * (children_len + 1) > children_cap) {
+        children_cap = children_cap > 0 ? 2 * children_cap : 64;
+        children = (child_t *) calloc(children_cap, sizeof(child_t));
+        children_len = 0;
+        for (i=0; i<old_cap; i++)
+            if (old[i].pid != 0)
+                *add_child(old[i].pid, old[i].role) = old[i];
+        free(old);
+    }
+    mask = children_cap - 1;
+    for (i = pid & mask; children[i].pid != 0; i = (i + 1) & mask);
+    memset(&children[i], 0, sizeof(child_t));
+    children[i].pid = pid;
+    children[i].role = role;
+    children[i].weight = 1;
+    children[i].cpu = -1;
+    children_len++;
+    return &children[i];
+}
+
+static void remove_child(child_t* child) {
+    unsigned int i, j, k, mask = children_cap - 1;
+    int stays;
+    // shift back the entries that probed past the removed one
+    i = child - children;
+    children[i].pid = 0;
+    for (j = (i + 1) & mask; children[j].pid != 0; j = (j + 1) & mask) {
+        k = children[j].pid & mask;
+        stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            children[i] = children[j];
+            children[j].pid = 0;
+            i = j;
+        }
+    }
+    children_len--;
+}
+
+// a new child starts with none of its parent's
+static void forget_children(void) {
+    if (children != NULL)
+        memset(children, 0, children_cap * sizeof(child_t));
+    children_len = 0;
+}
+
+// Number of children running a request, whether forked by the zygote or by
+// its sub-zygotes
+static int in_flight = 0;
+
+// What a sub-zygote tells the zygote about each of its children it reaped
+typedef struct {
+    pid_t pid;              // 0 if the child couldn't even be forked
+    int status;
+    long long run_ns;       // from dispatch to exit
+    long long fork_ns;      // of the fork() itself
+    int cpu;                // placed on, or -1
+    int last;               // the worker sending it takes no more requests
+} completion_t;
+
+// the channel to the zygote, in a sub-zygote
+static int sub_zygote_channel = -1;
+
+// tell the zygote a child of this sub-zygote is done, safe to call from a
+// signal handler
+static void report_completion(pid_t pid, int status) {
+    completion_t done = { pid, status, 0, 0, -1, 0 };
+    child_t* child = find_child(pid);
+    if (child != NULL) {
+        done.run_ns = now() - child->dispatched;
+        done.fork_ns = child->fork_ns;
+        done.cpu = child->cpu;
+        remove_child(child);
+    }
+    send(sub_zygote_channel, &done, sizeof(done), MSG_NOSIGNAL);
+}
+
+// Connections accepted, or pipelining more requests, whose next request has
+// not arrived whole yet, with what has arrived of it.  They are read without
+// blocking as bytes arrive, so a client trickling its request holds up no one
+// but itself, and is dropped if the whole of it hasn't arrived by a deadline.
+#define RECEIVE_TIMEOUT 5000000000LL
+typedef struct {
+    int fd;
+    long long accepted;
+    long long deadline;     // or 0 while a pipelining client sends nothing
+    int pipelined;
+    char* buf;              // what has arrived of the request
+    size_t len;
+    size_t cap;
+    int fds[ZYGOTE_MAX_FDS];    // passed along with it
+    int nfds;
+} pending_t;
+static pending_t* pending = NULL;
+static int pending_len = 0;
+static int pending_cap = 0;
+
+static void add_pending(int fd, int pipelined) {
+    pending_t* p;
+    if (pending_len == pending_cap) {
+        pending_cap = pending_cap * 2 + 16;
+        pending = (pending_t *) realloc(pending, pending_cap * sizeof(pending_t));
+    }
+    p = &pending[pending_len++];
+    p->fd = fd;
+    p->accepted = now();
+    p->deadline = pipelined ? 0 : p->accepted + RECEIVE_TIMEOUT;
+    p->pipelined = pipelined;
+    p->buf = NULL;
+    p->len = p->cap = 0;
+    p->nfds = 0;
+}
+
+static pending_t* find_pending(int fd) {
+    int i;
+    for (i=0; i<pending_len; i++)
+        if (pending[i].fd == fd)
+            return &pending[i];
+    return NULL;
+}
+
+// stop reading from the connection, closing it and what arrived on it unless
+// a request took them
+static void remove_pending(pending_t* p, int keep) {
+    int i;
+    events_del(p->fd);
+    if (!keep) {
+        close(p->fd);
+        for (i=0; i<p->nfds; i++)
+            close(p->fds[i]);
+        free(p->buf);
+    }
+    *p = pending[--pending_len];
+}
+
+// drop the connections whose request is overdue
+static void expire_pending(void) {
+    long long t = now();
+    int i;
+    for (i=pending_len-1; i>=0; i--)
+        if (pending[i].deadline != 0 && pending[i].deadline <= t) {
+            log("zygote: %s\n", "request not received in time");
+            zygote_stats_request(NULL);
+            remove_pending(&pending[i], 0);
+        }
+}
+
+// shorten the timeout of waiting for events to the earliest deadline
+static int pending_timeout(int timeout) {
+    long long t = now();
+    int i, ms;
+    for (i=0; i<pending_len; i++) {
+        if (pending[i].deadline == 0)
+            continue;
+        ms = (int) ((pending[i].deadline - t) / 1000000) + 1;
+        if (ms < 0)
+            ms = 0;
+        if (timeout == -1 || ms < timeout)
+            timeout = ms;
+    }
+    return timeout;
+}
+
+// Connections pipelining requests, not read from while the queue is full, so
+// a bulk submitter waits for its turns rather than being turned away
+static int* paused = NULL;
+static int paused_len = 0;
+static int paused_cap = 0;
+
+
+// Requests waiting for their turn, up to queue_size, while as many children
+// as allowed are running, or memory is short.  Turns are taken by weighted
+// fair queuing, self-clocked: each request is tagged with the virtual time
+// its turn would end if its client, i.e., uid and class, got its share of
+// the turns, and the earliest tag goes first.
+static int max_in_flight = 0;
+static request_t* queue = NULL;
+static int queue_size = 0;
+static int max_in_flight_total = 0;    // of all replicas together
+static int queue_size_total = 0;
+static int queue_len = 0;
+static long long queue_clock = 0;   // tag of the last request let in
+
+// the last tag of each client with requests waiting
+typedef struct {
+    uid_t uid;
+    int priority;
+    long long finish;
+} flow_t;
+static flow_t* flows = NULL;
+static int flows_len = 0;
+static int flows_cap = 0;
+#define FLOW_COST (1 << 20)
+
+// Pool of warm children forked ahead of time, each parked on its own hand-off
+// channel until the zygote passes it an accepted connection.  This takes the
+// fork(), i.e., copying the page tables of the whole loaded state, off the
+// critical path of a grow request.
+typedef struct {
+    pid_t pid;
+    int channel_fd;
+} pool_child_t;
+static pool_child_t* pool = NULL;
+static int pool_size = 0;
+static int pool_len = 0;
+
+// Cache of sub-zygotes, i.e., children that have already dlopen'ed a runnable
+// shared object and resolved its run(), so later grows of the same code can
+// fork from them without paying for relocations and static constructors.
+// Entries are keyed by the path, and validated by the file's identity and
+// modification time, or its content hash when those change.
+typedef struct {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    unsigned long long hash;
+    pid_t pid;
+    int channel_fd;
+    int in_flight;          // children running a request handed off to it
+    unsigned long last_used;
+} sub_zygote_t;
+static sub_zygote_t* code_cache = NULL;
+static int code_cache_size = 0;
+static int code_cache_len = 0;
+static unsigned long code_cache_clock = 0;
+// what a sub-zygote has loaded
+static run_t sub_zygote_run = NULL;
+
+// Channels of sub-zygotes evicted or gone, which stay open until the last of
+// their children has been reported done
+typedef struct {
+    int channel_fd;
+    int in_flight;
+} retired_t;
+static retired_t* retired = NULL;
+static int retired_len = 0;
+static int retired_cap = 0;
+
+// a sub-zygote or the executor exits once it sees no more requests coming,
+// and its requests are done
+static void retire_channel(int channel_fd, int in_flight) {
+    if (retired_len == retired_cap) {
+        retired_cap = retired_cap * 2 + 4;
+        retired = (retired_t *) realloc(retired, retired_cap * sizeof(retired_t));
+    }
+    shutdown(channel_fd, SHUT_WR);
+    retired[retired_len].channel_fd = channel_fd;
+    retired[retired_len].in_flight = in_flight;
+    retired_len++;
+}
+
+static void retire_sub_zygote(sub_zygote_t* entry) {
+    retire_channel(entry->channel_fd, entry->in_flight);
+    *entry = code_cache[--code_cache_len];
+}
+
+// The executor, a child of the zygote forked once that runs requests for
+// code defining run_thread() on its worker threads, each costing no more
+// than a hand-off.  Code stays loaded there, so the zygote remembers the
+// identity of every code it decided about, and retires the executor when a
+// code it has handed off changes.
+typedef int (*run_thread_t)(int objc, void* objv[], int argc, char* argv[], zygote_stdio_t* stdio);
+typedef struct {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int threaded;           // defines run_thread(), or -1 if unknown
+    int loaded;             // handed off to the executor
+} thread_code_t;
+#define THREAD_CODES 64
+static thread_code_t thread_codes[THREAD_CODES];
+static int thread_codes_len = 0;
+static int num_threads = 4;
+static pid_t executor_pid = 0;
+static int executor_channel = -1;
+static int executor_in_flight = 0;
+
+// Workers, children of the zygote that load the code of a request once, and
+// then serve one request after another for the same code and priority class
+// with no fork at all.  A worker recycles itself after worker_requests, or
+// once it has written to worker_dirty MiB of its own, bounding what it
+// copies from the zygote, and is retired by the zygote when its code changes.
+// With worker_reset, a worker puts its memory back after every request to a
+// snapshot taken once the code is loaded, and recycles only when it can't.
+typedef struct {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int priority;
+    pid_t pid;
+    int channel_fd;
+    int busy;               // running a request handed off to it
+    unsigned long last_used;
+} worker_t;
+static worker_t* workers = NULL;
+static int max_workers = 0;
+static int workers_len = 0;
+static unsigned long workers_clock = 0;
+static int worker_requests = 100;
+static int worker_dirty = 64;
+static int worker_reset = 0;
+
+// Results of runs of code declaring itself pure by defining zygote_pure, kept
+// in memory under a key of everything such a run may depend on, so the same
+// request is answered again without forking at all, and those arriving while
+// it's still running wait for it rather than running it too.  The zygote
+// remembers the identity of every code it decided about.  Files are told
+// apart by what stat() says of them, never read in the event loop, so one
+// changed less than RESULT_SETTLE_NS ago, which may change again without its
+// mtime telling, is run every time until it settles.
+typedef struct {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int pure;               // defines zygote_pure
+    unsigned long long hash;    // of its identity
+} pure_code_t;
+#define PURE_CODES 64
+#define RESULT_ENV_MAX 32
+#define RESULT_SETTLE_NS 2000000000LL
+static pure_code_t pure_codes[PURE_CODES];
+static int pure_codes_len = 0;
+static int result_cache_size = 0;
+static char* result_env[RESULT_ENV_MAX];    // names of variables in the key
+static int result_env_len = 0;
+static dev_t dev_null = 0;
+static request_t* waiters = NULL;           // for a result still running
+static int waiters_len = 0;
+static int waiters_cap = 0;
+
+// what the executor and workers pass to the code
+static int zygote_objc = 0;
+static void* *zygote_objv = NULL;
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+#ifdef __linux__
+static char argv0_orig[BUFSIZ];
+static char argv0_new[BUFSIZ];
+#endif
+
+// prepare a newly forked child so it doesn't do any of the zygote's jobs
+static void become_child(void) {
+    int i, j;
+#ifdef __linux__
+    prctl(PR_SET_NAME, (unsigned long) argv0_orig, 0, 0, 0);
+#endif
+    zygote_socket_fd   = -1;
+    zygote_socket_path = NULL;
+    replicas_len = 0;
+    if (executor_channel != -1)
+        close(executor_channel);
+    executor_channel = -1;
+    executor_pid = 0;
+    thread_codes_len = 0;
+    for (i=0; i<pool_len; i++)
+        close(pool[i].channel_fd);
+    pool_len = 0;
+    for (i=0; i<code_cache_len; i++)
+        close(code_cache[i].channel_fd);
+    code_cache_len = 0;
+    for (i=0; i<workers_len; i++)
+        close(workers[i].channel_fd);
+    workers_len = 0;
+    for (i=0; i<retired_len; i++)
+        close(retired[i].channel_fd);
+    retired_len = 0;
+    for (i=0; i<pending_len; i++) {
+        close(pending[i].fd);
+        for (j=0; j<pending[i].nfds; j++)
+            close(pending[i].fds[j]);
+        free(pending[i].buf);
+    }
+    pending_len = 0;
+    for (i=0; i<paused_len; i++)
+        close(paused[i]);
+    paused_len = 0;
+    for (i=0; i<queue_len; i++) {
+        request_t* waiting = &queue[i];
+        close(waiting->connection_fd);
+        for (j=0; j<ZYGOTE_REQUEST_FDS; j++)
+            if (waiting->fds[j] != -1)
+                close(waiting->fds[j]);
+    }
+    queue_len = 0;
+    for (i=0; i<waiters_len; i++) {
+        request_t* waiting = &waiters[i];
+        close(waiting->connection_fd);
+        for (j=0; j<ZYGOTE_REQUEST_FDS; j++)
+            if (waiting->fds[j] != -1)
+                close(waiting->fds[j]);
+    }
+    waiters_len = 0;
+    zygote_results_forget();
+    forget_watchers();
+    if (events_fd != -1 || sigchld_fd != -1)
+        events_close();
+    forget_children();
+    in_flight = 0;
+    zygote_stats_detach();
+}
+
+// how many bytes of a request have to arrive to tell what follows, given the
+// len bytes arrived so far, or all of them once it's whole, or -1 if it's
+// malformed
+static long request_size(char* buf, size_t len) {
+    zygote_frame_t header;
+    if (len < sizeof(header.version))
+        return sizeof(header.version);
+    memcpy(&header.version, buf, sizeof(header.version));
+    if (header.version == ZYGOTE_VERSION) {
+        if (len < sizeof(header))
+            return sizeof(header);
+        memcpy(&header, buf, sizeof(header));
+        if (header.length < 0 || header.length > ZYGOTE_FRAME_MAX)
+            return -1;
+        return sizeof(header) + header.length;
+    } else if (header.version == ZYGOTE_VERSION_LEGACY) {
+        return sizeof(header.version);
+    }
+    return -1;
+}
+
+// receive what has arrived of a request from grow, which decides where it
+// will be served, returning 1 once it's whole, 0 while more has to arrive, or
+// -1 if it never will
+static int recv_request(pending_t* p, request_t* req) {
+    zygote_frame_t header = {0};
+    zygote_section_t section;
+    int fds[ZYGOTE_MAX_FDS];
+    int nfds, i;
+    char* frame;
+    long size;
+    ssize_t n;
+
+    for (;;) {
+        size = request_size(p->buf, p->len);
+        if (size == -1) {
+            memcpy(&header.version, p->buf, sizeof(header.version));
+            if (header.version == ZYGOTE_VERSION)
+                log("zygote: %s\n", "malformed frame received");
+            else
+                log("zygote: FATAL: version mismatch, expected %d, but got %d\n", ZYGOTE_VERSION, header.version);
+            goto error;
+        }
+        if (p->len == size)
+            break;
+        if (p->cap < size) {
+            p->cap = size;
+            p->buf = (char *) realloc(p->buf, p->cap);
+        }
+        // no more than the request, the next one pipelined staying queued
+        n = recv_fds(p->fd, p->buf + p->len, size - p->len, fds, &nfds, MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0) {
+            // a pipelining client is done once it shuts down its end
+            if (p->pipelined && p->len == 0 && n == 0)
+                return -1;
+            log("zygote: %s\n", p->len == 0 ? "no request received" : "truncated frame received");
+            goto error;
+        }
+        for (i=0; i<nfds; i++)
+            if (p->nfds < ZYGOTE_MAX_FDS)
+                p->fds[p->nfds++] = fds[i];
+            else
+                close(fds[i]);
+        if (p->deadline == 0)
+            p->deadline = now() + RECEIVE_TIMEOUT;
+        p->len += n;
+    }
+
+    req->connection_fd = p->fd;
+    for (i=0; i<ZYGOTE_REQUEST_FDS; i++)
+        req->fds[i] = -1;
+    memset(req->times, 0, sizeof(req->times));
+    req->priority = PRIORITY_NORMAL;
+    req->shards = 0;
+    req->cpu = -1;
+    memcpy(&header.version, p->buf, sizeof(header.version));
+    if (header.version == ZYGOTE_VERSION) {
+        memcpy(&header, p->buf, sizeof(header));
+        frame = p->buf;
+    } else {
+        // stand in a frame with an empty code path, so it's forked as before
+        header.version = ZYGOTE_VERSION;
+        header.caps = ZYGOTE_CAP_UNFRAMED;
+        header.length = sizeof(section) + 1;
+        section.type = ZYGOTE_SECTION_CODE;
+        section.length = 1;
+        frame = (char *) malloc(sizeof(header) + header.length);
+        memcpy(frame, &header, sizeof(header));
+        memcpy(frame + sizeof(header), &section, sizeof(section));
+        frame[sizeof(header) + header.length - 1] = '\0';
+        free(p->buf);
+    }
+    // the request owns them from here on
+    p->buf = NULL;
+    p->len = p->cap = 0;
+    if (parse_request(req, frame, sizeof(header) + header.length) == -1) {
+        log("zygote: %s\n", "malformed request received");
+        free(frame);
+        goto error;
+    }
+    for (i=0; i<p->nfds && i<ZYGOTE_REQUEST_FDS; i++)
+        req->fds[i] = p->fds[i];
+    for (; i<p->nfds; i++)
+        close(p->fds[i]);
+    p->nfds = 0;
+    req->times[ZYGOTE_TIME_RECEIVE] = now();
+    return 1;
+
+error:
+    zygote_stats_request(NULL);
+    return -1;
+}
+
+// release what the zygote holds for a request once it's handed off
+static void release_request(request_t* req) {
+    int i;
+    close(req->connection_fd);
+    for (i=0; i<ZYGOTE_REQUEST_FDS; i++)
+        if (req->fds[i] != -1)
+            close(req->fds[i]);
+    for (i=0; i<2; i++)
+        if (req->capture[i] != -1)
+            close(req->capture[i]);
+    free(req->envp);
+    free(req->argv);
+    free(req->optv);
+    free(req->frame);
+    free(req->key);
+}
+
+// what the zygote knows about a request besides its frame
+typedef struct {
+    long long times[ZYGOTE_TIMES];
+    int priority;
+    int cpu;
+} handoff_t;
+
+// pass what the zygote knows of a request, its frame, the connection and its
+// file descriptors to another process
+static int handoff_request(int channel_fd, request_t* req) {
+    int fds[ZYGOTE_MAX_FDS];
+    int i, nfds = 0;
+    handoff_t handoff;
+    fds[nfds++] = req->connection_fd;
+    for (i=0; i<ZYGOTE_REQUEST_FDS && req->fds[i] != -1; i++)
+        fds[nfds++] = req->fds[i];
+    memcpy(handoff.times, req->times, sizeof(handoff.times));
+    handoff.priority = req->priority;
+    handoff.cpu = req->cpu;
+    if (send_fds(channel_fd, &handoff, sizeof(handoff), fds, nfds) == -1)
+        return -1;
+    return send_fds(channel_fd, req->frame, req->frame_len, NULL, 0);
+}
+
+// receive a request handed off by the zygote
+static int recv_handoff(int channel_fd, request_t* req) {
+    zygote_frame_t header;
+    handoff_t handoff;
+    int fds[ZYGOTE_MAX_FDS];
+    int i, nfds;
+    char* frame;
+    ssize_t n;
+
+    n = recv_fds(channel_fd, &handoff, sizeof(handoff), fds, &nfds, 0);
+    if (n <= 0 || nfds < 1)
+        return -1;
+    if ((n < sizeof(handoff) && recv_all(channel_fd, (char *) &handoff + n, sizeof(handoff) - n) == -1) ||
+            recv_all(channel_fd, &header, sizeof(header)) == -1) {
+        for (i=0; i<nfds; i++)
+            close(fds[i]);
+        return -1;
+    }
+    frame = (char *) malloc(sizeof(header) + header.length);
+    memcpy(frame, &header, sizeof(header));
+    if (recv_all(channel_fd, frame + sizeof(header), header.length) == -1 ||
+            parse_request(req, frame, sizeof(header) + header.length) == -1) {
+        free(frame);
+        for (i=0; i<nfds; i++)
+            close(fds[i]);
+        return -1;
+    }
+    req->connection_fd = fds[0];
+    for (i=0; i<ZYGOTE_REQUEST_FDS; i++)
+        req->fds[i] = i+1 < nfds ? fds[i+1] : -1;
+    memcpy(req->times, handoff.times, sizeof(handoff.times));
+    req->priority = handoff.priority;
+    req->cpu = handoff.cpu;
+    return 0;
+}
+
+// fork a warm child, which returns 1 once it is handed a request later,
+// or 0 in the zygote
+static int spawn_pool_child(request_t* req) {
+    int channel[2];
+    pid_t pid;
+
+    long long forking;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    forking = now();
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(channel[0]);
+        become_child();
+        // park until the zygote hands off a request, or goes away
+        if (recv_handoff(channel[1], req) == -1)
+            _exit(0);
+        close(channel[1]);
+        return 1;
+    }
+    close(channel[1]);
+    add_child(pid, CHILD_POOL)->fork_ns = now() - forking;
+    zygote_stats_fork(now() - forking);
+    pool[pool_len].pid = pid;
+    pool[pool_len].channel_fd = channel[0];
+    pool_len++;
+    return 0;
+}
+
+// hand off the request to the most recently forked warm child,
+// returning -1 if none was able to take it
+static int handoff_to_pool(request_t* req) {
+    while (pool_len > 0) {
+        pool_child_t* child = &pool[--pool_len];
+        int rc = handoff_request(child->channel_fd, req);
+        close(child->channel_fd);
+        if (rc == 0) {
+            child_t* c = find_child(child->pid);
+            if (c != NULL) {
+                c->role = CHILD_GROWN;
+                c->dispatched = req->times[ZYGOTE_TIME_DISPATCH];
+                c->cpu = req->cpu;
+            }
+            watch_request(child->pid, req);
+            in_flight++;
+            zygote_stats_dispatch(ZYGOTE_STATS_POOLED);
+            return 0;
+        }
+        log("zygote[%d]: warm child gone, trying another\n", child->pid);
+    }
+    return -1;
+}
+
+// FNV-1a hash of the file's content, up to the size it had
+static unsigned long long hash_file(char* path, off_t size) {
+    unsigned long long hash = 14695981039346656037ULL;
+    char buf[65536];
+    off_t offset;
+    ssize_t n, i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    // a file growing meanwhile is hashed no further
+    for (offset = 0; offset < size; offset += n) {
+        n = pread(fd, buf, size - offset < sizeof(buf) ? size - offset : sizeof(buf), offset);
+        if (n == -1 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0)
+            break;
+        for (i=0; i<n; i++) {
+            hash ^= (unsigned char) buf[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    close(fd);
+    return hash;
+}
+
+static void evict_sub_zygote(sub_zygote_t* entry) {
+    log("zygote[%d]: evicting sub-zygote for %s\n", entry->pid, entry->path);
+    retire_sub_zygote(entry);
+}
+
+// find a valid sub-zygote for the code, or make room for a new one
+static sub_zygote_t* lookup_sub_zygote(char* code_path, struct stat* st, unsigned long long* hash) {
+    sub_zygote_t* entry;
+    sub_zygote_t* lru;
+    int i;
+
+    *hash = 0;
+    for (i=0; i<code_cache_len; i++) {
+        entry = &code_cache[i];
+        if (strcmp(entry->path, code_path) != 0)
+            continue;
+        if (entry->dev == st->st_dev && entry->ino == st->st_ino &&
+                entry->size == st->st_size &&
+                entry->mtime.tv_sec  == st->st_mtim.tv_sec &&
+                entry->mtime.tv_nsec == st->st_mtim.tv_nsec)
+            return entry;
+        // the file was touched or replaced, so compare the content
+        *hash = hash_file(code_path, st->st_size);
+        if (entry->hash == *hash && entry->size == st->st_size &&
+                entry->dev == st->st_dev && entry->ino == st->st_ino) {
+            entry->mtime = st->st_mtim;
+            return entry;
+        }
+        evict_sub_zygote(entry);
+        break;
+    }
+    if (code_cache_len == code_cache_size) {
+        for (lru=&code_cache[0], i=1; i<code_cache_len; i++)
+            if (code_cache[i].last_used < lru->last_used)
+                lru = &code_cache[i];
+        evict_sub_zygote(lru);
+    }
+    return NULL;
+}
+
+// fork a sub-zygote that loads the code and then forks a child for every
+// request handed to it, returning 1 in such child, or 0 in the zygote
+static int spawn_sub_zygote(char* code_path, struct stat* st, unsigned long long hash, request_t* req) {
+    sub_zygote_t* entry;
+    int channel[2];
+    void* handle;
+    sigset_t sigchld, unblocked;
+    long long forking;
+    completion_t failed;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    forking = now();
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(channel[0]);
+        become_child();
+        // the zygote is handing off this very request right after
+        code_path = strdup(code_path);
+        release_request(req);
+        // load the code once, leaving any error to be reported by the children
+        handle = dlopen(code_path, DLOPEN_FLAGS);
+        if (handle != NULL && arena_size > 0)
+            zygote_arena_bind(handle);
+        if (handle != NULL)
+            sub_zygote_run = (run_t) dlsym(handle, "run");
+        log("zygote[%d]: sub-zygote loaded %s\n", getpid(), code_path);
+        sub_zygote_channel = channel[1];
+        sigemptyset(&sigchld);
+        sigaddset(&sigchld, SIGCHLD);
+        for (;;) {
+            if (recv_handoff(channel[1], req) == -1) {
+                // retired by the zygote, which still waits to hear from
+                // the children running
+                sigprocmask(SIG_BLOCK, &sigchld, &unblocked);
+                while (children_len > 0)
+                    sigsuspend(&unblocked);
+                _exit(0);
+            }
+            // reapChild must not miss a child before it's added to the table
+            sigprocmask(SIG_BLOCK, &sigchld, &unblocked);
+            forking = now();
+            pid = fork();
+            if (pid == 0) {
+                forget_watchers();
+                forget_children();
+                sub_zygote_channel = -1;
+                sigprocmask(SIG_SETMASK, &unblocked, NULL);
+                close(channel[1]);
+                return 1;
+            }
+            if (pid == -1) {
+                perror("fork");
+                memset(&failed, 0, sizeof(failed));
+                failed.status = W_EXITCODE(EXIT_FAILURE, 0);
+                failed.cpu = req->cpu;
+                send(channel[1], &failed, sizeof(failed), MSG_NOSIGNAL);
+            } else {
+                child_t* child = add_child(pid, CHILD_GROWN);
+                child->dispatched = req->times[ZYGOTE_TIME_DISPATCH];
+                child->cpu = req->cpu;
+                child->fork_ns = now() - forking;
+                watch_request(pid, req);
+            }
+            sigprocmask(SIG_SETMASK, &unblocked, NULL);
+            release_request(req);
+        }
+    }
+    close(channel[1]);
+    add_child(pid, CHILD_SUB_ZYGOTE)->fork_ns = now() - forking;
+    zygote_stats_fork(now() - forking);
+    if (events_add(channel[0], EVENT(EVENT_SUB_ZYGOTE, channel[0])) == -1)
+        perror("events_add");
+    if (hash == 0)
+        hash = hash_file(code_path, st->st_size);
+    entry = &code_cache[code_cache_len++];
+    strcpy(entry->path, code_path);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->hash = hash;
+    entry->pid = pid;
+    entry->channel_fd = channel[0];
+    entry->in_flight = 0;
+    entry->last_used = 0;
+    return 0;
+}
+
+// hand off the request to the sub-zygote for the code, spawning one if
+// necessary, returning -1 if the request should be served from here
+static int handoff_to_sub_zygote(request_t* req) {
+    sub_zygote_t* entry;
+    struct stat st;
+    unsigned long long hash;
+    int n, how = ZYGOTE_STATS_CACHED;
+
+    if (stat(req->code_path, &st) == -1)
+        return -1;
+    entry = lookup_sub_zygote(req->code_path, &st, &hash);
+    if (entry == NULL) {
+        n = spawn_sub_zygote(req->code_path, &st, hash, req);
+        if (n != 0)
+            return n;
+        entry = &code_cache[code_cache_len - 1];
+        how = ZYGOTE_STATS_LOADED;
+    }
+    entry->last_used = ++code_cache_clock;
+    if (handoff_request(entry->channel_fd, req) == 0) {
+        entry->in_flight++;
+        in_flight++;
+        zygote_stats_dispatch(how);
+        return 0;
+    }
+    evict_sub_zygote(entry);
+    return -1;
+}
+
+// Jobs of the executor, handed from its main thread to the workers
+typedef struct executor_job {
+    request_t req;
+    struct executor_job* next;
+} executor_job_t;
+static pthread_mutex_t executor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t executor_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t executor_loaded = PTHREAD_COND_INITIALIZER;
+static executor_job_t* executor_head = NULL;
+static executor_job_t* executor_tail = NULL;
+static int executor_closing = 0;
+// code loaded by the executor, never unloaded
+typedef struct {
+    char* path;
+    run_thread_t run_thread;
+    int loading;            // by a thread not holding executor_lock
+} executor_code_t;
+static executor_code_t* executor_codes = NULL;
+static int executor_codes_len = 0;
+static int executor_codes_cap = 0;
+
+// load the code once, telling grow on its stderr if it can't be, while the
+// other threads go on serving what's loaded already
+static run_thread_t load_thread_code(request_t* req) {
+    run_thread_t run_thread = NULL;
+    void* handle;
+    char* error;
+    int i;
+    pthread_mutex_lock(&executor_lock);
+    for (;;) {
+        for (i=0; i<executor_codes_len; i++)
+            if (strcmp(executor_codes[i].path, req->code_path) == 0)
+                break;
+        if (i == executor_codes_len || !executor_codes[i].loading)
+            break;
+        // by another thread, which may fail to
+        pthread_cond_wait(&executor_loaded, &executor_lock);
+    }
+    if (i < executor_codes_len) {
+        run_thread = executor_codes[i].run_thread;
+        pthread_mutex_unlock(&executor_lock);
+        return run_thread;
+    }
+    if (executor_codes_len == executor_codes_cap) {
+        executor_codes_cap = executor_codes_cap * 2 + 4;
+        executor_codes = (executor_code_t *) realloc(executor_codes,
+                executor_codes_cap * sizeof(executor_code_t));
+    }
+    executor_codes[executor_codes_len].path = strdup(req->code_path);
+    executor_codes[executor_codes_len].run_thread = NULL;
+    executor_codes[executor_codes_len].loading = 1;
+    executor_codes_len++;
+    pthread_mutex_unlock(&executor_lock);
+
+    handle = dlopen(req->code_path, DLOPEN_FLAGS);
+    if (handle == NULL) {
+        error = dlerror();
+        log("zygote[%d]: dlopen: %s\n", getpid(), error);
+        if (req->fds[2] != -1)
+            dprintf(req->fds[2], "dlopen: %s\n", error);
+    } else {
+        dlerror();
+        run_thread = (run_thread_t) dlsym(handle, "run_thread");
+        if ((error = dlerror()) != NULL) {
+            log("zygote[%d]: dlsym: %s\n", getpid(), error);
+            if (req->fds[2] != -1)
+                dprintf(req->fds[2], "dlsym: %s\n", error);
+            run_thread = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&executor_lock);
+    for (i=0; strcmp(executor_codes[i].path, req->code_path) != 0; i++);
+    if (run_thread != NULL) {
+        executor_codes[i].run_thread = run_thread;
+        executor_codes[i].loading = 0;
+        req->times[ZYGOTE_TIME_LOAD] = now();
+        log("zygote[%d]: executor loaded %s\n", getpid(), req->code_path);
+    } else {
+        // for the next request to try again
+        free(executor_codes[i].path);
+        executor_codes[i] = executor_codes[--executor_codes_len];
+    }
+    pthread_cond_broadcast(&executor_loaded);
+    pthread_mutex_unlock(&executor_lock);
+    return run_thread;
+}
+
+// serve a request on this worker thread, much like grow_this_zygote() but
+// leaving the process as it is
+static void serve_on_thread(request_t* req, int channel_fd) {
+    static const char* modes[] = { "r", "w", "w" };
+    FILE* streams[3] = { NULL, NULL, NULL };
+    zygote_stdio_t stdio;
+    run_thread_t run_thread;
+    completion_t done = { getpid(), 0, 0, 0, req->cpu, 0 };
+    struct rusage before;
+    int pidcaps[2];
+    int i, num = EXIT_FAILURE;
+    int timing = request_option(req, "timing") != NULL;
+
+    req->times[ZYGOTE_TIME_START] = now();
+    pidcaps[0] = getpid();
+    pidcaps[1] = ZYGOTE_CAP_OPTIONS | ZYGOTE_CAP_TIMING | ZYGOTE_CAP_THREAD | ZYGOTE_CAP_PIPELINE;
+    if (reply(req, ZYGOTE_REPLY_PID, pidcaps, sizeof(pidcaps)) == -1)
+        goto done;
+    log("zygote[%d]: %s: run_thread( %s; %d args )\n", getpid(), req->code_path, objvStr, req->argc - 1);
+    run_thread = load_thread_code(req);
+    if (run_thread == NULL)
+        goto done;
+
+    // hand the passed file descriptors over to streams, leaving 0, 1, 2 alone
+    for (i=0; i<3; i++) {
+        if (req->fds[i] == -1)
+            continue;
+        streams[i] = fdopen(req->fds[i], modes[i]);
+        if (streams[i] == NULL)
+            perror("fdopen");
+        else
+            req->fds[i] = -1;
+    }
+    stdio.in  = streams[0];
+    stdio.out = streams[1];
+    stdio.err = streams[2];
+    stdio.cwd = req->cwd;
+    stdio.envp = req->envp;
+
+    getrusage(RUSAGE_THREAD, &before);
+    req->times[ZYGOTE_TIME_RUN] = now();
+    num = run_thread(zygote_objc, zygote_objv, req->argc, req->argv, &stdio);
+    req->times[ZYGOTE_TIME_RETURN] = now();
+    for (i=0; i<3; i++)
+        if (streams[i] != NULL)
+            fclose(streams[i]);
+
+done:
+    if (timing) {
+        req->times[ZYGOTE_TIME_EXIT] = now();
+        reply(req, ZYGOTE_REPLY_TIMING, req->times, sizeof(req->times));
+    }
+    reply(req, ZYGOTE_REPLY_EXIT, &num, sizeof(num));
+    // there's no reaper, so send what it would after the exit status
+    if (timing && req->times[ZYGOTE_TIME_RUN] != 0)
+        reply_usage(req, RUSAGE_THREAD, &before);
+    done.status = W_EXITCODE(num & 0xff, 0);
+    done.run_ns = now() - req->times[ZYGOTE_TIME_DISPATCH];
+    release_request(req);
+    pthread_mutex_lock(&executor_lock);
+    send(channel_fd, &done, sizeof(done), MSG_NOSIGNAL);
+    pthread_mutex_unlock(&executor_lock);
+}
+
+static void* executor_thread(void* arg) {
+    int channel_fd = *(int *) arg;
+    executor_job_t* job;
+    for (;;) {
+        pthread_mutex_lock(&executor_lock);
+        while (executor_head == NULL && !executor_closing)
+            pthread_cond_wait(&executor_ready, &executor_lock);
+        job = executor_head;
+        if (job != NULL && (executor_head = job->next) == NULL)
+            executor_tail = NULL;
+        pthread_mutex_unlock(&executor_lock);
+        if (job == NULL)
+            return NULL;
+        serve_on_thread(&job->req, channel_fd);
+        free(job);
+    }
+}
+
+// the main thread of the executor queues what the zygote hands off to the
+// workers, until the zygote retires it
+static void run_executor(int channel_fd) {
+    pthread_t* threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    executor_job_t* job;
+    int i, started = 0;
+    for (i=0; i<num_threads; i++)
+        if (pthread_create(&threads[started], NULL, executor_thread, &channel_fd) == 0)
+            started++;
+    if (started == 0) {
+        fprintf(stderr, "zygote[%d]: executor has no threads\n", getpid());
+        _exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        job = (executor_job_t *) malloc(sizeof(executor_job_t));
+        if (recv_handoff(channel_fd, &job->req) == -1) {
+            free(job);
+            break;
+        }
+        job->next = NULL;
+        pthread_mutex_lock(&executor_lock);
+        if (executor_tail != NULL)
+            executor_tail->next = job;
+        else
+            executor_head = job;
+        executor_tail = job;
+        pthread_cond_signal(&executor_ready);
+        pthread_mutex_unlock(&executor_lock);
+    }
+    pthread_mutex_lock(&executor_lock);
+    executor_closing = 1;
+    pthread_cond_broadcast(&executor_ready);
+    pthread_mutex_unlock(&executor_lock);
+    for (i=0; i<started; i++)
+        pthread_join(threads[i], NULL);
+    fflush(NULL);
+    _exit(0);
+}
+
+// a new executor is spawned for the next threaded request
+static void forget_executor(void) {
+    int i;
+    executor_pid = 0;
+    executor_channel = -1;
+    executor_in_flight = 0;
+    for (i=0; i<thread_codes_len; i++)
+        thread_codes[i].loaded = 0;
+}
+
+static void retire_executor(void) {
+    if (executor_pid == 0)
+        return;
+    log("zygote[%d]: retiring the executor\n", executor_pid);
+    retire_channel(executor_channel, executor_in_flight);
+    forget_executor();
+}
+
+static int spawn_executor(request_t* req) {
+    int channel[2];
+    long long forking;
+    pid_t pid;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    forking = now();
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(channel[0]);
+        become_child();
+        // the zygote is handing off this very request right after
+        release_request(req);
+        run_executor(channel[1]);
+    }
+    close(channel[1]);
+    add_child(pid, CHILD_EXECUTOR)->fork_ns = now() - forking;
+    zygote_stats_fork(now() - forking);
+    if (events_add(channel[0], EVENT(EVENT_SUB_ZYGOTE, channel[0])) == -1)
+        perror("events_add");
+    executor_pid = pid;
+    executor_channel = channel[0];
+    executor_in_flight = 0;
+    log("zygote[%d]: executor running requests on %d threads\n", pid, num_threads);
+    return 0;
+}
+
+// whether the request should run on a thread of the executor, as the code
+// declares by defining run_thread(), or grow asks with thread=1
+static int wants_thread(request_t* req) {
+    thread_code_t* code = NULL;
+    struct stat st;
+    char* opt;
+    int i, asked;
+    if (num_threads <= 0 || !(req->caps & ZYGOTE_CAP_THREAD))
+        return 0;
+    opt = request_option(req, "thread");
+    asked = opt != NULL ? atoi(opt) : -1;
+    if (asked == 0 || stat(req->code_path, &st) == -1)
+        return 0;
+    for (i=0; i<thread_codes_len; i++)
+        if (strcmp(thread_codes[i].path, req->code_path) == 0) {
+            code = &thread_codes[i];
+            break;
+        }
+    if (code != NULL && !(code->dev == st.st_dev && code->ino == st.st_ino &&
+                code->size == st.st_size &&
+                code->mtime.tv_sec  == st.st_mtim.tv_sec &&
+                code->mtime.tv_nsec == st.st_mtim.tv_nsec)) {
+        // the executor would keep running what it loaded before
+        if (code->loaded)
+            retire_executor();
+        *code = thread_codes[--thread_codes_len];
+        code = NULL;
+    }
+    if (code == NULL) {
+        if (thread_codes_len == THREAD_CODES) {
+            // forget them all, and the executor that loaded any of them
+            retire_executor();
+            thread_codes_len = 0;
+        }
+        code = &thread_codes[thread_codes_len++];
+        strcpy(code->path, req->code_path);
+        code->dev = st.st_dev;
+        code->ino = st.st_ino;
+        code->size = st.st_size;
+        code->mtime = st.st_mtim;
+        code->threaded = zygote_elf_defines(req->code_path, "run_thread");
+        code->loaded = 0;
+    }
+    if (!(code->threaded == 1 || (code->threaded == -1 && asked > 0)))
+        return 0;
+    code->loaded = 1;
+    return 1;
+}
+
+// hand off the request to the executor, spawning it if necessary, returning
+// -1 if the request should be served by a child instead
+static int handoff_to_executor(request_t* req) {
+    if (executor_pid == 0 && spawn_executor(req) == -1)
+        return -1;
+    if (handoff_request(executor_channel, req) == 0) {
+        executor_in_flight++;
+        in_flight++;
+        zygote_stats_dispatch(ZYGOTE_STATS_THREADED);
+        return 0;
+    }
+    retire_executor();
+    return -1;
+}
+
+// serve a request in this worker, much like grow_this_zygote() but coming
+// back for the next one, returning the exit status
+static int serve_in_worker(request_t* req, run_t run) {
+    struct rusage before;
+    int pidcaps[2];
+    int i, num = EXIT_FAILURE;
+    int timing = request_option(req, "timing") != NULL;
+    char* opt;
+    int dirty_level;
+    zygote_dirty_t* dirty = NULL;
+
+    req->times[ZYGOTE_TIME_START] = now();
+    if (req->cpu != -1)
+        zygote_placement_pin(req->cpu);
+    pidcaps[0] = getpid();
+    pidcaps[1] = ZYGOTE_CAP_OPTIONS | ZYGOTE_CAP_TIMING | ZYGOTE_CAP_PIPELINE;
+    if (reply(req, ZYGOTE_REPLY_PID, pidcaps, sizeof(pidcaps)) == -1)
+        return num;
+    if (req->envp != NULL)
+        environ = req->envp;
+    if (req->cwd != NULL && chdir(req->cwd) == -1)
+        perror(req->cwd);
+    log("zygote[%d]: %s: run( %s; %d args ) in a worker\n", getpid(), req->code_path, objvStr, req->argc - 1);
+    if (run == NULL)
+        goto done;
+    for (i=0; i<3; i++) {
+        if (req->fds[i] == -1)
+            continue;
+        if (req->fds[i] != i) {
+            if (dup2(req->fds[i], i) == -1) {
+                perror("dup2");
+                goto done;
+            }
+            close(req->fds[i]);
+        }
+        req->fds[i] = -1;
+    }
+    opt = request_option(req, "dirty");
+    dirty_level = opt != NULL ? atoi(opt) : 0;
+    if (dirty_level < dirty_report)
+        dirty_level = dirty_report;
+    if (dirty_level > 0)
+        dirty = zygote_dirty_begin(zygote_objc, zygote_objv, dirty_level > 1);
+
+    getrusage(RUSAGE_SELF, &before);
+    req->times[ZYGOTE_TIME_RUN] = now();
+#ifdef HAS_ON_EXIT
+    // should run() exit() after all
+    grow_request = req;
+#endif
+    num = run(zygote_objc, zygote_objv, req->argc, req->argv);
+#ifdef HAS_ON_EXIT
+    grow_request = NULL;
+#endif
+    req->times[ZYGOTE_TIME_RETURN] = now();
+    if (dirty != NULL)
+        report_dirty(req, dirty, opt != NULL);
+    fflush(NULL);
+
+done:
+    if (timing) {
+        req->times[ZYGOTE_TIME_EXIT] = now();
+        reply(req, ZYGOTE_REPLY_TIMING, req->times, sizeof(req->times));
+    }
+    reply(req, ZYGOTE_REPLY_EXIT, &num, sizeof(num));
+    // there's no reaper, so send what it would after the exit status
+    if (timing && req->times[ZYGOTE_TIME_RUN] != 0)
+        reply_usage(req, RUSAGE_SELF, &before);
+    return num;
+}
+
+// the worker loads the code, and serves what the zygote hands off until it
+// recycles itself, or the zygote retires it
+static void run_worker(int channel_fd, char* code_path, int priority) {
+    request_t req;
+    completion_t done;
+    void* handle;
+    run_t run = NULL;
+    char* *zygote_environ = environ;
+    int saved_fds[3];
+    int cwd_fd, i, served = 0;
+    long dirtied = 0, reset = 0;
+    zygote_snapshot_t* snapshot = NULL;
+
+    apply_priority(priority);
+    if (zygote_cgroup_enter(priority) == -1)
+        log("zygote[%d]: running outside the cgroup for %s requests\n", getpid(), priority_names[priority]);
+    if (arena_size > 0)
+        if (zygote_arena_enable((size_t) arena_size << 20) == -1)
+            perror("zygote_arena_enable");
+    handle = dlopen(code_path, DLOPEN_FLAGS);
+    if (handle == NULL) {
+        log("zygote[%d]: dlopen: %s\n", getpid(), dlerror());
+    } else {
+        if (arena_size > 0)
+            zygote_arena_bind(handle);
+        run = (run_t) dlsym(handle, "run");
+        if (run == NULL)
+            log("zygote[%d]: dlsym: %s\n", getpid(), dlerror());
+        else
+            log("zygote[%d]: worker loaded %s\n", getpid(), code_path);
+    }
+    // what every request starts from
+    for (i=0; i<3; i++)
+        saved_fds[i] = dup(i);
+    cwd_fd = open(".", O_RDONLY);
+#ifdef HAS_ON_EXIT
+    on_exit(replyWithExitStatus, NULL);
+#endif
+    if (worker_reset && run != NULL)
+        if ((snapshot = zygote_snapshot_take()) == NULL)
+            log("zygote[%d]: worker recycling without a snapshot to reset to\n", getpid());
+
+    while (recv_handoff(channel_fd, &req) == 0) {
+        memset(&done, 0, sizeof(done));
+        done.pid = getpid();
+        done.cpu = req.cpu;
+        done.status = W_EXITCODE(serve_in_worker(&req, run) & 0xff, 0);
+        done.run_ns = now() - req.times[ZYGOTE_TIME_DISPATCH];
+        // leave nothing of the request behind, above all grow's fds
+        environ = zygote_environ;
+        if (cwd_fd != -1 && fchdir(cwd_fd) == -1)
+            perror("fchdir");
+        for (i=0; i<3; i++)
+            if (saved_fds[i] != -1)
+                dup2(saved_fds[i], i);
+        release_request(&req);
+        served++;
+        // back to the snapshot, or as much as has been written
+        if (snapshot != NULL)
+            reset = zygote_snapshot_restore(snapshot);
+        else if (worker_dirty > 0)
+            dirtied = zygote_dirty_private();
+        done.last = run == NULL || reset == -1 ||
+            (worker_requests > 0 && served >= worker_requests) ||
+            (snapshot == NULL && worker_dirty > 0 && dirtied >= (long) worker_dirty << 20);
+        send(channel_fd, &done, sizeof(done), MSG_NOSIGNAL);
+        if (done.last) {
+            if (reset == -1)
+                log("zygote[%d]: worker recycled after %d requests, as it can't be reset\n", getpid(),
+                        served);
+            else
+                log("zygote[%d]: worker recycled after %d requests, with %ld MiB written\n", getpid(),
+                        served, dirtied >> 20);
+            break;
+        }
+    }
+    fflush(NULL);
+    _exit(0);
+}
+
+static void retire_worker(worker_t* worker) {
+    retire_channel(worker->channel_fd, worker->busy);
+    *worker = workers[--workers_len];
+}
+
+static int spawn_worker(request_t* req, struct stat* st) {
+    worker_t* worker;
+    int channel[2];
+    long long forking;
+    char* code_path;
+    int priority;
+    pid_t pid;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    forking = now();
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(channel[0]);
+        become_child();
+        // the zygote is handing off this very request right after
+        code_path = strdup(req->code_path);
+        priority = req->priority;
+        release_request(req);
+        run_worker(channel[1], code_path, priority);
+    }
+    close(channel[1]);
+    add_child(pid, CHILD_WORKER)->fork_ns = now() - forking;
+    zygote_stats_fork(now() - forking);
+    if (events_add(channel[0], EVENT(EVENT_SUB_ZYGOTE, channel[0])) == -1)
+        perror("events_add");
+    worker = &workers[workers_len++];
+    strcpy(worker->path, req->code_path);
+    worker->dev = st->st_dev;
+    worker->ino = st->st_ino;
+    worker->size = st->st_size;
+    worker->mtime = st->st_mtim;
+    worker->priority = req->priority;
+    worker->pid = pid;
+    worker->channel_fd = channel[0];
+    worker->busy = 0;
+    return 0;
+}
+
+// hand off the request to an idle worker for its code, spawning one if
+// there's room, returning -1 if the request should be served by a child of
+// its own
+static int handoff_to_worker(request_t* req) {
+    worker_t* worker = NULL;
+    worker_t* lru = NULL;
+    struct stat st;
+    char* opt;
+    int i;
+    // grow can opt out, and old ones send the rest after the pid
+    opt = request_option(req, "worker");
+    if ((opt != NULL && atoi(opt) == 0) || req->caps & ZYGOTE_CAP_UNFRAMED ||
+            stat(req->code_path, &st) == -1)
+        return -1;
+    for (i=0; i<workers_len; i++) {
+        worker = &workers[i];
+        if (strcmp(worker->path, req->code_path) != 0)
+            continue;
+        if (!(worker->dev == st.st_dev && worker->ino == st.st_ino &&
+                    worker->size == st.st_size &&
+                    worker->mtime.tv_sec  == st.st_mtim.tv_sec &&
+                    worker->mtime.tv_nsec == st.st_mtim.tv_nsec)) {
+            // it would keep running what it loaded before
+            log("zygote[%d]: retiring the worker for %s\n", worker->pid, worker->path);
+            retire_worker(worker);
+            i--;
+        }
+    }
+    for (worker = NULL, i=0; i<workers_len; i++) {
+        if (workers[i].busy)
+            continue;
+        if (strcmp(workers[i].path, req->code_path) == 0 && workers[i].priority == req->priority) {
+            worker = &workers[i];
+            break;
+        }
+        if (lru == NULL || workers[i].last_used < lru->last_used)
+            lru = &workers[i];
+    }
+    if (worker == NULL) {
+        if (workers_len == max_workers) {
+            // all busy, so fork as usual
+            if (lru == NULL)
+                return -1;
+            log("zygote[%d]: retiring the worker for %s\n", lru->pid, lru->path);
+            retire_worker(lru);
+        }
+        if (spawn_worker(req, &st) == -1)
+            return -1;
+        worker = &workers[workers_len - 1];
+    }
+    worker->last_used = ++workers_clock;
+    if (handoff_request(worker->channel_fd, req) == 0) {
+        worker->busy = 1;
+        in_flight++;
+        zygote_stats_dispatch(ZYGOTE_STATS_WORKED);
+        return 0;
+    }
+    retire_worker(worker);
+    return -1;
+}
+
+static void enqueue_request(request_t* req);
+
+// the value of a variable in the environment of the request
+static char* request_env(request_t* req, const char* name) {
+    size_t len = strlen(name);
+    char* *env;
+    if (req->envp == NULL)
+        return getenv(name);
+    for (env = req->envp; *env != NULL; env++)
+        if (strncmp(*env, name, len) == 0 && (*env)[len] == '=')
+            return *env + len + 1;
+    return NULL;
+}
+
+// FNV-1a hash of what stat() says identifies a version of a file, or 0 if it
+// was changed too recently to tell the next change from it
+static unsigned long long hash_stat(struct stat* st, off_t offset) {
+    unsigned long long fields[8] = { st->st_dev, st->st_ino, st->st_size,
+        st->st_mtim.tv_sec, st->st_mtim.tv_nsec, st->st_ctim.tv_sec, st->st_ctim.tv_nsec, offset };
+    unsigned long long hash = 14695981039346656037ULL;
+    unsigned char* p;
+    struct timespec ts;
+    long long changed;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    changed = st->st_ctim.tv_sec > st->st_mtim.tv_sec ||
+        (st->st_ctim.tv_sec == st->st_mtim.tv_sec && st->st_ctim.tv_nsec > st->st_mtim.tv_nsec) ?
+        st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec :
+        st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    if (ts.tv_sec * 1000000000LL + ts.tv_nsec - changed < RESULT_SETTLE_NS)
+        return 0;
+    for (p = (unsigned char *) fields; p < (unsigned char *) (fields + 8); p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+// the code of the request if it declares itself pure, with the hash of its
+// identity
+static pure_code_t* pure_code(request_t* req) {
+    pure_code_t* code = NULL;
+    struct stat st;
+    int i;
+    if (strlen(req->code_path) >= PATH_MAX || stat(req->code_path, &st) == -1)
+        return NULL;
+    for (i=0; i<pure_codes_len; i++)
+        if (strcmp(pure_codes[i].path, req->code_path) == 0) {
+            code = &pure_codes[i];
+            break;
+        }
+    if (code != NULL && !(code->dev == st.st_dev && code->ino == st.st_ino &&
+                code->size == st.st_size &&
+                code->mtime.tv_sec  == st.st_mtim.tv_sec &&
+                code->mtime.tv_nsec == st.st_mtim.tv_nsec)) {
+        // results of what it was before are never looked up again
+        *code = pure_codes[--pure_codes_len];
+        code = NULL;
+    }
+    if (code == NULL) {
+        if (pure_codes_len == PURE_CODES)
+            pure_codes_len = 0;
+        code = &pure_codes[pure_codes_len++];
+        strcpy(code->path, req->code_path);
+        code->dev = st.st_dev;
+        code->ino = st.st_ino;
+        code->size = st.st_size;
+        code->mtime = st.st_mtim;
+        code->pure = zygote_elf_defines(req->code_path, "zygote_pure") == 1;
+        code->hash = 0;
+    }
+    // decided again once it settles
+    if (code->pure && code->hash == 0)
+        code->hash = hash_stat(&st, 0);
+    return code->pure && code->hash != 0 ? code : NULL;
+}
+
+// hash of the identity of stdin and its offset, which must be a regular file
+// that settled, or /dev/null or none at all, or -1 otherwise
+static int hash_stdin(int fd, unsigned long long* hash) {
+    struct stat st;
+    off_t offset;
+    *hash = 0;
+    if (fd == -1)
+        return 0;
+    if (fstat(fd, &st) == -1)
+        return -1;
+    if (S_ISCHR(st.st_mode) && st.st_rdev == dev_null)
+        return 0;
+    if (!S_ISREG(st.st_mode) || (offset = lseek(fd, 0, SEEK_CUR)) == -1 ||
+            (*hash = hash_stat(&st, offset)) == 0)
+        return -1;
+    return 0;
+}
+
+// append n bytes to the key of the request
+static void append_key(request_t* req, size_t* cap, const void* p, size_t n) {
+    if (req->key_len + n > *cap) {
+        *cap = (req->key_len + n) * 2;
+        req->key = (char *) realloc(req->key, *cap);
+    }
+    memcpy(req->key + req->key_len, p, n);
+    req->key_len += n;
+}
+
+// make the key of the request's result from everything a run of pure code
+// may depend on: the code, argv, the variables of its environment named by
+// ZYGOTE_RESULT_ENV, and what's left of stdin, unless its run can't be
+// memoized
+static void memoize_request(request_t* req) {
+    pure_code_t* code;
+    unsigned long long hash;
+    size_t cap = 0;
+    const char* value;
+    unsigned char* p;
+    int i;
+    if (result_cache_size <= 0)
+        return;
+    // the result is sent from the zygote, whose pid grow must not signal,
+    // and anything grow asks to measure needs a run
+    if ((req->caps & ZYGOTE_CAP_UNFRAMED) || !(req->caps & ZYGOTE_CAP_THREAD) ||
+            req->fds[1] == -1 || req->fds[2] == -1 ||
+            request_option(req, "timing") != NULL || request_option(req, "dirty") != NULL ||
+            request_option(req, "forkserver") != NULL || request_option(req, "shards") != NULL)
+        return;
+    if ((code = pure_code(req)) == NULL || hash_stdin(req->fds[0], &hash) == -1)
+        return;
+    req->key_len = 0;
+    append_key(req, &cap, &code->hash, sizeof(code->hash));
+    append_key(req, &cap, &hash, sizeof(hash));
+    append_key(req, &cap, &req->argc, sizeof(req->argc));
+    for (i=0; i<req->argc; i++)
+        append_key(req, &cap, req->argv[i], strlen(req->argv[i]) + 1);
+    for (i=0; i<result_env_len; i++) {
+        // unset apart from empty
+        value = request_env(req, result_env[i]);
+        append_key(req, &cap, value != NULL ? "=" : "", 1);
+        if (value != NULL)
+            append_key(req, &cap, value, strlen(value) + 1);
+    }
+    req->key_hash = 14695981039346656037ULL;
+    for (p = (unsigned char *) req->key; p < (unsigned char *) req->key + req->key_len; p++) {
+        req->key_hash ^= *p;
+        req->key_hash *= 1099511628211ULL;
+    }
+}
+
+// answer the request with a result that's done, leaving what grow's stdout
+// and stderr don't take right away to a child forked just for copying it
+static void serve_result(request_t* req, zygote_result_t* r) {
+    int pidcaps[2] = { getpid(),
+        ZYGOTE_CAP_OPTIONS | ZYGOTE_CAP_TIMING | ZYGOTE_CAP_THREAD | ZYGOTE_CAP_PIPELINE };
+    int fds[2] = { req->fds[1], req->fds[2] };
+    off_t offsets[2] = { 0, 0 };
+    int status = zygote_results_status(r);
+    pid_t pid;
+    reply(req, ZYGOTE_REPLY_PID, pidcaps, sizeof(pidcaps));
+    if (zygote_results_replay(r, fds, offsets, 0) == 1) {
+        pid = fork();
+        if (pid == 0) {
+            // the result outlives the zygote's
+            zygote_results_detach(r);
+            become_child();
+            zygote_results_replay(r, fds, offsets, 1);
+            reply(req, ZYGOTE_REPLY_EXIT, &status, sizeof(status));
+            _exit(0);
+        }
+        if (pid == -1) {
+            perror("fork");
+            status = EXIT_FAILURE;
+        } else {
+            release_request(req);
+            return;
+        }
+    }
+    reply(req, ZYGOTE_REPLY_EXIT, &status, sizeof(status));
+    release_request(req);
+}
+
+// answer the request with the result of the same run done before, or have it
+// wait for the one still running, returning 1 if it's taken care of
+static int serve_memoized(request_t* req) {
+    zygote_result_t* r;
+    if (req->key == NULL || (r = zygote_results_find(req->key, req->key_len, req->key_hash)) == NULL)
+        return 0;
+    if (zygote_results_status(r) == -1) {
+        if (waiters_len == waiters_cap) {
+            waiters_cap = waiters_cap * 2 + 16;
+            waiters = (request_t *) realloc(waiters, waiters_cap * sizeof(request_t));
+        }
+        req->result = r;
+        waiters[waiters_len++] = *req;
+        zygote_stats_dispatch(ZYGOTE_STATS_COALESCED);
+        return 1;
+    }
+    zygote_stats_dispatch(ZYGOTE_STATS_MEMOIZED);
+    serve_result(req, r);
+    return 1;
+}
+
+// keep the result of a run whose child exited normally, answering those
+// waiting for it, or else drop it, and let them run on their own
+static void finish_result(zygote_result_t* r, int status) {
+    request_t req;
+    int i, kept = 0;
+    if (WIFEXITED(status))
+        kept = zygote_results_done(r, WEXITSTATUS(status)) == 0;
+    for (i=0; i<waiters_len; i++) {
+        if (waiters[i].result != r)
+            continue;
+        req = waiters[i];
+        waiters[i--] = waiters[--waiters_len];
+        req.result = NULL;
+        if (WIFEXITED(status))
+            serve_result(&req, r);
+        else
+            enqueue_request(&req);
+    }
+    if (kept)
+        zygote_results_trim();
+    else
+        zygote_results_drop(r);
+}
+
+// forget a child that has gone away
+static void forget_child(child_t* child, int status) {
+    int i;
+    switch (child->role) {
+        case CHILD_POOL:
+            for (i=0; i<pool_len; i++)
+                if (pool[i].pid == child->pid) {
+                    close(pool[i].channel_fd);
+                    pool[i] = pool[--pool_len];
+                    break;
+                }
+            break;
+        case CHILD_SUB_ZYGOTE:
+            // its channel is closed when drained
+            for (i=0; i<code_cache_len; i++)
+                if (code_cache[i].pid == child->pid) {
+                    retire_sub_zygote(&code_cache[i]);
+                    break;
+                }
+            break;
+        case CHILD_EXECUTOR:
+            // its channel is closed when drained, and a new one spawned when
+            // needed
+            if (executor_pid == child->pid)
+                retire_executor();
+            break;
+        case CHILD_WORKER:
+            // its channel is closed when drained
+            for (i=0; i<workers_len; i++)
+                if (workers[i].pid == child->pid) {
+                    retire_worker(&workers[i]);
+                    break;
+                }
+            break;
+        case CHILD_REPLICA:
+            // respawned from the main loop
+            for (i=1; i<replicas_len; i++)
+                if (replicas[i].pid == child->pid)
+                    replicas[i].pid = 0;
+            log("zygote: replica %d is gone, respawning it\n", child->pid);
+            break;
+        case CHILD_GROWN:
+            in_flight -= child->weight;
+            zygote_placement_done(child->cpu);
+            zygote_stats_done(now() - child->dispatched, status != 0);
+            if (child->result != NULL)
+                finish_result(child->result, status);
+            break;
+    }
+    remove_child(child);
+}
+
+// account for the children a sub-zygote reports done, and close its channel
+// when it goes away
+static void recv_completions(int channel_fd) {
+    completion_t done[16];
+    int* count = NULL;
+    worker_t* worker = NULL;
+    ssize_t n;
+    int i;
+    for (i=0; i<code_cache_len; i++)
+        if (code_cache[i].channel_fd == channel_fd)
+            count = &code_cache[i].in_flight;
+    for (i=0; i<workers_len; i++)
+        if (workers[i].channel_fd == channel_fd) {
+            worker = &workers[i];
+            count = &worker->busy;
+        }
+    if (channel_fd == executor_channel)
+        count = &executor_in_flight;
+    for (i=0; count == NULL && i<retired_len; i++)
+        if (retired[i].channel_fd == channel_fd)
+            count = &retired[i].in_flight;
+    n = recv(channel_fd, done, sizeof(done), MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n > 0 && n % sizeof(completion_t) != 0 &&
+            recv_all(channel_fd, (char *) done + n, sizeof(completion_t) - n % sizeof(completion_t)) == 0)
+        n += sizeof(completion_t) - n % sizeof(completion_t);
+    for (i=0; i < n / (ssize_t) sizeof(completion_t); i++) {
+        if (count != NULL && *count > 0)
+            (*count)--;
+        in_flight--;
+        if (done[i].fork_ns > 0)
+            zygote_stats_fork(done[i].fork_ns);
+        zygote_stats_done(done[i].run_ns, done[i].status != 0);
+        zygote_placement_done(done[i].cpu);
+        if (done[i].last && worker != NULL) {
+            retire_worker(worker);
+            worker = NULL;
+            count = NULL;
+        }
+    }
+    if (n > 0)
+        return;
+    // the sub-zygote is gone, and so are the children it didn't report
+    events_del(channel_fd);
+    if (channel_fd == executor_channel) {
+        // crashed, taking its requests with it
+        in_flight -= executor_in_flight;
+        forget_executor();
+    }
+    close(channel_fd);
+    for (i=0; i<code_cache_len; i++)
+        if (code_cache[i].channel_fd == channel_fd) {
+            in_flight -= code_cache[i].in_flight;
+            code_cache[i] = code_cache[--code_cache_len];
+            return;
+        }
+    for (i=0; i<workers_len; i++)
+        if (workers[i].channel_fd == channel_fd) {
+            in_flight -= workers[i].busy;
+            workers[i] = workers[--workers_len];
+            return;
+        }
+    for (i=0; i<retired_len; i++)
+        if (retired[i].channel_fd == channel_fd) {
+            in_flight -= retired[i].in_flight;
+            retired[i] = retired[--retired_len];
+            return;
+        }
+}
+
+// reap every child that has finished without blocking
+static void reap_children(void) {
+    int status;
+    pid_t pid;
+    child_t* child;
+    struct rusage usage;
+    long long cgroup[ZYGOTE_CGROUP_STATS];
+    int has_cgroup;
+    events_drain_sigchld();
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        logExitStatus(pid, status);
+        child = find_child(pid);
+        // only grown children and workers have leaves of their own
+        has_cgroup = child != NULL && (child->role == CHILD_GROWN || child->role == CHILD_WORKER) &&
+            zygote_cgroup_reaped(pid, cgroup) == 0;
+        report_reaped(pid, &usage, has_cgroup ? cgroup : NULL);
+        if (child != NULL)
+            forget_child(child, status);
+    }
+}
+
+// accept a batch of waiting connections, and watch for their requests
+static void accept_connections(int socket_fd) {
+    int i, connection_fd;
+    for (i=0; i<MAX_EVENTS; i++) {
+        connection_fd = accept(socket_fd, NULL, NULL);
+        if (connection_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                perror("accept");
+            break;
+        }
+        if (events_add(connection_fd, EVENT(EVENT_CONNECTION, connection_fd)) == -1) {
+            perror("events_add");
+            close(connection_fd);
+            continue;
+        }
+        add_pending(connection_fd, 0);
+    }
+}
+
+// read the next request pipelined on the connection once there's room for
+// it, answering this one on a descriptor of its own
+static void keep_connection(request_t* req, int connection_fd) {
+    int fd = dup(connection_fd);
+    if (fd == -1) {
+        // the connection ends with this request then
+        perror("dup");
+        return;
+    }
+    req->connection_fd = fd;
+    if (paused_len == paused_cap) {
+        paused_cap = paused_cap * 2 + 16;
+        paused = (int *) realloc(paused, paused_cap * sizeof(int));
+    }
+    paused[paused_len++] = connection_fd;
+}
+
+static void resume_connections(void) {
+    int fd;
+    while (paused_len > 0 && (queue_len == 0 || queue_len < queue_size)) {
+        fd = paused[--paused_len];
+        if (events_add(fd, EVENT(EVENT_CONNECTION, fd)) == -1) {
+            perror("events_add");
+            close(fd);
+            continue;
+        }
+        add_pending(fd, 1);
+    }
+}
+
+// thresholds of memory pressure, above which no more children start while
+// others are still running
+static int memory_pressure = 0;     // % of time stalled over the last 10s
+static int min_available = 0;       // MiB of MemAvailable
+#define MEMORY_CHECK_INTERVAL 100000000LL
+
+static int memory_short(void) {
+    static long long checked = 0;
+    static int is_short = 0;
+    long long t;
+    char line[128];
+    double avg10;
+    long available;
+    FILE* f;
+    if (memory_pressure <= 0 && min_available <= 0)
+        return 0;
+    // the kernel averages anyway, so don't read /proc for every request
+    t = now();
+    if (t - checked < MEMORY_CHECK_INTERVAL)
+        return is_short;
+    checked = t;
+    is_short = 0;
+    if (memory_pressure > 0 && (f = fopen("/proc/pressure/memory", "r")) != NULL) {
+        if (fscanf(f, "some avg10=%lf", &avg10) == 1 && avg10 >= memory_pressure)
+            is_short = 1;
+        fclose(f);
+    }
+    if (min_available > 0 && (f = fopen("/proc/meminfo", "r")) != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL)
+            if (sscanf(line, "MemAvailable: %ld kB", &available) == 1) {
+                if (available / 1024 < min_available)
+                    is_short = 1;
+                break;
+            }
+        fclose(f);
+    }
+    return is_short;
+}
+
+// whether another child may start now, which one always may when none runs
+static int admissible(request_t* req) {
+    if (in_flight <= 0)
+        return 1;
+    if (max_in_flight > 0 && in_flight + (req->shards > 0 ? req->shards : 1) > max_in_flight)
+        return 0;
+    return !memory_short();
+}
+
+// split the run into as many shards as grow asks, but no more than may run at
+// a time, which each count against
+static void count_shards(request_t* req) {
+    char* opt = request_option(req, "shards");
+    req->shards = opt != NULL ? atoi(opt) : 0;
+    if (req->shards > MAX_SHARDS)
+        req->shards = MAX_SHARDS;
+    if (max_in_flight > 0 && req->shards > max_in_flight)
+        req->shards = max_in_flight;
+    if (req->shards < 0)
+        req->shards = 0;
+}
+
+// tell grow to come back later, instead of serving the request
+static void reply_busy(request_t* req) {
+    int busy[2] = { in_flight, queue_len };
+    int status = ZYGOTE_EXIT_BUSY;
+    reply(req, ZYGOTE_REPLY_BUSY, busy, sizeof(busy));
+    reply(req, ZYGOTE_REPLY_EXIT, &status, sizeof(status));
+    release_request(req);
+}
+
+// tag the request with the end of its turn after those of its client waiting
+static void tag_request(request_t* req) {
+    flow_t* flow = NULL;
+    int i;
+    for (i=0; i<flows_len; i++) {
+        // clients caught up with have nothing waiting
+        if (flows[i].finish <= queue_clock) {
+            flows[i--] = flows[--flows_len];
+            continue;
+        }
+        if (flows[i].uid == req->uid && flows[i].priority == req->priority)
+            flow = &flows[i];
+    }
+    if (flow == NULL) {
+        if (flows_len == flows_cap) {
+            flows_cap = flows_cap * 2 + 16;
+            flows = (flow_t *) realloc(flows, flows_cap * sizeof(flow_t));
+        }
+        flow = &flows[flows_len++];
+        flow->uid = req->uid;
+        flow->priority = req->priority;
+        flow->finish = queue_clock;
+    }
+    flow->finish += FLOW_COST / priority_weights[req->priority];
+    req->finish = flow->finish;
+}
+
+// whether request a should take its turn before b
+static int takes_turn_before(request_t* a, request_t* b) {
+    if (a->finish != b->finish)
+        return a->finish < b->finish;
+    return a->times[ZYGOTE_TIME_RECEIVE] < b->times[ZYGOTE_TIME_RECEIVE];
+}
+
+// hold the request until admissible, or turn away the one whose turn would
+// come last when the queue is full
+static void enqueue_request(request_t* req) {
+    int i, last = -1;
+    tag_request(req);
+    if (queue_len == queue_size) {
+        for (i=0; i<queue_len; i++)
+            if (last == -1 || takes_turn_before(&queue[last], &queue[i]))
+                last = i;
+        log("zygote: busy with %d children and %d requests waiting\n", in_flight, queue_len);
+        zygote_stats_dispatch(ZYGOTE_STATS_BUSY);
+        if (last == -1 || takes_turn_before(&queue[last], req)) {
+            reply_busy(req);
+            return;
+        }
+        reply_busy(&queue[last]);
+        queue[last] = *req;
+    } else {
+        queue[queue_len++] = *req;
+    }
+    zygote_stats_dispatch(ZYGOTE_STATS_QUEUED);
+}
+
+// the request waiting whose turn comes first
+static request_t* next_request(void) {
+    int i, first = 0;
+    for (i=1; i<queue_len; i++)
+        if (takes_turn_before(&queue[i], &queue[first]))
+            first = i;
+    return &queue[first];
+}
+
+// take out the request whose turn comes first
+static void dequeue_request(request_t* req) {
+    int first = next_request() - queue;
+    *req = queue[first];
+    queue[first] = queue[--queue_len];
+    queue_clock = req->finish;
+}
+
+// decide who serves the request, returning 1 in the child that should grow
+// with the given run(), or 0 in the zygote
+static int dispatch_request(request_t* req, run_t* run) {
+    pid_t pid;
+    child_t* child;
+    long long forking;
+    int i;
+    *run = NULL;
+    // the same run may have started or finished while it waited
+    if (serve_memoized(req))
+        return 0;
+    req->times[ZYGOTE_TIME_DISPATCH] = now();
+    req->cpu = zygote_placement_pick();
+    if (req->cpu != -1)
+        zygote_stats_placed(zygote_placement_node(req->cpu) == zygote_placement_data_node());
+    // a run whose result is kept writes to it from a child of our own
+    if (req->key != NULL)
+        req->result = zygote_results_start(req->key, req->key_len, req->key_hash, req->capture);
+    // as are the shards of a run, counted against the limit as one each
+    if (req->result != NULL || req->shards > 0)
+        goto fork_child;
+    if (wants_thread(req) && handoff_to_executor(req) == 0) {
+        release_request(req);
+        return 0;
+    }
+    if (max_workers > 0 && handoff_to_worker(req) == 0) {
+        release_request(req);
+        return 0;
+    }
+    if (code_cache_size > 0) {
+        i = handoff_to_sub_zygote(req);
+        if (i > 0) {
+            // grow a child of the sub-zygote into a full process
+            *run = sub_zygote_run;
+            return 1;
+        }
+        if (i == 0) {
+            release_request(req);
+            return 0;
+        }
+    }
+    if (handoff_to_pool(req) == 0) {
+        release_request(req);
+        return 0;
+    }
+    // fork with copy-on-write
+fork_child:
+    forking = now();
+    pid = fork();
+    if (pid == 0) {
+        // make sure child doesn't do parent's jobs
+        become_child();
+        return 1;
+    }
+    if (pid == -1) {
+        perror("fork");
+        zygote_stats_dispatch(ZYGOTE_STATS_REJECTED);
+        zygote_placement_done(req->cpu);
+        if (req->result != NULL)
+            zygote_results_drop(req->result);
+    } else {
+        child = add_child(pid, CHILD_GROWN);
+        child->result = req->result;
+        child->cpu = req->cpu;
+        if (req->shards > 0)
+            child->weight = req->shards;
+        child->dispatched = req->times[ZYGOTE_TIME_DISPATCH];
+        child->fork_ns = now() - forking;
+        zygote_stats_fork(child->fork_ns);
+        zygote_stats_dispatch(ZYGOTE_STATS_FORKED);
+        in_flight += child->weight;
+        watch_request(pid, req);
+    }
+    release_request(req);
+    return 0;
+}
+
+// decide how many replicas of the zygote there are, and on which NUMA nodes,
+// at least one on each with numa
+static void plan_replicas(int count, int numa, int objc, void* objv[]) {
+    int nodes[MAX_REPLICAS];
+    int num_nodes = 0, i;
+    if (numa) {
+        num_nodes = zygote_placement_nodes(nodes, MAX_REPLICAS, objc, objv);
+        if (num_nodes < 2) {
+            log("zygote: not replicating on %s\n", num_nodes == 1 ? "a single NUMA node" : "this system");
+            num_nodes = 0;
+        }
+    }
+    if (count < num_nodes)
+        count = num_nodes;
+    if (count > MAX_REPLICAS)
+        count = MAX_REPLICAS;
+    if (count < 2)
+        return;
+    for (i=0; i<count; i++) {
+        replicas[i].pid = i == 0 ? getpid() : 0;
+        replicas[i].node = num_nodes > 0 ? nodes[i % num_nodes] : -1;
+        replicas[i].spawned = 0;
+    }
+    replicas_len = count;
+}
+
+// give replica i its share of the limit and the queue of the whole zygote,
+// split evenly, and at least one child at a time
+static void share_limits(int i) {
+    max_in_flight = max_in_flight_total;
+    queue_size = queue_size_total;
+    if (replicas_len < 2)
+        return;
+    if (max_in_flight > 0) {
+        max_in_flight = max_in_flight_total / replicas_len + (i < max_in_flight_total % replicas_len);
+        if (max_in_flight < 1)
+            max_in_flight = 1;
+    }
+    queue_size = queue_size_total / replicas_len + (i < queue_size_total % replicas_len);
+}
+
+// prepare a newly forked replica to accept from the socket on its own
+static void become_replica(int i, int socket_fd, pid_t zygote_pid) {
+    int node = replicas[i].node;
+    long moved;
+    // take its share while still knowing how many replicas there are
+    share_limits(i);
+    // drop everything of the zygote, but leave removing the socket to it
+    become_child();
+#ifdef __linux__
+    prctl(PR_SET_NAME, (unsigned long) argv0_new, 0, 0, 0);
+    prctl(PR_SET_PDEATHSIG, SIGTERM, 0, 0, 0);
+#endif
+    if (getppid() != zygote_pid)
+        _exit(EXIT_FAILURE);
+    if (events_init() == -1 ||
+            events_add(socket_fd, EVENT(EVENT_LISTEN, socket_fd)) == -1 ||
+            events_add(sigchld_fd, EVENT(EVENT_SIGCHLD, sigchld_fd)) == -1)
+        _exit(EXIT_FAILURE);
+    zygote_stats_replica(i);
+    if (node == -1) {
+        log("zygote[%d]: replica %d\n", getpid(), i);
+        return;
+    }
+    moved = zygote_placement_replicate(node);
+    log("zygote[%d]: replica %d on node %d, with %ld pages moved there\n", getpid(), i, node, moved);
+    if (zygote_placement_data_node() != -1)
+        zygote_stats_placement(getenv("ZYGOTE_PLACEMENT"), zygote_placement_data_node());
+}
+
+// fork the replicas that aren't running, but not the same one more than once
+// a REPLICA_RESPAWN_INTERVAL, returning 1 in a replica, or 0 in the zygote
+static int spawn_replicas(int socket_fd) {
+    pid_t pid, zygote_pid = getpid();
+    long long t = now();
+    int i;
+    for (i=1; i<replicas_len; i++) {
+        if (replicas[i].pid != 0 || (replicas[i].spawned > 0 &&
+                    t - replicas[i].spawned < REPLICA_RESPAWN_INTERVAL))
+            continue;
+        replicas[i].spawned = t;
+        pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            continue;
+        }
+        if (pid == 0) {
+            become_replica(i, socket_fd, zygote_pid);
+            return 1;
+        }
+        add_child(pid, CHILD_REPLICA);
+        replicas[i].pid = pid;
+    }
+    return 0;
+}
+
+// how long the main loop may wait before respawning a replica, at most
+static int replicas_timeout(int timeout) {
+    long long t = now();
+    int i, ms;
+    for (i=1; i<replicas_len; i++) {
+        if (replicas[i].pid != 0)
+            continue;
+        ms = (int) ((replicas[i].spawned + REPLICA_RESPAWN_INTERVAL - t) / 1000000) + 1;
+        if (ms < 0)
+            ms = 0;
+        if (timeout == -1 || ms < timeout)
+            timeout = ms;
+    }
+    return timeout;
+}
+
+int zygote(char* socket_path, ...) {
+    struct sockaddr_un address = {0};
+    int socket_fd;
+    va_list ap;
+    int objc, i, j, n, num;
+    void* *objv;
+    char socket_path_real[PATH_MAX];
+    uint64_t ready[MAX_EVENTS];
+    int refill, timeout;
+    char* opt;
+    request_t req;
+    long long accepted;
+    pending_t* waiting;
+    run_t run;
+    struct stat st;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        perror("wait_as_zygote");
+        return -1;
+    }
+
+    gethostname(zygote_hostname, sizeof(zygote_hostname));
+    zygote_stderr = fdopen(dup(2), "w");
+    // keep log lines from getting duplicated in forked children
+    if (zygote_stderr != NULL)
+        setvbuf(zygote_stderr, NULL, _IOLBF, 0);
 
     // prepare objc, objv from varargs
     objc = 0;
@@ -368,12 +3615,20 @@ int zygote(char* socket_path, ...) {
         close(socket_fd);
         return -1;
     }
-    if (listen(socket_fd, 5) != 0) {
+    if (listen(socket_fd, zygote_option("ZYGOTE_BACKLOG", SOMAXCONN)) != 0) {
         perror("listen");
         return -1;
     }
+    // accept in batches until there's no more
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
     // reap before children become zombies
     signal(SIGCHLD, reapChild);
+    if (events_init() == -1 ||
+            events_add(socket_fd, EVENT(EVENT_LISTEN, socket_fd)) == -1 ||
+            events_add(sigchld_fd, EVENT(EVENT_SIGCHLD, sigchld_fd)) == -1) {
+        close(socket_fd);
+        return -1;
+    }
     // cleanup before exiting
     zygote_socket_fd   = socket_fd;
     zygote_socket_path = socket_path;
@@ -392,24 +3647,164 @@ int zygote(char* socket_path, ...) {
     if (realpath(socket_path, socket_path_real) == NULL)
         strcpy(socket_path_real, socket_path);
     log("zygote: listening to %s\n", socket_path_real);
-    for (;;) {
-        int connection_fd = accept(socket_fd, 
-                        (struct sockaddr *) &address,
-                        &address_length);
-        if (connection_fd == -1)
+    pool_size = zygote_option("ZYGOTE_POOL_SIZE", 0);
+    if (pool_size > 0) {
+        pool = (pool_child_t *) malloc(pool_size * sizeof(pool_child_t));
+        log("zygote: keeping %d warm children\n", pool_size);
+    }
+    fast_exit = zygote_option("ZYGOTE_FAST_EXIT", 1);
+    arena_size = zygote_option("ZYGOTE_ARENA", 0);
+    dirty_report = zygote_option("ZYGOTE_DIRTY_REPORT", 0);
+    if (arena_size > 0)
+        log("zygote: children allocate from a %d MiB arena\n", arena_size);
+    code_cache_size = zygote_option("ZYGOTE_CODE_CACHE_SIZE", 0);
+    if (code_cache_size > 0) {
+        code_cache = (sub_zygote_t *) malloc(code_cache_size * sizeof(sub_zygote_t));
+        log("zygote: keeping up to %d sub-zygotes\n", code_cache_size);
+    }
+    plan_replicas(zygote_option("ZYGOTE_REPLICAS", 1), zygote_option("ZYGOTE_NUMA_REPLICAS", 0), objc, objv);
+    if (zygote_option("ZYGOTE_STATS", 1) && zygote_stats_open(socket_path, replicas_len) == 0)
+        log("zygote: publishing statistics to %s%s\n", socket_path_real, ZYGOTE_STATS_SUFFIX);
+    max_in_flight_total = zygote_option("ZYGOTE_MAX_IN_FLIGHT", 0);
+    memory_pressure = zygote_option("ZYGOTE_MEMORY_PRESSURE", 0);
+    min_available = zygote_option("ZYGOTE_MIN_AVAILABLE", 0);
+    queue_size_total = zygote_option("ZYGOTE_QUEUE_SIZE", 128);
+    if (queue_size_total < 0)
+        queue_size_total = 0;
+    share_limits(0);
+    queue = (request_t *) malloc((queue_size_total > 0 ? queue_size_total : 1) * sizeof(request_t));
+    if (max_in_flight > 0)
+        log("zygote: running up to %d children at a time%s\n", max_in_flight_total,
+                replicas_len > 1 ? ", split among the replicas" : "");
+    num_threads = zygote_option("ZYGOTE_THREADS", 4);
+    max_workers = zygote_option("ZYGOTE_WORKERS", 0);
+    worker_requests = zygote_option("ZYGOTE_WORKER_REQUESTS", 100);
+    worker_dirty = zygote_option("ZYGOTE_WORKER_DIRTY", 64);
+    worker_reset = zygote_option("ZYGOTE_WORKER_RESET", 0);
+    if (max_workers > 0) {
+        workers = (worker_t *) malloc(max_workers * sizeof(worker_t));
+        log("zygote: keeping up to %d workers, each for %d requests or %d MiB written\n",
+                max_workers, worker_requests, worker_dirty);
+    }
+    zygote_parallel_init(zygote_option("ZYGOTE_PARALLEL", 0));
+    result_cache_size = zygote_option("ZYGOTE_RESULT_CACHE", 0);
+    if (result_cache_size > 0) {
+        if (zygote_results_init((long long) result_cache_size << 20) == 0 && stat("/dev/null", &st) == 0) {
+            dev_null = st.st_rdev;
+            opt = strdup(getenv("ZYGOTE_RESULT_ENV") != NULL ? getenv("ZYGOTE_RESULT_ENV") : "LANG LC_ALL TZ");
+            for (opt = strtok(opt, " ,"); opt != NULL && result_env_len < RESULT_ENV_MAX; opt = strtok(NULL, " ,"))
+                result_env[result_env_len++] = opt;
+            log("zygote: memoizing runs of pure code in up to %d MiB\n", result_cache_size);
+        } else {
+            perror("zygote: memoizing runs");
+            result_cache_size = 0;
+        }
+    }
+    zygote_objc = objc;
+    zygote_objv = objv;
+    if (getenv("ZYGOTE_PRIORITIES") != NULL)
+        parse_priority_rules(getenv("ZYGOTE_PRIORITIES"));
+    if (getenv("ZYGOTE_PLACEMENT") != NULL &&
+            zygote_placement_init(getenv("ZYGOTE_PLACEMENT"), objc, objv) != ZYGOTE_PLACEMENT_NONE) {
+        log("zygote: placing children by %s, with the data on node %d\n",
+                getenv("ZYGOTE_PLACEMENT"), zygote_placement_data_node());
+        zygote_stats_placement(getenv("ZYGOTE_PLACEMENT"), zygote_placement_data_node());
+    }
+    if (getenv("ZYGOTE_CGROUP") != NULL) {
+        opt = getenv("ZYGOTE_CGROUP_LEAVES");
+        i = opt == NULL || strcmp(opt, "class") != 0;
+        if (zygote_cgroup_enable(getenv("ZYGOTE_CGROUP"), i, priority_names, PRIORITIES) == 0)
+            log("zygote: running children in a cgroup for each %s under %s\n", i ? "child" : "class",
+                    getenv("ZYGOTE_CGROUP"));
+    }
+    if (replicas_len > 0) {
+        log("zygote: accepting with %d replicas\n", replicas_len);
+        if (spawn_replicas(socket_fd) == 0 && replicas[0].node != -1) {
+            // this one stays with the data
+            log("zygote: replica 0 on node %d, with %ld pages moved there\n", replicas[0].node,
+                    zygote_placement_replicate(replicas[0].node));
+        }
+    }
+    for (refill = 1;;) {
+        // refill the pool only while there's nothing else to do, and look
+        // again at memory while it holds back requests waiting
+        timeout = refill && pool_len < pool_size ? 0 : queue_len > 0 ? MEMORY_CHECK_INTERVAL / 1000000 : -1;
+        timeout = replicas_timeout(timeout);
+        timeout = pending_timeout(timeout);
+        n = events_wait(ready, MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("events_wait");
             break;
-        // fork with copy-on-write
-        if (fork() == 0) {
-            // make sure child doesn't do parent's jobs
-#ifdef __linux__
-            prctl(PR_SET_NAME, (unsigned long) argv0_orig, 0, 0, 0);
-#endif
-            zygote_socket_fd   = -1;
-            zygote_socket_path = NULL;
-            // and grow into a full process
-            return grow_this_zygote(connection_fd, objc, objv);
         }
-        close(connection_fd);
+        if (n == 0 && refill && pool_len < pool_size) {
+            i = spawn_pool_child(&req);
+            if (i > 0)
+                // grow this warm child into a full process
+                return grow_this_zygote(&req, NULL, objc, objv);
+            if (i == -1)
+                // try again after something happens
+                refill = 0;
+            continue;
+        }
+        refill = 1;
+        for (j=0; j<n; j++) {
+            int fd = EVENT_FD(ready[j]);
+            switch (EVENT_KIND(ready[j])) {
+                case EVENT_LISTEN:
+                    accept_connections(fd);
+                    break;
+                case EVENT_SIGCHLD:
+                    reap_children();
+                    break;
+                case EVENT_SUB_ZYGOTE:
+                    recv_completions(fd);
+                    break;
+                case EVENT_CONNECTION:
+                    if ((waiting = find_pending(fd)) == NULL)
+                        break;
+                    i = recv_request(waiting, &req);
+                    if (i == 0)
+                        break;
+                    if (i == -1) {
+                        remove_pending(waiting, 0);
+                        break;
+                    }
+                    accepted = waiting->accepted;
+                    remove_pending(waiting, 1);
+                    if (req.caps & ZYGOTE_CAP_PIPELINE)
+                        keep_connection(&req, fd);
+                    zygote_stats_request(req.code_path);
+                    req.times[ZYGOTE_TIME_ACCEPT] = accepted;
+                    classify_request(&req);
+                    count_shards(&req);
+                    // no turn to take for a result done or still running
+                    memoize_request(&req);
+                    if (serve_memoized(&req))
+                        break;
+                    // let those waiting take their turns first
+                    if (queue_len > 0 || !admissible(&req)) {
+                        enqueue_request(&req);
+                        break;
+                    }
+                    if (dispatch_request(&req, &run))
+                        return grow_this_zygote(&req, run, objc, objv);
+                    break;
+            }
+        }
+        expire_pending();
+        // let in those waiting as children finish
+        while (queue_len > 0 && admissible(next_request())) {
+            dequeue_request(&req);
+            if (dispatch_request(&req, &run))
+                return grow_this_zygote(&req, run, objc, objv);
+        }
+        resume_connections();
+        // bring back the replicas that went away, the new one going on here
+        if (spawn_replicas(socket_fd))
+            continue;
+        zygote_stats_gauges(pool_len, code_cache_len, queue_len);
     }
     close(socket_fd);
     unlink(socket_path);